@@ -25,17 +25,35 @@
 #define __AKOctree__Octree__
 
 #include <array>
+#include <memory>
+#include <new>
+#include <type_traits>
+#include <vector>
+#include <utility>
 #include <thread>
 #include <numeric>
 #include <atomic>
 #include <mutex>
+#include <condition_variable>
+#include <queue>
+#include <deque>
+#include <functional>
+#include <algorithm>
+#include <cmath>
+#include <cassert>
+#include <limits>
+#include <cstdint>
+#include <chrono>
+#include <ostream>
 
 namespace AKOctree {
 
-    template<class LeafDataType, class NodeDataType, class Precision>
+    struct OctreeConcurrentCellPolicy;
+
+    template<class LeafDataType, class NodeDataType, class Precision, class CellPolicy>
     class Octree;
 
-    template<class LeafDataType, class NodeDataType, class Precision>
+    template<class LeafDataType, class NodeDataType, class Precision, class CellPolicy>
     class OctreeCell;
 
     template<class Precision = float>
@@ -78,370 +96,1865 @@ namespace AKOctree {
         OctreeAgentAutoAdjustExtension() {}
     };
 
+    template<class LeafDataType, class NodeDataType = LeafDataType, class Precision = float>
+    class OctreeAgentPositionExtension {
+    public:
+        virtual ~OctreeAgentPositionExtension() {}
+        virtual OctreeVec3<Precision> GetItemPosition(const LeafDataType *item) const = 0;
+    protected:
+        OctreeAgentPositionExtension() {}
+    };
+
+    // For items that lie in exactly one child, such as points. GetItemOctant returns the index of the child
+    // of the cell centered at cellCenter that holds the item, laid out as in getCenterDelta. An item on a
+    // face shared by children goes to the first of them: -x, +y and -z win ties.
+    template<class LeafDataType, class NodeDataType = LeafDataType, class Precision = float>
+    class OctreeAgentOctantExtension {
+    public:
+        virtual ~OctreeAgentOctantExtension() {}
+        virtual int GetItemOctant(const LeafDataType *item, const OctreeVec3<Precision> &cellCenter) const = 0;
+    protected:
+        OctreeAgentOctantExtension() {}
+    };
+
+    template<class LeafDataType, class NodeDataType = LeafDataType, class Precision = float>
+    class OctreeAgentRayExtension {
+    public:
+        virtual ~OctreeAgentRayExtension() {}
+        // distance is the ray parameter of the hit, in units of the direction length
+        virtual bool IsItemIntersectingRay(const LeafDataType *item,
+                                           const OctreeVec3<Precision> &origin,
+                                           const OctreeVec3<Precision> &direction,
+                                           Precision &distance) const = 0;
+    protected:
+        OctreeAgentRayExtension() {}
+    };
+
+    // Base for agents that are resolved at compile time instead of through virtual calls. Derived
+    // implements isItemOverlappingCell, and any of GetItemPosition, GetMaxValuesForAutoAdjust with
+    // GetMinValuesForAutoAdjust, or IsItemIntersectingRay it needs, with the signatures of the virtual
+    // interfaces but as plain member functions, so the tree can inline them.
+    template<class Derived, class LeafDataType, class NodeDataType = LeafDataType, class Precision = float>
+    class OctreeStaticAgent {
+    protected:
+        OctreeStaticAgent() {}
+    };
+
+    template<class LeafDataType, class Precision = float>
+    struct OctreeRayHit {
+        const LeafDataType *item;
+        Precision distance;
+    };
+
+    // Path of an item through the tree, three bits (one child index) per level, used by the bulk build
+    struct OctreeMortonKey {
+        uint64_t code;
+        unsigned int index;
+        unsigned int levels; // levels the item could be classified into, less than the code length if no child accepted it
+    };
+
     template<class LeafDataType, class NodeDataType = LeafDataType, class Precision = float>
     class OctreeNodeDataPrinter {
     public:
         virtual std::string GetDataString(NodeDataType& nodeData) const = 0;
     };
 
-    template<class LeafDataType, class NodeDataType = LeafDataType, class Precision = float>
+    template<class LeafDataType, class NodeDataType = LeafDataType, class Precision = float, class CellPolicy = OctreeConcurrentCellPolicy>
     class OctreeVisitor {
     public:
         virtual ~OctreeVisitor() {}
 
-        virtual void visitRoot(const std::shared_ptr<OctreeCell<LeafDataType, NodeDataType, Precision> > rootCell) const;
-        virtual void visitBranch(const OctreeCell<LeafDataType, NodeDataType, Precision> * const cell,
-                                 const std::shared_ptr<OctreeCell<LeafDataType, NodeDataType, Precision> > childs[8]) const;
-        virtual void visitLeaf(const OctreeCell<LeafDataType, NodeDataType, Precision> * const cell,
-                               const std::vector<const LeafDataType *> &items) const;
+        virtual void visitRoot(const std::shared_ptr<OctreeCell<LeafDataType, NodeDataType, Precision, CellPolicy> > rootCell) const;
+        virtual void visitBranch(const OctreeCell<LeafDataType, NodeDataType, Precision, CellPolicy> * const cell,
+                                 const std::shared_ptr<OctreeCell<LeafDataType, NodeDataType, Precision, CellPolicy> > childs[8]) const;
+        virtual void visitLeaf(const OctreeCell<LeafDataType, NodeDataType, Precision, CellPolicy> * const cell,
+                               const typename CellPolicy::template LeafItems<const LeafDataType *> &items) const;
 
     protected:
         OctreeVisitor() {}
-        void ContinueVisit(const std::shared_ptr<OctreeCell<LeafDataType, NodeDataType, Precision> > cell) const;
+        void ContinueVisit(const std::shared_ptr<OctreeCell<LeafDataType, NodeDataType, Precision, CellPolicy> > &cell) const;
     };
 
-    template<class LeafDataType, class NodeDataType = LeafDataType, class Precision = float>
+    template<class LeafDataType, class NodeDataType = LeafDataType, class Precision = float, class CellPolicy = OctreeConcurrentCellPolicy>
     class OctreeVisitorThreaded {
 
-        template<class L, class N, class P>
+        template<class L, class N, class P, class C>
         friend class Octree;
 
-        template<class L, class N, class P>
+        template<class L, class N, class P, class C>
         friend class OctreeCell;
 
     public:
         virtual ~OctreeVisitorThreaded() {}
-        virtual void visitPreRoot(const std::shared_ptr<OctreeCell<LeafDataType, NodeDataType, Precision> > rootCell) const {}
+        virtual void visitPreRoot(const std::shared_ptr<OctreeCell<LeafDataType, NodeDataType, Precision, CellPolicy> > rootCell) const {}
 
-        virtual void visitPreBranch(const OctreeCell<LeafDataType, NodeDataType, Precision> * cell,
-                                    const std::shared_ptr<OctreeCell<LeafDataType, NodeDataType, Precision> > childs[8],
+        virtual void visitPreBranch(const OctreeCell<LeafDataType, NodeDataType, Precision, CellPolicy> * cell,
+                                    const std::shared_ptr<OctreeCell<LeafDataType, NodeDataType, Precision, CellPolicy> > childs[8],
                                     std::array<bool, 8>& childsToProcess) const {}
 
-        virtual void visitPostRoot(const std::shared_ptr<OctreeCell<LeafDataType, NodeDataType, Precision> > rootCell) const {}
+        virtual void visitPostRoot(const std::shared_ptr<OctreeCell<LeafDataType, NodeDataType, Precision, CellPolicy> > rootCell) const {}
 
-        virtual void visitPostBranch(const OctreeCell<LeafDataType, NodeDataType, Precision> * cell,
-                                     const std::shared_ptr<OctreeCell<LeafDataType, NodeDataType, Precision> > childs[8]) const {}
+        virtual void visitPostBranch(const OctreeCell<LeafDataType, NodeDataType, Precision, CellPolicy> * cell,
+                                     const std::shared_ptr<OctreeCell<LeafDataType, NodeDataType, Precision, CellPolicy> > childs[8]) const {}
 
-        virtual void visitLeaf(const OctreeCell<LeafDataType, NodeDataType, Precision> * cell,
-                               const std::vector<const LeafDataType *> &items) const {}
+        virtual void visitLeaf(const OctreeCell<LeafDataType, NodeDataType, Precision, CellPolicy> * cell,
+                               const typename CellPolicy::template LeafItems<const LeafDataType *> &items) const {}
 
     protected:
         OctreeVisitorThreaded() {}
 
     private:
-        void visitRoot(const std::shared_ptr<OctreeCell<LeafDataType, NodeDataType, Precision> > rootCell) const;
+        void visitRoot(const std::shared_ptr<OctreeCell<LeafDataType, NodeDataType, Precision, CellPolicy> > rootCell) const;
 
-        void visitBranch(const OctreeCell<LeafDataType, NodeDataType, Precision> * cell,
-                         const std::shared_ptr<OctreeCell<LeafDataType, NodeDataType, Precision> > childs[8]) const;
+        void visitBranch(const OctreeCell<LeafDataType, NodeDataType, Precision, CellPolicy> * cell,
+                         const std::shared_ptr<OctreeCell<LeafDataType, NodeDataType, Precision, CellPolicy> > childs[8]) const;
     };
 
-    template<class LeafDataType, class NodeDataType = LeafDataType, class Precision = float>
-    class OctreeCell {
-
-        template<class L, class N, class P>
-        friend class Octree;
-
-        template<class L, class N, class P>
-        friend class OctreeVisitor;
-
-        template<class L, class N, class P>
-        friend class OctreeVisitorThreaded;
+    // Lock of a leaf that several insert threads may fill at once. It takes a single byte, so trees
+    // that are only used from one thread do not pay for a std::mutex in every cell.
+    class OctreeSpinLock {
+    public:
+        OctreeSpinLock() { flag.clear(); }
 
-        enum class OctreeCellType {
-            Leaf,
-            Branch
-        };
+        void lock() {
+            while (flag.test_and_set(std::memory_order_acquire)) {
+                std::this_thread::yield();
+            }
+        }
 
-    public:
-        OctreeCell(unsigned int          maxItemsPerCell,
-                   OctreeVec3<Precision> center,
-                   Precision             radius,
-                   unsigned int          cellIndex = 0,
-                   OctreeCellType        cellType = OctreeCellType::Leaf) : maxItemsPerCell(maxItemsPerCell),
-                                                                            center(center),
-                                                                            radius(radius),
-                                                                            cellType(cellType),
-                                                                            cellIndex(cellIndex),
-                                                                            internalCellType(cellType) {}
+        bool try_lock() { return !flag.test_and_set(std::memory_order_acquire); }
 
-        NodeDataType& getNodeData() const;
-        unsigned int getCellIndex() const { return cellIndex; }
-        Precision getRadius() const { return radius; }
-        OctreeVec3<Precision> getCellCenter() const { return center; }
+        void unlock() { flag.clear(std::memory_order_release); }
 
     private:
+        OctreeSpinLock(const OctreeSpinLock &) = delete;
+        OctreeSpinLock &operator=(const OctreeSpinLock &) = delete;
 
-        bool getItemPath(const LeafDataType *item, std::string &path) const;
-        std::string getStringRepresentation(unsigned int level) const;
-        void printTreeAndSubtreeData(unsigned int level, OctreeNodeDataPrinter<LeafDataType, NodeDataType, Precision> *printer) const;
-        bool insert(const LeafDataType *item, const OctreeAgent<LeafDataType, NodeDataType, Precision> *agent);
-        bool insertInThread(const LeafDataType *item, const OctreeAgent<LeafDataType, NodeDataType, Precision> *agent);
-        bool insertIntoLeaf(const LeafDataType *item, const OctreeAgent<LeafDataType, NodeDataType, Precision> *agent);
-        void moveCell(OctreeVec3<Precision> center, Precision radius);
-        unsigned int forceCountItems() const;
-        const std::shared_ptr<OctreeCell<LeafDataType, NodeDataType, Precision> > * getChilds() const { return childs; }
-        const std::vector<const LeafDataType *>& getData() const { return data; }
-        void visit(const OctreeVisitor<LeafDataType, NodeDataType, Precision> *visitor) const;
-        void visit(const OctreeVisitorThreaded<LeafDataType, NodeDataType, Precision>*visitor) const;
-        bool isLeaf() const { return cellType == OctreeCellType::Leaf; }
-        std::mutex& getMutex() { return nodeMutex; }
-        bool isEqual(OctreeCell<LeafDataType, NodeDataType, Precision>  const &rhs) const;
-        void makeBranch(const std::vector<const LeafDataType *> &items, const LeafDataType *item, const OctreeAgent<LeafDataType, NodeDataType, Precision> *agent);
-
-        friend bool operator==(const OctreeCell<LeafDataType, NodeDataType, Precision>  &lhs, const OctreeCell<LeafDataType, NodeDataType, Precision>  &rhs) { return lhs.isEqual(rhs); }
-        friend bool operator!=(OctreeCell<LeafDataType, NodeDataType, Precision>  const &lhs, OctreeCell<LeafDataType, NodeDataType, Precision>  const &rhs) { return !(lhs == rhs); }
-
-        const unsigned int maxItemsPerCell;
-        OctreeVec3<Precision> center = OctreeVec3<Precision>();
-        Precision radius = Precision(0);
-        OctreeCellType cellType;
-        const unsigned int cellIndex;
-        OctreeCellType internalCellType;
-        mutable NodeDataType nodeData = {};
-        std::shared_ptr<OctreeCell<LeafDataType, NodeDataType, Precision> > childs[8];
-        std::vector<const LeafDataType *> data;
-        std::mutex nodeMutex;
+        std::atomic_flag flag;
     };
 
-    template<class LeafDataType, class NodeDataType = LeafDataType, class Precision = float>
-    class Octree {
+    // Lock of the cells of trees that are never written by two threads at once, it takes no space in a cell
+    struct OctreeNoLock {
+        void lock() {}
+        bool try_lock() { return true; }
+        void unlock() {}
+    };
 
-        static_assert( std::is_arithmetic<Precision>::value, "Precision must be arithmetic!");
+    // Vector of trivial values that keeps up to InlineCapacity of them in place and only allocates
+    // beyond that. The heap pointer shares its bytes with the values kept in place.
+    template<class T, unsigned int InlineCapacity>
+    class OctreeSmallVector {
+        static_assert(std::is_trivial<T>::value, "OctreeSmallVector only holds trivial values");
+        static_assert(InlineCapacity > 0, "OctreeSmallVector needs room for at least one value");
 
     public:
-        Octree(unsigned int maxItemsPerCell,
-               unsigned int threadsNumber = 1) : Octree(maxItemsPerCell,
-                                                        OctreeVec3<Precision>(),
-                                                        Precision(10),
-                                                        threadsNumber) {}
-
-        Octree(unsigned int             maxItemsPerCell,
-               OctreeVec3<Precision>    center,
-               Precision                radius,
-               unsigned int             threadsNumber = 1);
-
-        unsigned int getMaxItemsPerCell() const {  return maxItemsPerCell; }
-        unsigned int getItemsCount() const { return itemsCount; }
-        void clear();
-        void insert(const LeafDataType *item, const OctreeAgent<LeafDataType, NodeDataType, Precision> *agent);
-        void insert(const LeafDataType *items,
-                    const unsigned int itemsCount,
-                    const OctreeAgent<LeafDataType, NodeDataType, Precision> *agentInsert,
-                    const OctreeAgentAutoAdjustExtension<LeafDataType, NodeDataType, Precision> *agentAdjust,
-                    bool autoAdjustTree = true);
+        typedef T value_type;
+        typedef T *iterator;
+        typedef const T *const_iterator;
 
-        template <class T>
-        void insert(const LeafDataType *items, const unsigned int itemsCount, const T *agent, bool autoAdjustTree);
+        OctreeSmallVector() {}
+        OctreeSmallVector(const OctreeSmallVector &items) { assign(items.begin(), items.end()); }
+        ~OctreeSmallVector() { release(); }
 
-        template <class T>
-        void insert(const LeafDataType *items, const unsigned int itemsCount, const T *agent);
-        void insert(std::vector<LeafDataType> &items,
-                    const OctreeAgent<LeafDataType, NodeDataType, Precision> *agentInsert,
-                    const OctreeAgentAutoAdjustExtension<LeafDataType, NodeDataType, Precision> *agentAdjust,
-                    bool autoAdjustTree = true);
+        OctreeSmallVector &operator=(const OctreeSmallVector &items) {
+            if (this != &items) {
+                assign(items.begin(), items.end());
+            }
+            return *this;
+        }
 
-        template <class T>
-        void insert(std::vector<LeafDataType> &items, const T *agent, bool autoAdjustTree);
+        size_t size() const { return count; }
+        bool empty() const { return count == 0; }
+        size_t capacity() const { return capacityValue; }
+        // Bytes allocated outside the vector, none while the values fit in place
+        size_t getAllocatedBytes() const { return isInPlace() ? 0 : capacityValue * sizeof(T); }
+
+        T *data() { return isInPlace() ? storage.values : storage.heap; }
+        const T *data() const { return isInPlace() ? storage.values : storage.heap; }
+        iterator begin() { return data(); }
+        iterator end() { return data() + count; }
+        const_iterator begin() const { return data(); }
+        const_iterator end() const { return data() + count; }
+        T &operator[](size_t i) { return data()[i]; }
+        const T &operator[](size_t i) const { return data()[i]; }
+        T &back() { return data()[count - 1]; }
+        const T &back() const { return data()[count - 1]; }
+
+        void push_back(const T &value) {
+            if (count == capacityValue) {
+                reserve(2 * capacityValue);
+            }
+            data()[count++] = value;
+        }
 
-        template <class T>
-        void insert(std::vector<LeafDataType> &items, const T *agent);
-        std::string getItemPath(LeafDataType *item) const;
-        std::string getStringRepresentation() const { return root->getStringRepresentation(0); }
-        void printTreeData(OctreeNodeDataPrinter<LeafDataType, NodeDataType, Precision> *printer) const {  root->printTreeAndSubtreeData(0, printer); }
-        unsigned int forceGetItemsCount() const { return root->forceCountItems();  }
-        void visit(const OctreeVisitor<LeafDataType, NodeDataType, Precision> *visitor) const;
-        void visit(const OctreeVisitorThreaded<LeafDataType, NodeDataType, Precision> *visitor) const;
-        bool operator==(const Octree<LeafDataType, NodeDataType, Precision> &rhs) { return *root == *rhs.root; }
-        bool operator!=(const Octree<LeafDataType, NodeDataType, Precision> &rhs) { return *root != *rhs.root; }
+        void pop_back() { count--; }
+        void clear() { count = 0; }
 
-    private:
-        void insertThread(const OctreeAgent<LeafDataType, NodeDataType, Precision> *agent);
+        void reserve(size_t n) {
+            if (n <= capacityValue) {
+                return;
+            }
+            T *heap = new T[n];
+            std::copy(begin(), end(), heap);
+            release();
+            storage.heap = heap;
+            capacityValue = (uint32_t)n;
+        }
 
-        void visitThread(const OctreeVisitorThreaded<LeafDataType, NodeDataType, Precision> *visitor,
-                         std::array<std::shared_ptr<OctreeCell<LeafDataType, NodeDataType, Precision> >, 8 > threadRoots,
-                         std::vector<int> toVisit) const;
+        template<class InputIt>
+        iterator insert(const_iterator position, InputIt first, InputIt last) {
+            size_t index = position - begin();
+            size_t n = (size_t)std::distance(first, last);
+            if (count + n > capacityValue) {
+                reserve(std::max<size_t>(count + n, 2 * capacityValue));
+            }
+            T *values = data();
+            std::copy_backward(values + index, values + count, values + count + n);
+            std::copy(first, last, values + index);
+            count += (uint32_t)n;
+            return values + index;
+        }
 
+        template<class InputIt>
+        void assign(InputIt first, InputIt last) {
+            clear();
+            insert(end(), first, last);
+        }
 
-        OctreeVec3<Precision> center = OctreeVec3<Precision>();
-        Precision radius = Precision(10);
+        // Values kept in place move with the storage bytes, as the heap pointer does
+        void swap(OctreeSmallVector &items) {
+            std::swap(storage, items.storage);
+            std::swap(count, items.count);
+            std::swap(capacityValue, items.capacityValue);
+        }
 
-        const unsigned int maxItemsPerCell = 1;
-        std::atomic_uint itemsCount;
+    private:
+        bool isInPlace() const { return capacityValue == InlineCapacity; }
 
-        unsigned int threadsNumber = 1;
-        std::mutex threadsMutex;
+        void release() {
+            if (!isInPlace()) {
+                delete[] storage.heap;
+            }
+            capacityValue = InlineCapacity;
+        }
 
-        std::shared_ptr<OctreeCell<LeafDataType, NodeDataType, Precision> > root;
-        std::vector<const LeafDataType *> itemsToAdd;
-        mutable std::vector<std::thread> threads;
+        union Storage {
+            T *heap;
+            T values[InlineCapacity];
+        } storage;
+        uint32_t count = 0;
+        uint32_t capacityValue = InlineCapacity;
     };
 
-    template<class P> // P=Precision
-    OctreeVec3<P>& OctreeVec3<P>::operator+=(const OctreeVec3<P>& rhs) {
-        x += rhs.x;
-        y += rhs.y;
-        z += rhs.z;
-        return *this;
-    }
+    // Bytes a leaf allocates for its items
+    template<class T>
+    size_t getAllocatedBytes(const std::vector<T> &items) { return items.capacity() * sizeof(T); }
 
-    template<class P> // P=Precision
-    OctreeVec3<P>& OctreeVec3<P>::operator-=(const OctreeVec3<P>& rhs) {
-        x -= rhs.x;
-        y -= rhs.y;
-        z -= rhs.z;
-        return *this;
-    }
+    template<class T, unsigned int InlineCapacity>
+    size_t getAllocatedBytes(const OctreeSmallVector<T, InlineCapacity> &items) { return items.getAllocatedBytes(); }
 
-    template<class P> // P=Precision
-    OctreeVec3<P> operator+(OctreeVec3<P> lhs, const OctreeVec3<P>& rhs) {
-        lhs += rhs;
-        return lhs;
-    }
+    // Stateless allocator that records the bytes of its last allocation. allocate_shared() with it
+    // lays out the same control block as make_shared(), which is what the stats need to know.
+    struct OctreeSizeProbe {
+        static size_t &lastAllocation() {
+            static thread_local size_t bytes = 0;
+            return bytes;
+        }
+    };
 
-    template<class P> // P=Precision
-    OctreeVec3<P> operator/(OctreeVec3<P> lhs, const P& rhs) {
-        lhs.x /= rhs;
-        lhs.y /= rhs;
-        lhs.z /= rhs;
-        return lhs;
-    }
+    template<class T>
+    struct OctreeSizeProbeAllocator {
+        typedef T value_type;
 
-    template<class P> // P=Precision
-    OctreeVec3<P> operator-(OctreeVec3<P> lhs, const OctreeVec3<P>& rhs) {
-        lhs -= rhs;
-        return lhs;
-    }
+        OctreeSizeProbeAllocator() {}
+        template<class U>
+        OctreeSizeProbeAllocator(const OctreeSizeProbeAllocator<U> &) {}
 
-    template<class L, class N, class P> //L=LeafDataType N=NodeDataType P=Precision
-    void OctreeVisitor<L, N, P>::visitRoot(const std::shared_ptr<OctreeCell<L, N, P> > rootCell) const {
-        ContinueVisit(rootCell);
-    }
+        T *allocate(size_t n) {
+            OctreeSizeProbe::lastAllocation() = n * sizeof(T);
+            return static_cast<T *>(::operator new(n * sizeof(T)));
+        }
+        void deallocate(T *pointer, size_t) { ::operator delete(pointer); }
+    };
 
-    template<class L, class N, class P> //L=LeafDataType N=NodeDataType P=Precision
-    void OctreeVisitor<L, N, P>::visitBranch(const OctreeCell<L, N, P> * cell,
-                                             const std::shared_ptr<OctreeCell<L, N, P> > childs[8]) const {
+    template<class T, class U>
+    bool operator==(const OctreeSizeProbeAllocator<T> &, const OctreeSizeProbeAllocator<U> &) { return true; }
+    template<class T, class U>
+    bool operator!=(const OctreeSizeProbeAllocator<T> &, const OctreeSizeProbeAllocator<U> &) { return false; }
 
-        for (int i = 0; i < 8; ++i) {
-            ContinueVisit(childs[i]);
-        }
+    // Bytes make_shared<T>() allocates besides the T itself
+    template<class T, class... Args>
+    size_t getSharedControlBytes(Args&&... args) {
+        std::allocate_shared<T>(OctreeSizeProbeAllocator<T>(), std::forward<Args>(args)...);
+        return OctreeSizeProbe::lastAllocation() - sizeof(T);
     }
 
-    template<class L, class N, class P> //L=LeafDataType N=NodeDataType P=Precision
-    void OctreeVisitor<L, N, P>::visitLeaf(const OctreeCell<L, N, P> * cell,
-                                           const std::vector<const L *> &items) const {}
+    // Cell policies, the last template parameter of Octree, of its cells and of its visitors.
+    // The default keeps a lock in every cell for the threaded insert() and concurrentInsert(),
+    // and the items of every leaf in a std::vector. Readers do not take the locks.
+    struct OctreeConcurrentCellPolicy {
+        typedef OctreeSpinLock Lock;
+        static const bool concurrentInserts = true;
+        static const bool lockedReads = false;
+        template<class T> using LeafItems = std::vector<T>;
+    };
 
-    template<class L, class N, class P> //L=LeafDataType N=NodeDataType P=Precision
-    void OctreeVisitor<L, N, P>::ContinueVisit(const std::shared_ptr<OctreeCell<L, N, P> > cell) const {
-        cell->visit(this);
-    }
+    // For trees read while other threads call concurrentInsert(): queries, raycasts and visits hold
+    // the lock of every leaf while they look at its items, so a leaf is never grown or split under them.
+    // Each leaf read costs a lock and an unlock, which is why the default policy does not do it.
+    struct OctreeConcurrentReadCellPolicy : OctreeConcurrentCellPolicy {
+        static const bool lockedReads = true;
+    };
 
-    template<class L, class N, class P> //L=LeafDataType N=NodeDataType P=Precision
-    void OctreeVisitorThreaded<L, N, P>::visitRoot(const std::shared_ptr<OctreeCell<L, N, P> > rootCell) const {
-        visitPreRoot(rootCell);
-        rootCell->visit(this);
-        visitPostRoot(rootCell);
-    }
+    // For trees that are built and then read: cells hold no lock, insert() runs on one thread whatever
+    // the threads of the tree and concurrentInsert() does not compile. bulkInsert() and visits still
+    // use every thread, since their threads never share a cell.
+    struct OctreeSingleWriterCellPolicy {
+        typedef OctreeNoLock Lock;
+        static const bool concurrentInserts = false;
+        static const bool lockedReads = false;
+        template<class T> using LeafItems = std::vector<T>;
+    };
 
-    inline std::array<bool, 8> getArrayOfChildsToProcess() {
-        std::array<bool, 8> a;
-        a.fill(true);
-        return a;
-    }
+    // Leaves keep up to InlineItems items inside the cell and only allocate beyond that, so with
+    // maxItemsPerCell <= InlineItems creating and filling a leaf never allocates. Every cell, branches
+    // included, grows by the room for InlineItems pointers. Base gives the lock of the cells.
+    template<unsigned int InlineItems, class Base = OctreeConcurrentCellPolicy>
+    struct OctreeInlineLeafCellPolicy : Base {
+        template<class T> using LeafItems = OctreeSmallVector<T, InlineItems>;
+    };
 
-    template<class LeafDataType, class NodeDataType, class Precision>
-    void OctreeVisitorThreaded<LeafDataType, NodeDataType, Precision>::visitBranch(const OctreeCell<LeafDataType, NodeDataType, Precision> * cell,
-                                                                                   const std::shared_ptr<OctreeCell<LeafDataType, NodeDataType, Precision> > childs[8]) const {
-        auto childsToProcess = getArrayOfChildsToProcess();
-        visitPreBranch(cell, childs, childsToProcess);
-        for (int i = 0; i < 8; ++i) {
-            if(childsToProcess[i]) {
-                childs[i]->visit(this);
+    // Events counted on the hot paths when the header is compiled with OCTREE_INSTRUMENTATION,
+    // all zero otherwise. Read them with Octree::getCounters().
+    struct OctreeCounters {
+        uint64_t overlapTests = 0;        // isItemOverlappingCell calls of the agent
+        uint64_t splits = 0;              // leaves turned into branches by makeBranch
+        uint64_t splitReinserts = 0;      // items moved into the children of a split leaf
+        uint64_t duplicatesRejected = 0;  // items already held by the leaf they were inserted into
+        uint64_t lockAcquisitions = 0;    // leaf locks taken by the threaded and concurrent inserts
+        uint64_t contendedLocks = 0;      // of those, the ones another thread was holding
+        uint64_t visitTasks = 0;          // tasks run by the threaded visit
+        // Time every thread of the threaded visit spent running tasks, indexed by thread
+        std::vector<uint64_t> visitThreadNanoseconds;
+
+        static const size_t fieldsCount = 7;
+
+        static uint64_t OctreeCounters::*getField(size_t i) {
+            static uint64_t OctreeCounters::* const fields[fieldsCount] = {
+                &OctreeCounters::overlapTests, &OctreeCounters::splits, &OctreeCounters::splitReinserts,
+                &OctreeCounters::duplicatesRejected, &OctreeCounters::lockAcquisitions,
+                &OctreeCounters::contendedLocks, &OctreeCounters::visitTasks
+            };
+            return fields[i];
+        }
+
+        void addVisitTimes(const std::vector<uint64_t> &nanoseconds) {
+            if (nanoseconds.size() > visitThreadNanoseconds.size()) {
+                visitThreadNanoseconds.resize(nanoseconds.size(), 0);
+            }
+            for (size_t i = 0; i < nanoseconds.size(); ++i) {
+                visitThreadNanoseconds[i] += nanoseconds[i];
             }
         }
-        visitPostBranch(cell, childs);
-    }
+    };
 
-    template<class L, class N, class P> //L=LeafDataType N=NodeDataType P=Precision
-    N& OctreeCell<L, N, P>::getNodeData() const {
-        return nodeData;
-    }
+#ifdef OCTREE_INSTRUMENTATION
+    // Counters of a tree. Every thread counts into its own OctreeCounters during an operation and adds
+    // them here once at the end, with atomics, so one item inserts from many threads do not serialize.
+    class OctreeSharedCounters {
+    public:
+        OctreeSharedCounters() { reset(); }
 
-    template<class L, class N, class P> //L=LeafDataType N=NodeDataType P=Precision
-    bool OctreeCell<L, N, P>::getItemPath(const L *item, std::string &path) const {
-        if(internalCellType == OctreeCellType::Leaf) {
-            for (auto &it : data) {
-                if (it == item) {
-                    return true;
+        void add(const OctreeCounters &counters) {
+            for (size_t i = 0; i < OctreeCounters::fieldsCount; ++i) {
+                uint64_t value = counters.*OctreeCounters::getField(i);
+                if (value != 0) {
+                    values[i].fetch_add(value, std::memory_order_relaxed);
                 }
             }
-            return false;
-        } else {
-            for (int i = 0; i < 8; ++i) {
-                path += std::to_string(i);
-                if (childs[i]->getItemPath(item, path)) {
-                    return true;
-                } else {
-                    path.pop_back();
-                }
+            if (!counters.visitThreadNanoseconds.empty()) {
+                std::lock_guard<std::mutex> lock(mutex);
+                visitTimes.addVisitTimes(counters.visitThreadNanoseconds);
             }
-            return false;
         }
-    }
 
-    template<class L, class N, class P> //L=LeafDataType N=NodeDataType P=Precision
-    std::string OctreeCell<L, N, P>::getStringRepresentation(unsigned int level) const {
-        std::string s;
-        if(internalCellType == OctreeCellType::Leaf) {
-            s += "Leaf, items:" + std::to_string(data.size());
-            for (unsigned int i = 0; i < data.size(); ++i) {
-                s += " " + std::to_string((unsigned long long)data[i]);
-            }
-            s += "\n";
-        } else {
-            s += "Branch ";
-            for (int i = 0; i < 8; ++i) {
-                if (i != 0) {
-                    for (unsigned int j = 0; j < level + 1; ++j) {
-                        s += "       ";
-                    }
-                    for (unsigned int j = 0; j < level; ++j) {
-                        s += "  ";
-                    }
-                }
-                s += std::to_string(i) + " " + childs[i]->getStringRepresentation(level + 1);
+        OctreeCounters get() const {
+            OctreeCounters counters;
+            for (size_t i = 0; i < OctreeCounters::fieldsCount; ++i) {
+                counters.*OctreeCounters::getField(i) = values[i].load(std::memory_order_relaxed);
             }
+            std::lock_guard<std::mutex> lock(mutex);
+            counters.visitThreadNanoseconds = visitTimes.visitThreadNanoseconds;
+            return counters;
         }
-        return s;
-    }
 
-    template<class L, class N, class P> //L=LeafDataType N=NodeDataType P=Precision
-    void OctreeCell<L, N, P>::printTreeAndSubtreeData(unsigned int level, OctreeNodeDataPrinter<L, N, P> *printer) const {
-        if(internalCellType == OctreeCellType::Leaf) {
-            printf("Leaf: %s\n", printer->GetDataString(nodeData).c_str());
-        } else {
-            printf("Branch ");
-            printf("%s", printer->GetDataString(nodeData).c_str());
-            for (int i = 0; i < 8; ++i) {
-                if (i != 0) {
-                    for (unsigned int j = 0; j < level + 1; ++j) {
-                        printf("       ");
-                    }
-                    for (unsigned int j = 0; j < level; ++j) {
-                        printf("  ");
-                    }
-                }
-                printf("%d ", i);
-                if (childs[i] == nullptr) {
-                    printf("NULL\n");
-                } else {
-                    childs[i]->printTreeAndSubtreeData(level + 1, printer);
-                }
+        void reset() {
+            for (size_t i = 0; i < OctreeCounters::fieldsCount; ++i) {
+                values[i].store(0);
             }
+            std::lock_guard<std::mutex> lock(mutex);
+            visitTimes = OctreeCounters();
         }
-    }
 
-    template<class P>
-    OctreeVec3<P> getCenterDelta(int index, P halfRadius) {
+    private:
+        std::atomic<uint64_t> values[OctreeCounters::fieldsCount];
+        mutable std::mutex mutex;
+        OctreeCounters visitTimes;
+    };
+
+    // Counters of the tree operation running on this thread, nullptr outside of one. Cells reach
+    // them without a pointer of their own, so the tree layout is the same with and without counters.
+    inline OctreeCounters *&getThreadCounters() {
+        static thread_local OctreeCounters *counters = nullptr;
+        return counters;
+    }
+
+    // Makes a block of counters current for this thread and adds it to the tree's counters at the end
+    // of the scope. Scopes nest, the threaded parts of an operation open their own on every thread.
+    class OctreeCountersScope {
+    public:
+        explicit OctreeCountersScope(OctreeSharedCounters &target) : target(target),
+                                                                    previous(getThreadCounters()) {
+            getThreadCounters() = &counters;
+        }
+
+        ~OctreeCountersScope() {
+            getThreadCounters() = previous;
+            target.add(counters);
+        }
+
+    private:
+        OctreeCountersScope(const OctreeCountersScope &) = delete;
+        OctreeCountersScope &operator=(const OctreeCountersScope &) = delete;
+
+        OctreeCounters counters;
+        OctreeSharedCounters &target;
+        OctreeCounters *previous;
+    };
+
+#define OCTREE_COUNT(counter, n) do { if (AKOctree::getThreadCounters() != nullptr) { AKOctree::getThreadCounters()->counter += (n); } } while (0)
+#define OCTREE_COUNTERS_SCOPE() AKOctree::OctreeCountersScope octreeCountersScope(counters)
+#else
+#define OCTREE_COUNT(counter, n) do {} while (0)
+#define OCTREE_COUNTERS_SCOPE() do {} while (0)
+#endif
+
+    // Leaf lock of the threaded inserts, which counts the acquisitions that had to wait
+    template<class Lock>
+    class OctreeLeafLock {
+    public:
+        explicit OctreeLeafLock(Lock &lock) : lock(lock) {
+            OCTREE_COUNT(lockAcquisitions, 1);
+            if (!lock.try_lock()) {
+                OCTREE_COUNT(contendedLocks, 1);
+                lock.lock();
+            }
+        }
+
+        ~OctreeLeafLock() { lock.unlock(); }
+
+    private:
+        OctreeLeafLock(const OctreeLeafLock &) = delete;
+        OctreeLeafLock &operator=(const OctreeLeafLock &) = delete;
+
+        Lock &lock;
+    };
+
+    struct OctreeTraceEvent {
+        const char *name;
+        uint64_t beginNanoseconds;
+        uint64_t endNanoseconds;
+        uint64_t items;
+    };
+
+    // Timeline of the threaded insert, bulk build and visit of the trees it is set on, one track per
+    // worker with a span for the worker and one for every subtree task it ran. Every thread appends
+    // to its own list, so a tracer records one tree operation at a time.
+    class OctreeTracer {
+    public:
+        OctreeTracer() : start(std::chrono::steady_clock::now()) {}
+
+        void clear() {
+            for (auto &thread : events) {
+                thread.clear();
+            }
+        }
+
+        size_t getEventsCount() const {
+            size_t count = 0;
+            for (auto &thread : events) {
+                count += thread.size();
+            }
+            return count;
+        }
+
+        const std::vector<OctreeTraceEvent> &getThreadEvents(unsigned int thread) const { return events[thread]; }
+        unsigned int getThreadsNumber() const { return (unsigned int)events.size(); }
+
+        // Trace Event Format, opened by chrome://tracing and Perfetto
+        void writeChromeTrace(std::ostream &out) const {
+            // Microseconds with nanosecond digits, however long the tracer has been running
+            std::ios_base::fmtflags flags = out.flags();
+            std::streamsize precision = out.precision();
+            out << std::fixed;
+            out.precision(3);
+            out << "{\"traceEvents\": [";
+            bool first = true;
+            for (unsigned int thread = 0; thread < events.size(); ++thread) {
+                out << (first ? "" : ",") << "\n{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 0, \"tid\": " << thread
+                    << ", \"args\": {\"name\": \"worker " << thread << "\"}}";
+                first = false;
+                for (auto &event : events[thread]) {
+                    out << ",\n{\"name\": \"" << event.name << "\", \"ph\": \"X\", \"pid\": 0, \"tid\": " << thread
+                        << ", \"ts\": " << event.beginNanoseconds / 1000.0
+                        << ", \"dur\": " << (event.endNanoseconds - event.beginNanoseconds) / 1000.0;
+                    if (event.items != 0) {
+                        out << ", \"args\": {\"items\": " << event.items << "}";
+                    }
+                    out << "}";
+                }
+            }
+            out << "\n]}\n";
+            out.flags(flags);
+            out.precision(precision);
+        }
+
+    private:
+        template<class L, class N, class P, class C>
+        friend class Octree;
+
+        friend class OctreeTraceSpan;
+
+        OctreeTracer(const OctreeTracer &) = delete;
+        OctreeTracer &operator=(const OctreeTracer &) = delete;
+
+        // Called before the threads start, so record() never resizes the lists
+        void prepare(unsigned int threadsNumber) {
+            if (events.size() < threadsNumber) {
+                events.resize(threadsNumber);
+            }
+        }
+
+        uint64_t now() const {
+            return (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+        }
+
+        void record(unsigned int thread, const char *name, uint64_t begin, uint64_t end, uint64_t items) {
+            events[thread].push_back({name, begin, end, items});
+        }
+
+        const std::chrono::steady_clock::time_point start;
+        std::vector<std::vector<OctreeTraceEvent> > events;
+    };
+
+    // Span of a worker recorded from construction to destruction, nothing without a tracer
+    class OctreeTraceSpan {
+    public:
+        OctreeTraceSpan(OctreeTracer *tracer, unsigned int thread, const char *name, uint64_t items = 0) : tracer(tracer),
+                                                                                                           thread(thread),
+                                                                                                           name(name),
+                                                                                                           items(items),
+                                                                                                           begin(tracer ? tracer->now() : 0) {}
+
+        ~OctreeTraceSpan() {
+            if (tracer) {
+                tracer->record(thread, name, begin, tracer->now(), items);
+            }
+        }
+
+    private:
+        OctreeTraceSpan(const OctreeTraceSpan &) = delete;
+        OctreeTraceSpan &operator=(const OctreeTraceSpan &) = delete;
+
+        OctreeTracer *tracer;
+        unsigned int thread;
+        const char *name;
+        uint64_t items;
+        uint64_t begin;
+    };
+
+    // Workers that stay alive between threaded calls of the trees using them. run() hands the job to
+    // every worker and runs its first slice on the calling thread. Idle workers spin for spinCount
+    // rounds, so calls that follow each other closely start without a wake up, and then park.
+    // One job runs at a time; a pool may be shared by several trees.
+    class OctreeThreadPool {
+    public:
+        explicit OctreeThreadPool(unsigned int threadsNumber = 0, unsigned int spinCount = 4096) : spinCount(spinCount) {
+            if (threadsNumber == 0) {
+                threadsNumber = std::max(1u, std::thread::hardware_concurrency());
+            }
+            generation.store(0);
+            pending.store(0);
+            for (unsigned int i = 1; i < threadsNumber; ++i) {
+                workers.push_back(std::thread(&OctreeThreadPool::work, this, i));
+            }
+        }
+
+        ~OctreeThreadPool() {
+            {
+                std::lock_guard<std::mutex> lock(parkMutex);
+                stopping = true;
+            }
+            parked.notify_all();
+            for (auto &worker : workers) {
+                worker.join();
+            }
+        }
+
+        unsigned int getThreadsNumber() const { return (unsigned int)workers.size() + 1; }
+
+        // Calls job(thread) for every thread in [0, getThreadsNumber()) and returns when all are done.
+        // A job that runs this pool again, e.g. by inserting into another tree sharing it, would wait
+        // for threads that wait for it, so the inner run calls the job for every thread on its own thread.
+        void run(const std::function<void(unsigned int)> &job) {
+            if (runningPool() == this) {
+                for (unsigned int thread = 0; thread < getThreadsNumber(); ++thread) {
+                    job(thread);
+                }
+                return;
+            }
+            std::lock_guard<std::mutex> runLock(runMutex);
+            RunningScope running(this);
+            if (workers.empty()) {
+                job(0);
+                return;
+            }
+            currentJob = &job;
+            pending.store((unsigned int)workers.size());
+            {
+                std::lock_guard<std::mutex> lock(parkMutex);
+                generation++;
+            }
+            parked.notify_all();
+
+            job(0);
+
+            for (unsigned int spin = 0; spin < spinCount && pending.load(std::memory_order_acquire) != 0; ++spin) {
+                std::this_thread::yield();
+            }
+            std::unique_lock<std::mutex> lock(parkMutex);
+            finished.wait(lock, [this] { return pending.load(std::memory_order_acquire) == 0; });
+        }
+
+    private:
+        OctreeThreadPool(const OctreeThreadPool &) = delete;
+        OctreeThreadPool &operator=(const OctreeThreadPool &) = delete;
+
+        // Pool whose job the calling thread is running, nullptr outside of jobs
+        static OctreeThreadPool *&runningPool() {
+            static thread_local OctreeThreadPool *pool = nullptr;
+            return pool;
+        }
+
+        struct RunningScope {
+            explicit RunningScope(OctreeThreadPool *pool) : previous(runningPool()) { runningPool() = pool; }
+            ~RunningScope() { runningPool() = previous; }
+            OctreeThreadPool *previous;
+        };
+
+        void work(unsigned int thread) {
+            uint64_t done = 0;
+            while (true) {
+                for (unsigned int spin = 0; spin < spinCount && generation.load(std::memory_order_acquire) == done; ++spin) {
+                    std::this_thread::yield();
+                }
+                {
+                    std::unique_lock<std::mutex> lock(parkMutex);
+                    parked.wait(lock, [this, done] { return stopping || generation.load() != done; });
+                    if (generation.load() == done) {
+                        return;
+                    }
+                    done = generation.load();
+                }
+
+                {
+                    RunningScope running(this);
+                    (*currentJob)(thread);
+                }
+
+                if (pending.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+                    std::lock_guard<std::mutex> lock(parkMutex);
+                    finished.notify_one();
+                }
+            }
+        }
+
+        const unsigned int spinCount;
+        std::vector<std::thread> workers;
+        std::mutex runMutex;
+        std::mutex parkMutex;
+        std::condition_variable parked;
+        std::condition_variable finished;
+        std::atomic<uint64_t> generation;
+        std::atomic_uint pending;
+        const std::function<void(unsigned int)> *currentJob = nullptr;
+        bool stopping = false;
+    };
+
+    // Items a leaf and its positions make room for when they first grow
+    const size_t OctreeLeafMinCapacity = 4;
+
+    // Leaf items tested at once by the scans over leaf positions
+    const size_t OctreeLeafScanBlock = 64;
+
+    // Positions of the items of a leaf, one array per coordinate in the order of the leaf's items.
+    // Leaf scans read them sequentially instead of following every item pointer, and the loops
+    // below are simple enough for the compiler to vectorize. The three arrays and their size live
+    // in a single allocation, x then y then z, so a leaf costs one pointer and one block at most.
+    template<class Precision = float>
+    class OctreeLeafPositions {
+    public:
+        OctreeLeafPositions() {}
+        OctreeLeafPositions(const OctreeLeafPositions<Precision> &positions) {
+            if (positions.block != nullptr) {
+                size_t n = positions.size();
+                allocate(n);
+                copyAfterLast(positions, n);
+            }
+        }
+        ~OctreeLeafPositions() { ::operator delete(block); }
+
+        OctreeLeafPositions<Precision> &operator=(OctreeLeafPositions<Precision> positions) {
+            std::swap(block, positions.block);
+            return *this;
+        }
+
+        // Positions are kept once enabled, a default constructed or reset object keeps none
+        explicit operator bool() const { return block != nullptr; }
+        void enable() {
+            if (block == nullptr) {
+                allocate(0);
+            }
+        }
+        void reset() { *this = OctreeLeafPositions<Precision>(); }
+
+        size_t size() const { return block != nullptr ? block->size : 0; }
+        size_t capacity() const { return block != nullptr ? block->capacity : 0; }
+        // Bytes of the block, nothing when the positions are off
+        size_t getAllocatedBytes() const { return block != nullptr ? valuesOffset + 3 * capacity() * sizeof(Precision) : 0; }
+        const Precision *x() const { return values(); }
+        const Precision *y() const { return values() + capacity(); }
+        const Precision *z() const { return values() + 2 * capacity(); }
+        OctreeVec3<Precision> get(size_t i) const { return OctreeVec3<Precision>(x()[i], y()[i], z()[i]); }
+
+        void reserve(size_t count) {
+            if (count > capacity()) {
+                size_t n = size();
+                OctreeLeafPositions<Precision> positions;
+                positions.allocate(count);
+                positions.copyAfterLast(*this, n);
+                std::swap(block, positions.block);
+            }
+        }
+
+        void push(const OctreeVec3<Precision> &position) {
+            if (size() == capacity()) {
+                reserve(std::max<size_t>(OctreeLeafMinCapacity, 2 * capacity()));
+            }
+            block->size++;
+            set(size() - 1, position);
+        }
+
+        void set(size_t i, const OctreeVec3<Precision> &position) {
+            Precision *v = values();
+            v[i] = position.x;
+            v[capacity() + i] = position.y;
+            v[2 * capacity() + i] = position.z;
+        }
+
+        // Same swap with the last one as the items of a leaf
+        void remove(size_t i) {
+            set(i, get(size() - 1));
+            block->size--;
+        }
+
+        void append(const OctreeLeafPositions<Precision> &positions) {
+            size_t n = positions.size();
+            reserve(size() + n);
+            copyAfterLast(positions, n);
+        }
+
+        unsigned int countInsideRadius(const OctreeVec3<Precision> &point, Precision squaredRadius) const {
+            const Precision *px = x(), *py = y(), *pz = z();
+            size_t n = size();
+            unsigned int count = 0;
+            for (size_t i = 0; i < n; ++i) {
+                Precision dx = px[i] - point.x;
+                Precision dy = py[i] - point.y;
+                Precision dz = pz[i] - point.z;
+                count += dx * dx + dy * dy + dz * dz <= squaredRadius ? 1 : 0;
+            }
+            return count;
+        }
+
+        // inside[i - begin] is set for the positions in [begin, end) within squaredRadius of point
+        void markInsideRadius(const OctreeVec3<Precision> &point,
+                              Precision squaredRadius,
+                              size_t begin,
+                              size_t end,
+                              uint8_t *inside) const {
+            const Precision *px = x(), *py = y(), *pz = z();
+            for (size_t i = begin; i < end; ++i) {
+                Precision dx = px[i] - point.x;
+                Precision dy = py[i] - point.y;
+                Precision dz = pz[i] - point.z;
+                inside[i - begin] = dx * dx + dy * dy + dz * dz <= squaredRadius;
+            }
+        }
+
+        void markInsideBox(const OctreeVec3<Precision> &min,
+                           const OctreeVec3<Precision> &max,
+                           size_t begin,
+                           size_t end,
+                           uint8_t *inside) const {
+            const Precision *px = x(), *py = y(), *pz = z();
+            for (size_t i = begin; i < end; ++i) {
+                inside[i - begin] = (px[i] >= min.x) & (px[i] <= max.x) &
+                                    (py[i] >= min.y) & (py[i] <= max.y) &
+                                    (pz[i] >= min.z) & (pz[i] <= max.z);
+            }
+        }
+
+    private:
+        struct Header {
+            uint32_t size;
+            uint32_t capacity;
+        };
+        // The arrays start after the header, aligned for Precision
+        static const size_t valuesOffset = (sizeof(Header) + alignof(Precision) - 1) / alignof(Precision) * alignof(Precision);
+
+        Header *block = nullptr;
+
+        Precision *values() const { return reinterpret_cast<Precision *>(reinterpret_cast<char *>(block) + valuesOffset); }
+
+        // Copies the first n positions after the last one kept, the capacity has to have room for them
+        void copyAfterLast(const OctreeLeafPositions<Precision> &positions, size_t n) {
+            if (n == 0) {
+                return;
+            }
+            size_t last = size();
+            size_t targetCapacity = capacity();
+            size_t sourceCapacity = positions.capacity();
+            const Precision *source = positions.values();
+            Precision *target = values();
+            for (size_t axis = 0; axis < 3; ++axis) {
+                std::copy(source + axis * sourceCapacity, source + axis * sourceCapacity + n, target + axis * targetCapacity + last);
+            }
+            block->size = (uint32_t)(last + n);
+        }
+
+        void allocate(size_t count) {
+            block = static_cast<Header *>(::operator new(valuesOffset + 3 * count * sizeof(Precision)));
+            block->size = 0;
+            block->capacity = (uint32_t)count;
+        }
+    };
+
+    // Shape and memory footprint of a tree, returned by Octree::stats()
+    struct OctreeStats {
+        size_t nodes = 0;
+        size_t branches = 0;
+        size_t leaves = 0;
+        size_t emptyLeaves = 0;
+        // Leaves per depth, the root is at depth 0
+        std::vector<size_t> depthHistogram;
+        // Leaves per number of items they hold
+        std::vector<size_t> occupancyHistogram;
+        // Cells without their node data, the node data of every cell, the item pointers the leaves
+        // allocate and the leaf positions, all counted at the capacity they hold. Items kept inside
+        // the cells by OctreeInlineLeafCellPolicy count as cell bytes.
+        size_t cellBytes = 0;
+        size_t nodeDataBytes = 0;
+        size_t leafDataBytes = 0;
+        size_t leafPositionsBytes = 0;
+        // shared_ptr control blocks of the cell allocations, one per block of eight children and one
+        // per cell copied on its own. The bookkeeping of the heap around every allocation is not counted.
+        size_t controlBlockBytes = 0;
+
+        double getEmptyLeafRatio() const { return leaves != 0 ? double(emptyLeaves) / double(leaves) : 0.0; }
+        size_t getTotalBytes() const { return cellBytes + nodeDataBytes + leafDataBytes + leafPositionsBytes + controlBlockBytes; }
+
+        void add(const OctreeStats &stats) {
+            nodes += stats.nodes;
+            branches += stats.branches;
+            leaves += stats.leaves;
+            emptyLeaves += stats.emptyLeaves;
+            addHistogram(depthHistogram, stats.depthHistogram);
+            addHistogram(occupancyHistogram, stats.occupancyHistogram);
+            cellBytes += stats.cellBytes;
+            nodeDataBytes += stats.nodeDataBytes;
+            leafDataBytes += stats.leafDataBytes;
+            leafPositionsBytes += stats.leafPositionsBytes;
+            controlBlockBytes += stats.controlBlockBytes;
+        }
+
+        static void addToHistogram(std::vector<size_t> &histogram, size_t bucket) {
+            if (bucket >= histogram.size()) {
+                histogram.resize(bucket + 1, 0);
+            }
+            histogram[bucket]++;
+        }
+
+    private:
+        static void addHistogram(std::vector<size_t> &histogram, const std::vector<size_t> &other) {
+            if (other.size() > histogram.size()) {
+                histogram.resize(other.size(), 0);
+            }
+            for (size_t i = 0; i < other.size(); ++i) {
+                histogram[i] += other[i];
+            }
+        }
+    };
+
+    template<class LeafDataType, class NodeDataType = LeafDataType, class Precision = float, class CellPolicy = OctreeConcurrentCellPolicy>
+    class OctreeCell {
+
+        template<class L, class N, class P, class C>
+        friend class Octree;
+
+        template<class L, class N, class P>
+        friend class LinearOctree;
+
+        template<class L, class N, class P>
+        friend class PooledOctree;
+
+        template<class L, class N, class P, class C>
+        friend class OctreeVisitor;
+
+        template<class L, class N, class P, class C>
+        friend class OctreeVisitorThreaded;
+
+        enum class OctreeCellType : uint8_t {
+            Leaf,
+            Branch
+        };
+
+        // Slice of the sorted keys whose subtree is built by one thread of the parallel bulk build
+        struct BuildTask {
+            OctreeCell *cell;
+            size_t begin;
+            size_t end;
+        };
+
+        // Subtree measured by one thread of Octree::stats()
+        struct StatsTask {
+            const OctreeCell *cell;
+            unsigned int depth;
+        };
+
+        // Bytes the control block adds to a cell made on its own and to a block of eight children,
+        // padding of the block included
+        static size_t getCellControlBytes();
+        static size_t getBlockControlBytes();
+
+        // Tells a reader whether the cell is a leaf, and with CellPolicy::lockedReads holds the lock
+        // of the leaf until the reader is done with its items. A leaf split before the lock was taken
+        // is read as the branch it became, inserts never turn a branch back into a leaf.
+        class ReadGuard {
+        public:
+            explicit ReadGuard(const OctreeCell &cell) : lock(nullptr) {
+                if (!CellPolicy::lockedReads) {
+                    leaf = cell.getCellType() == OctreeCellType::Leaf;
+                    return;
+                }
+                leaf = cell.isLeaf();
+                if (leaf) {
+                    lock = &cell.getLock();
+                    lock->lock();
+                    leaf = cell.getCellType() == OctreeCellType::Leaf;
+                    if (!leaf) {
+                        lock->unlock();
+                        lock = nullptr;
+                    }
+                }
+            }
+
+            ~ReadGuard() {
+                if (lock != nullptr) {
+                    lock->unlock();
+                }
+            }
+
+            bool isLeaf() const { return leaf; }
+
+        private:
+            ReadGuard(const ReadGuard &) = delete;
+            ReadGuard &operator=(const ReadGuard &) = delete;
+
+            typename CellPolicy::Lock *lock;
+            bool leaf;
+        };
+
+    public:
+        // Items of a leaf, a std::vector unless the cell policy keeps them inside the cell
+        typedef typename CellPolicy::template LeafItems<const LeafDataType *> LeafItems;
+
+        OctreeCell(unsigned int          maxItemsPerCell,
+                   OctreeVec3<Precision> center,
+                   Precision             radius,
+                   unsigned int          cellIndex = 0,
+                   OctreeCellType        cellType = OctreeCellType::Leaf) : center(center),
+                                                                            radius(radius),
+                                                                            maxItemsPerCell(maxItemsPerCell),
+                                                                            cellIndex((uint8_t)cellIndex),
+                                                                            state(cellType) {
+            itemsCount.store(0);
+        }
+
+        NodeDataType& getNodeData() const;
+        unsigned int getCellIndex() const { return cellIndex; }
+        Precision getRadius() const { return radius; }
+        // Number of items in the subtree, kept up to date by insert, split, removal and build
+        unsigned int getItemsCount() const { return itemsCount; }
+        OctreeVec3<Precision> getCellCenter() const { return center; }
+
+        // Positions of the items of a leaf, nullptr for branches and for trees without enableLeafPositions()
+        const OctreeLeafPositions<Precision> *getPositions() const { return positions ? &positions : nullptr; }
+
+    private:
+
+        bool getItemPath(const LeafDataType *item, std::string &path) const;
+        std::string getStringRepresentation(unsigned int level) const;
+        void printTreeAndSubtreeData(unsigned int level, OctreeNodeDataPrinter<LeafDataType, NodeDataType, Precision> *printer) const;
+        template <class T>
+        bool insert(const LeafDataType *item, const T *agent);
+        template <class T>
+        bool insertInThread(const LeafDataType *item, const T *agent);
+        template <class T>
+        bool insertIntoLeaf(const LeafDataType *item, const T *agent);
+        template <class T>
+        bool insertIntoChild(const LeafDataType *item, const T *agent);
+        template <class T>
+        int getChildIndex(const LeafDataType *item, const T *agent) const;
+        template <class T>
+        static int getChildIndex(const LeafDataType *item,
+                                 const OctreeVec3<Precision> &center,
+                                 Precision radius,
+                                 const T *agent);
+        template <class T>
+        static int getChildIndex(const LeafDataType *item,
+                                 const OctreeVec3<Precision> &center,
+                                 Precision radius,
+                                 const T *agent,
+                                 std::true_type);
+        template <class T>
+        static int getChildIndex(const LeafDataType *item,
+                                 const OctreeVec3<Precision> &center,
+                                 Precision radius,
+                                 const T *agent,
+                                 std::false_type);
+        template <class T>
+        bool remove(const LeafDataType *item, const T *agent, bool ancestorCollapses);
+        void collapse();
+        // Capacity a full leaf grows to: doubling from a few items, never beyond what a leaf can hold
+        size_t getLeafCapacity(size_t capacity) const {
+            return std::min<size_t>(maxItemsPerCell, std::max<size_t>(OctreeLeafMinCapacity, 2 * capacity));
+        }
+        void moveCell(OctreeVec3<Precision> center, Precision radius);
+        unsigned int forceCountItems() const;
+        const std::shared_ptr<OctreeCell<LeafDataType, NodeDataType, Precision, CellPolicy> > * getChilds() const { return childs; }
+        const LeafItems& getData() const { return data; }
+        void visit(const OctreeVisitor<LeafDataType, NodeDataType, Precision, CellPolicy> *visitor) const;
+        void visit(const OctreeVisitorThreaded<LeafDataType, NodeDataType, Precision, CellPolicy>*visitor) const;
+        template <class Items>
+        void collectItems(Items &items) const;
+        void collectPositions(OctreeLeafPositions<Precision> &positions) const;
+        bool hasLeafPositions() const;
+
+        template <class T>
+        void addLeafPositions(const T *agent);
+
+        template <class T>
+        static OctreeVec3<Precision> getItemPosition(const LeafDataType *item, const T *agent);
+        template <class T>
+        void queryBox(const OctreeVec3<Precision> &min,
+                      const OctreeVec3<Precision> &max,
+                      const T *agent,
+                      std::vector<const LeafDataType *> &items) const;
+        template <class T>
+        void queryRadius(const OctreeVec3<Precision> &point,
+                         Precision squaredRadius,
+                         const T *agent,
+                         std::vector<const LeafDataType *> &items) const;
+        template <class T>
+        unsigned int countRadius(const OctreeVec3<Precision> &point,
+                                 Precision squaredRadius,
+                                 const T *agent) const;
+        template <class T>
+        unsigned int countBox(const OctreeVec3<Precision> &min,
+                              const OctreeVec3<Precision> &max,
+                              const T *agent) const;
+        template <class T>
+        void raycast(const OctreeVec3<Precision> &origin,
+                     const OctreeVec3<Precision> &direction,
+                     int childOrderMask,
+                     const T *agent,
+                     OctreeRayHit<LeafDataType, Precision> &hit) const;
+        template <class T>
+        void raycastAll(const OctreeVec3<Precision> &origin,
+                        const OctreeVec3<Precision> &direction,
+                        Precision maxDistance,
+                        int childOrderMask,
+                        const T *agent,
+                        std::vector<OctreeRayHit<LeafDataType, Precision> > &hits) const;
+        // Other threads see a leaf become a branch only once its children are filled
+        bool isLeaf() const { return state.type.load(std::memory_order_acquire) == OctreeCellType::Leaf; }
+        // Type seen by the thread changing the cell, the only writer or the insert thread holding its lock
+        OctreeCellType getCellType() const { return state.type.load(std::memory_order_relaxed); }
+        typename CellPolicy::Lock& getLock() const { return state; }
+        bool isEqual(OctreeCell<LeafDataType, NodeDataType, Precision, CellPolicy>  const &rhs) const;
+        template <class T>
+        void makeBranch(const LeafItems &items, const LeafDataType *item, const T *agent);
+        void createChilds();
+        std::shared_ptr<OctreeCell<LeafDataType, NodeDataType, Precision, CellPolicy> > copy(uint32_t epoch) const;
+        template <class T>
+        void build(const LeafDataType *items, std::vector<OctreeMortonKey> &keys, const T *agent);
+        template <class T>
+        void buildRange(const LeafDataType *items,
+                        std::vector<OctreeMortonKey> &keys,
+                        size_t begin,
+                        size_t end,
+                        unsigned int level,
+                        unsigned int levels,
+                        bool hasUnclassifiedItems,
+                        const T *agent,
+                        std::vector<BuildTask> *tasks = nullptr,
+                        unsigned int taskLevel = 0);
+        template <class T>
+        void buildBranch(const LeafDataType *items,
+                         std::vector<OctreeMortonKey> &keys,
+                         size_t begin,
+                         size_t end,
+                         unsigned int level,
+                         unsigned int levels,
+                         bool hasUnclassifiedItems,
+                         const T *agent,
+                         std::vector<BuildTask> *tasks = nullptr,
+                         unsigned int taskLevel = 0);
+        template <class T>
+        void buildLeaf(const LeafDataType *items, std::vector<OctreeMortonKey> &keys, size_t begin, size_t end, const T *agent);
+        // Codes of the items below a cell with this center and radius, PooledOctree builds with them too
+        template <class T>
+        static bool computeMortonCodes(const LeafDataType *items,
+                                       OctreeMortonKey *begin,
+                                       OctreeMortonKey *end,
+                                       unsigned int levels,
+                                       const OctreeVec3<Precision> &center,
+                                       Precision radius,
+                                       const T *agent);
+        unsigned int recountItems(unsigned int levels);
+        void collectStats(OctreeStats &stats, unsigned int depth, unsigned int grain, std::vector<StatsTask> *tasks) const;
+
+        friend bool operator==(const OctreeCell<LeafDataType, NodeDataType, Precision, CellPolicy>  &lhs, const OctreeCell<LeafDataType, NodeDataType, Precision, CellPolicy>  &rhs) { return lhs.isEqual(rhs); }
+        friend bool operator!=(OctreeCell<LeafDataType, NodeDataType, Precision, CellPolicy>  const &lhs, OctreeCell<LeafDataType, NodeDataType, Precision, CellPolicy>  const &rhs) { return !(lhs == rhs); }
+
+        // Fields used by every traversal come first, the single byte fields are packed together
+        OctreeVec3<Precision> center = OctreeVec3<Precision>();
+        Precision radius = Precision(0);
+        std::shared_ptr<OctreeCell<LeafDataType, NodeDataType, Precision, CellPolicy> > childs[8];
+        LeafItems data;
+        OctreeLeafPositions<Precision> positions;
+        std::atomic_uint itemsCount;
+        const unsigned int maxItemsPerCell;
+        uint32_t epoch = 0;
+        const uint8_t cellIndex;
+        // Deriving from the lock lets a lock without state take no space. Readers lock const cells.
+        mutable struct State : CellPolicy::Lock {
+            explicit State(OctreeCellType type) : type(type) {}
+            std::atomic<OctreeCellType> type;
+        } state;
+        mutable NodeDataType nodeData = {};
+    };
+
+    // The eight children of a branch, constructed in one allocation. Children are handed out as
+    // shared_ptrs aliasing the block, which lives until the last of them is released.
+    template<class LeafDataType, class NodeDataType = LeafDataType, class Precision = float, class CellPolicy = OctreeConcurrentCellPolicy>
+    class OctreeCellBlock {
+    public:
+        OctreeCellBlock(unsigned int maxItemsPerCell, OctreeVec3<Precision> center, Precision halfRadius);
+
+        ~OctreeCellBlock() {
+            for (int i = 0; i < 8; ++i) {
+                getCell(i)->~OctreeCell();
+            }
+        }
+
+        OctreeCell<LeafDataType, NodeDataType, Precision, CellPolicy> *getCell(int index) {
+            return reinterpret_cast<OctreeCell<LeafDataType, NodeDataType, Precision, CellPolicy> *>(&cells[index]);
+        }
+
+    private:
+        OctreeCellBlock(const OctreeCellBlock &) = delete;
+        OctreeCellBlock &operator=(const OctreeCellBlock &) = delete;
+
+        typename std::aligned_storage<sizeof(OctreeCell<LeafDataType, NodeDataType, Precision, CellPolicy>),
+                                      alignof(OctreeCell<LeafDataType, NodeDataType, Precision, CellPolicy>)>::type cells[8];
+    };
+
+    template<class LeafDataType, class NodeDataType = LeafDataType, class Precision = float, class CellPolicy = OctreeConcurrentCellPolicy>
+    class Octree {
+
+        static_assert( std::is_arithmetic<Precision>::value, "Precision must be arithmetic!");
+
+    public:
+        Octree(unsigned int maxItemsPerCell,
+               unsigned int threadsNumber = 1) : Octree(maxItemsPerCell,
+                                                        OctreeVec3<Precision>(),
+                                                        Precision(10),
+                                                        threadsNumber) {}
+
+        Octree(unsigned int             maxItemsPerCell,
+               OctreeVec3<Precision>    center,
+               Precision                radius,
+               unsigned int             threadsNumber = 1);
+
+        // The tree runs its threaded insert and visit on threadPool, which may be shared with other trees
+        Octree(unsigned int                      maxItemsPerCell,
+               OctreeVec3<Precision>             center,
+               Precision                         radius,
+               std::shared_ptr<OctreeThreadPool> threadPool);
+
+        unsigned int getMaxItemsPerCell() const {  return maxItemsPerCell; }
+        unsigned int getItemsCount() const { return itemsCount; }
+        std::shared_ptr<OctreeThreadPool> getThreadPool() const { return threadPool; }
+        // Records the threaded insert, bulk build and visit of this tree, nullptr stops recording
+        void setTracer(std::shared_ptr<OctreeTracer> tracer) { this->tracer = tracer; }
+        std::shared_ptr<OctreeTracer> getTracer() const { return tracer; }
+        void clear();
+
+        template <class T>
+        void insert(const LeafDataType *item, const T *agent);
+
+        // Insert that may run from any number of threads at once. With OctreeConcurrentReadCellPolicy
+        // queries, raycasts and visits may run alongside it; remove, update, clear and stats may not.
+        template <class T>
+        void concurrentInsert(const LeafDataType *item, const T *agent);
+
+        // After enableSnapshots() every change copies the cells it touches that the previous version
+        // shares, and publishes the new version when it is done. snapshot() may be called from any
+        // thread and returns the last published version, which never changes and is released with
+        // the last reader holding it. Visitors that write node data change it in every version.
+        void enableSnapshots();
+        std::shared_ptr<const Octree<LeafDataType, NodeDataType, Precision, CellPolicy> > snapshot() const;
+
+        // Leaves keep a copy of their item positions, taken from the agents passed to every change,
+        // which need GetItemPosition. Box, radius and nearest queries then scan those copies.
+        template <class T>
+        void enableLeafPositions(const T *agent);
+
+        template <class T>
+        bool remove(const LeafDataType *item, const T *agent);
+
+        template <class T>
+        bool update(const LeafDataType *item,
+                    const LeafDataType *previousItem,
+                    const T *agent);
+        void insert(const LeafDataType *items,
+                    const unsigned int itemsCount,
+                    const OctreeAgent<LeafDataType, NodeDataType, Precision> *agentInsert,
+                    const OctreeAgentAutoAdjustExtension<LeafDataType, NodeDataType, Precision> *agentAdjust,
+                    bool autoAdjustTree = true);
+
+        template <class T>
+        void insert(const LeafDataType *items, const unsigned int itemsCount, const T *agent, bool autoAdjustTree);
+
+        template <class T>
+        void insert(const LeafDataType *items, const unsigned int itemsCount, const T *agent);
+        void insert(std::vector<LeafDataType> &items,
+                    const OctreeAgent<LeafDataType, NodeDataType, Precision> *agentInsert,
+                    const OctreeAgentAutoAdjustExtension<LeafDataType, NodeDataType, Precision> *agentAdjust,
+                    bool autoAdjustTree = true);
+
+        template <class T>
+        void insert(std::vector<LeafDataType> &items, const T *agent, bool autoAdjustTree);
+
+        template <class T>
+        void insert(std::vector<LeafDataType> &items, const T *agent);
+        void bulkInsert(const LeafDataType *items,
+                        const unsigned int itemsCount,
+                        const OctreeAgent<LeafDataType, NodeDataType, Precision> *agentInsert,
+                        const OctreeAgentAutoAdjustExtension<LeafDataType, NodeDataType, Precision> *agentAdjust,
+                        bool autoAdjustTree = true);
+
+        template <class T>
+        void bulkInsert(const LeafDataType *items, const unsigned int itemsCount, const T *agent);
+
+        template <class T>
+        void bulkInsert(std::vector<LeafDataType> &items, const T *agent);
+        std::string getItemPath(LeafDataType *item) const;
+        std::string getStringRepresentation() const { return root->getStringRepresentation(0); }
+        // Like visit(), must not run beside writers. Read a snapshot() for a tree being modified.
+        OctreeStats stats() const;
+        // Counters summed over every operation since construction or resetCounters(), all zero
+        // unless the header is compiled with OCTREE_INSTRUMENTATION
+        OctreeCounters getCounters() const;
+        void resetCounters();
+        void printTreeData(OctreeNodeDataPrinter<LeafDataType, NodeDataType, Precision> *printer) const {  root->printTreeAndSubtreeData(0, printer); }
+        // Walks the whole tree, getItemsCount() returns the same value from the cached counts
+        unsigned int forceGetItemsCount() const { return root->forceCountItems();  }
+        void visit(const OctreeVisitor<LeafDataType, NodeDataType, Precision, CellPolicy> *visitor) const;
+        void visit(const OctreeVisitorThreaded<LeafDataType, NodeDataType, Precision, CellPolicy> *visitor) const;
+
+        template <class T>
+        void queryBox(const OctreeVec3<Precision> &min,
+                      const OctreeVec3<Precision> &max,
+                      const T *agent,
+                      std::vector<const LeafDataType *> &items) const;
+
+        template <class T>
+        std::vector<const LeafDataType *> findKNearest(const OctreeVec3<Precision> &point,
+                                                       unsigned int k,
+                                                       const T *agent) const;
+
+        template <class T>
+        void queryRadius(const OctreeVec3<Precision> &point,
+                         Precision radius,
+                         const T *agent,
+                         std::vector<const LeafDataType *> &items) const;
+
+        template <class T>
+        unsigned int countRadius(const OctreeVec3<Precision> &point,
+                                 Precision radius,
+                                 const T *agent) const;
+
+        template <class T>
+        unsigned int countBox(const OctreeVec3<Precision> &min,
+                              const OctreeVec3<Precision> &max,
+                              const T *agent) const;
+
+        template <class T>
+        const LeafDataType *raycast(const OctreeVec3<Precision> &origin,
+                                   const OctreeVec3<Precision> &direction,
+                                   const T *agent,
+                                   Precision *distance = nullptr,
+                                   Precision maxDistance = std::numeric_limits<Precision>::max()) const;
+
+        template <class T>
+        void raycastAll(const OctreeVec3<Precision> &origin,
+                        const OctreeVec3<Precision> &direction,
+                        const T *agent,
+                        std::vector<OctreeRayHit<LeafDataType, Precision> > &hits,
+                        Precision maxDistance = std::numeric_limits<Precision>::max()) const;
+        bool operator==(const Octree<LeafDataType, NodeDataType, Precision, CellPolicy> &rhs) { return *root == *rhs.root; }
+        bool operator!=(const Octree<LeafDataType, NodeDataType, Precision, CellPolicy> &rhs) { return *root != *rhs.root; }
+
+    private:
+        explicit Octree(const Octree<LeafDataType, NodeDataType, Precision, CellPolicy> *tree);
+
+        void publishSnapshot();
+        void makeRootWritable();
+
+        template <class T>
+        void makePathWritable(const LeafDataType *item, const T *agent);
+
+        // Branch whose children are visited as separate tasks. The child that finishes last calls
+        // visitPostBranch and reports to the parent, so no thread waits for the children.
+        struct VisitContinuation {
+            const OctreeCell<LeafDataType, NodeDataType, Precision, CellPolicy> *cell;
+            std::atomic_int remaining;
+            VisitContinuation *parent;
+        };
+
+        struct VisitTask {
+            const OctreeCell<LeafDataType, NodeDataType, Precision, CellPolicy> *cell;
+            VisitContinuation *parent;
+        };
+
+        // Tasks of one visiting thread. The owner takes the newest task, other threads steal the oldest.
+        struct VisitQueue {
+            OctreeSpinLock lock;
+            std::deque<VisitTask> tasks;
+        };
+
+        template <class T, class U>
+        void insertItems(const LeafDataType *items,
+                         const unsigned int itemsCount,
+                         const T *agentInsert,
+                         const U *agentAdjust,
+                         bool autoAdjustTree);
+
+        template <class T, class U>
+        void bulkInsertItems(const LeafDataType *items,
+                             const unsigned int itemsCount,
+                             const T *agentInsert,
+                             const U *agentAdjust,
+                             bool autoAdjustTree);
+
+        template <class U>
+        void adjustToItems(const LeafDataType *items, const unsigned int itemsCount, const U *agentAdjust);
+
+        template <class T>
+        bool insertIntoRoot(const LeafDataType *item, const T *agent);
+
+        template <class T>
+        void insertThread(const LeafDataType *items,
+                          const unsigned int itemsCount,
+                          std::atomic_uint &nextItem,
+                          const T *agent);
+        void runInThreads(const std::function<void(unsigned int)> &job) const;
+
+        template <class T>
+        void buildInThreads(const LeafDataType *items, const unsigned int itemsCount, const T *agent);
+        void sortMortonKeysInThreads(std::vector<OctreeMortonKey> &keys, unsigned int bits) const;
+
+        void visitInThreads(const OctreeVisitorThreaded<LeafDataType, NodeDataType, Precision, CellPolicy> *visitor) const;
+        void visitTask(const OctreeVisitorThreaded<LeafDataType, NodeDataType, Precision, CellPolicy> *visitor,
+                       const VisitTask &task,
+                       unsigned int grain,
+                       VisitQueue &queue,
+                       std::atomic_uint &pendingTasks) const;
+        void finishVisitTask(const OctreeVisitorThreaded<LeafDataType, NodeDataType, Precision, CellPolicy> *visitor,
+                             VisitContinuation *continuation) const;
+
+
+        OctreeVec3<Precision> center = OctreeVec3<Precision>();
+        Precision radius = Precision(10);
+
+        const unsigned int maxItemsPerCell = 1;
+        std::atomic_uint itemsCount;
+
+        unsigned int threadsNumber = 1;
+        std::shared_ptr<OctreeThreadPool> threadPool;
+
+        std::shared_ptr<OctreeCell<LeafDataType, NodeDataType, Precision, CellPolicy> > root;
+
+        bool snapshotsEnabled = false;
+        bool leafPositionsEnabled = false;
+        uint32_t epoch = 0;
+        std::shared_ptr<const Octree<LeafDataType, NodeDataType, Precision, CellPolicy> > publishedSnapshot;
+
+        std::shared_ptr<OctreeTracer> tracer;
+
+#ifdef OCTREE_INSTRUMENTATION
+        mutable OctreeSharedCounters counters;
+#endif
+
+        template<class L, class N, class P>
+        friend class LinearOctree;
+    };
+
+    // Deepest level a LinearOctree keeps, the child indices of all levels fit in 64 bits
+    const unsigned int OctreeLinearMaxDepth = 21;
+
+    // Leaf of a LinearOctree. code holds the child index of every level from the root, three bits per
+    // level, aligned as if the leaf was at OctreeLinearMaxDepth, so sorting by code gives depth first order.
+    struct OctreeLinearLeaf {
+        uint64_t code;
+        unsigned int depth;
+        unsigned int begin; // first item, the items of a leaf end where the next leaf begins
+    };
+
+    template<class Precision = float>
+    struct OctreeLinearNode {
+        uint64_t code;
+        unsigned int depth;
+        OctreeVec3<Precision> center;
+        Precision radius;
+    };
+
+    template<class LeafDataType, class NodeDataType = LeafDataType, class Precision = float>
+    class OctreeLinearVisitor {
+    public:
+        virtual ~OctreeLinearVisitor() {}
+
+        // Returning false skips the children of the branch
+        virtual bool visitPreBranch(const OctreeLinearNode<Precision> &node) const { return true; }
+        virtual void visitPostBranch(const OctreeLinearNode<Precision> &node) const {}
+        virtual void visitLeaf(const OctreeLinearNode<Precision> &node,
+                               const LeafDataType * const *items,
+                               unsigned int itemsCount) const {}
+
+    protected:
+        OctreeLinearVisitor() {}
+    };
+
+    // Read only octree kept as a sorted array of its non empty leaves and one array of their items.
+    // It is built with the same agents and maxItemsPerCell as Octree and has the same leaves.
+    // Branches are not stored, they are found again from the codes with binary searches.
+    template<class LeafDataType, class NodeDataType = LeafDataType, class Precision = float>
+    class LinearOctree {
+
+        static_assert( std::is_arithmetic<Precision>::value, "Precision must be arithmetic!");
+
+    public:
+        LinearOctree(unsigned int          maxItemsPerCell,
+                     OctreeVec3<Precision> center,
+                     Precision             radius,
+                     unsigned int          threadsNumber = 1) : center(center),
+                                                                radius(radius),
+                                                                maxItemsPerCell(maxItemsPerCell),
+                                                                threadsNumber(threadsNumber) {}
+
+        template <class T>
+        void build(const LeafDataType *items, const unsigned int itemsCount, const T *agent);
+        void clear();
+
+        unsigned int getMaxItemsPerCell() const { return maxItemsPerCell; }
+        unsigned int getItemsCount() const { return (unsigned int)items.size(); }
+        OctreeVec3<Precision> getCenter() const { return center; }
+        Precision getRadius() const { return radius; }
+        const std::vector<OctreeLinearLeaf>& getLeaves() const { return leaves; }
+        const LeafDataType * const *getLeafItems(size_t leaf) const { return items.data() + leaves[leaf].begin; }
+        unsigned int getLeafItemsCount(size_t leaf) const { return getLeafEnd(leaf) - leaves[leaf].begin; }
+
+        // Index of the leaf whose cell holds the position, -1 if that cell is empty or outside of the tree
+        int findLeaf(const OctreeVec3<Precision> &position) const;
+
+        template <class T>
+        void queryBox(const OctreeVec3<Precision> &min,
+                      const OctreeVec3<Precision> &max,
+                      const T *agent,
+                      std::vector<const LeafDataType *> &items) const;
+
+        void visit(const OctreeLinearVisitor<LeafDataType, NodeDataType, Precision> *visitor) const;
+
+    private:
+        void addLeaves(const OctreeCell<LeafDataType, NodeDataType, Precision, OctreeSingleWriterCellPolicy> *cell, uint64_t code, unsigned int depth);
+        unsigned int getLeafEnd(size_t leaf) const;
+        size_t getChildLeavesEnd(size_t begin, size_t end, const OctreeLinearNode<Precision> &node, int child) const;
+        OctreeLinearNode<Precision> getChildNode(const OctreeLinearNode<Precision> &node, int child) const;
+
+        template <class T>
+        void queryBox(const OctreeVec3<Precision> &min,
+                      const OctreeVec3<Precision> &max,
+                      const T *agent,
+                      std::vector<const LeafDataType *> &items,
+                      size_t begin,
+                      size_t end,
+                      const OctreeLinearNode<Precision> &node) const;
+
+        void visit(const OctreeLinearVisitor<LeafDataType, NodeDataType, Precision> *visitor,
+                   size_t begin,
+                   size_t end,
+                   const OctreeLinearNode<Precision> &node) const;
+
+        OctreeVec3<Precision> center = OctreeVec3<Precision>();
+        Precision radius = Precision(10);
+        const unsigned int maxItemsPerCell = 1;
+        unsigned int threadsNumber = 1;
+
+        std::vector<OctreeLinearLeaf> leaves;
+        std::vector<const LeafDataType *> items;
+    };
+
+    // Cell of a PooledOctree. The 8 children of a branch are next to each other in the pool and
+    // childs is the index of the first one; the root is at index 0, so 0 marks a leaf.
+    // The items of every subtree are next to each other, itemsCount counts all of them.
+    struct OctreePooledNode {
+        uint32_t childs;
+        uint32_t itemsBegin;
+        uint32_t itemsCount;
+    };
+
+    // Cell of a PooledOctree as a visitor sees it, the geometry is derived on the way down
+    template<class Precision = float>
+    struct OctreePooledCell {
+        uint32_t index;
+        unsigned int depth;
+        OctreeVec3<Precision> center;
+        Precision radius;
+    };
+
+    template<class LeafDataType, class NodeDataType = LeafDataType, class Precision = float>
+    class OctreePooledVisitor {
+    public:
+        virtual ~OctreePooledVisitor() {}
+
+        // Returning false skips the children of the branch
+        virtual bool visitPreBranch(const OctreePooledCell<Precision> &cell) const { return true; }
+        virtual void visitPostBranch(const OctreePooledCell<Precision> &cell) const {}
+        virtual void visitLeaf(const OctreePooledCell<Precision> &cell,
+                               const LeafDataType * const *items,
+                               unsigned int itemsCount) const {}
+
+    protected:
+        OctreePooledVisitor() {}
+    };
+
+    // Frozen snapshot of an octree for queries. Its cells live in one pool and its items in one array,
+    // both in depth first order. build() sorts Morton keys and lays the cells out directly, as
+    // Octree::bulkInsert() does, so it allocates no cell on its own and ends with the same cells as an
+    // Octree given the same items, agent and maxItemsPerCell. There is no insert or remove, a changed
+    // set of items is built again.
+    template<class LeafDataType, class NodeDataType = LeafDataType, class Precision = float>
+    class PooledOctree {
+
+        static_assert( std::is_arithmetic<Precision>::value, "Precision must be arithmetic!");
+
+    public:
+        PooledOctree(unsigned int          maxItemsPerCell,
+                     OctreeVec3<Precision> center,
+                     Precision             radius) : center(center),
+                                                     radius(radius),
+                                                     maxItemsPerCell(maxItemsPerCell),
+                                                     nodes(1) {}
+
+        // Replaces the items. Builds on the calling thread.
+        template <class T>
+        void build(const LeafDataType *items, const unsigned int itemsCount, const T *agent);
+        void clear();
+
+        unsigned int getMaxItemsPerCell() const { return maxItemsPerCell; }
+        unsigned int getItemsCount() const { return (unsigned int)items.size(); }
+        OctreeVec3<Precision> getCenter() const { return center; }
+        Precision getRadius() const { return radius; }
+        const std::vector<OctreePooledNode>& getNodes() const { return nodes; }
+        const LeafDataType * const *getNodeItems(size_t node) const { return items.data() + nodes[node].itemsBegin; }
+        size_t getAllocatedBytes() const { return nodes.capacity() * sizeof(OctreePooledNode) + items.capacity() * sizeof(const LeafDataType *); }
+
+        template <class T>
+        void queryBox(const OctreeVec3<Precision> &min,
+                      const OctreeVec3<Precision> &max,
+                      const T *agent,
+                      std::vector<const LeafDataType *> &items) const;
+
+        template <class T>
+        void queryRadius(const OctreeVec3<Precision> &point,
+                         Precision radius,
+                         const T *agent,
+                         std::vector<const LeafDataType *> &items) const;
+
+        template <class T>
+        unsigned int countRadius(const OctreeVec3<Precision> &point,
+                                 Precision radius,
+                                 const T *agent) const;
+
+        // Nearest first, as Octree::findKNearest()
+        template <class T>
+        std::vector<const LeafDataType *> findKNearest(const OctreeVec3<Precision> &point,
+                                                       unsigned int k,
+                                                       const T *agent) const;
+
+        void visit(const OctreePooledVisitor<LeafDataType, NodeDataType, Precision> *visitor) const;
+
+    private:
+        template <class T>
+        void buildCell(const LeafDataType *items,
+                       std::vector<OctreeMortonKey> &keys,
+                       const OctreePooledCell<Precision> &cell,
+                       const T *agent);
+        template <class T>
+        void buildRange(const LeafDataType *items,
+                        std::vector<OctreeMortonKey> &keys,
+                        size_t begin,
+                        size_t end,
+                        unsigned int level,
+                        unsigned int levels,
+                        bool hasUnclassifiedItems,
+                        const OctreePooledCell<Precision> &cell,
+                        const T *agent);
+        template <class T>
+        void buildBranch(const LeafDataType *items,
+                         std::vector<OctreeMortonKey> &keys,
+                         size_t begin,
+                         size_t end,
+                         unsigned int level,
+                         unsigned int levels,
+                         bool hasUnclassifiedItems,
+                         const OctreePooledCell<Precision> &cell,
+                         const T *agent);
+        void buildLeaf(const LeafDataType *items, std::vector<OctreeMortonKey> &keys, size_t begin, size_t end, uint32_t node);
+        OctreePooledCell<Precision> getRootCell() const { return {0, 0, center, radius}; }
+        OctreePooledCell<Precision> getChildCell(const OctreePooledCell<Precision> &cell, int child) const;
+
+        template <class T>
+        void queryBox(const OctreeVec3<Precision> &min,
+                      const OctreeVec3<Precision> &max,
+                      const T *agent,
+                      std::vector<const LeafDataType *> &items,
+                      const OctreePooledCell<Precision> &cell) const;
+
+        template <class T>
+        void queryRadius(const OctreeVec3<Precision> &point,
+                         Precision squaredRadius,
+                         const T *agent,
+                         std::vector<const LeafDataType *> &items,
+                         const OctreePooledCell<Precision> &cell) const;
+
+        template <class T>
+        unsigned int countRadius(const OctreeVec3<Precision> &point,
+                                 Precision squaredRadius,
+                                 const T *agent,
+                                 const OctreePooledCell<Precision> &cell) const;
+
+        void visit(const OctreePooledVisitor<LeafDataType, NodeDataType, Precision> *visitor,
+                   const OctreePooledCell<Precision> &cell) const;
+
+        OctreeVec3<Precision> center = OctreeVec3<Precision>();
+        Precision radius = Precision(10);
+        const unsigned int maxItemsPerCell = 1;
+
+        // Never empty, an empty tree is a root leaf without items
+        std::vector<OctreePooledNode> nodes;
+        std::vector<const LeafDataType *> items;
+    };
+
+    template<class P> // P=Precision
+    OctreeVec3<P>& OctreeVec3<P>::operator+=(const OctreeVec3<P>& rhs) {
+        x += rhs.x;
+        y += rhs.y;
+        z += rhs.z;
+        return *this;
+    }
+
+    template<class P> // P=Precision
+    OctreeVec3<P>& OctreeVec3<P>::operator-=(const OctreeVec3<P>& rhs) {
+        x -= rhs.x;
+        y -= rhs.y;
+        z -= rhs.z;
+        return *this;
+    }
+
+    template<class P> // P=Precision
+    OctreeVec3<P> operator+(OctreeVec3<P> lhs, const OctreeVec3<P>& rhs) {
+        lhs += rhs;
+        return lhs;
+    }
+
+    template<class P> // P=Precision
+    OctreeVec3<P> operator/(OctreeVec3<P> lhs, const P& rhs) {
+        lhs.x /= rhs;
+        lhs.y /= rhs;
+        lhs.z /= rhs;
+        return lhs;
+    }
+
+    template<class P> // P=Precision
+    OctreeVec3<P> operator-(OctreeVec3<P> lhs, const OctreeVec3<P>& rhs) {
+        lhs -= rhs;
+        return lhs;
+    }
+
+    template<class L, class N, class P, class C> //L=LeafDataType N=NodeDataType P=Precision C=CellPolicy
+    void OctreeVisitor<L, N, P, C>::visitRoot(const std::shared_ptr<OctreeCell<L, N, P, C> > rootCell) const {
+        ContinueVisit(rootCell);
+    }
+
+    template<class L, class N, class P, class C> //L=LeafDataType N=NodeDataType P=Precision C=CellPolicy
+    void OctreeVisitor<L, N, P, C>::visitBranch(const OctreeCell<L, N, P, C> * cell,
+                                                const std::shared_ptr<OctreeCell<L, N, P, C> > childs[8]) const {
+
+        for (int i = 0; i < 8; ++i) {
+            ContinueVisit(childs[i]);
+        }
+    }
+
+    template<class L, class N, class P, class C> //L=LeafDataType N=NodeDataType P=Precision C=CellPolicy
+    void OctreeVisitor<L, N, P, C>::visitLeaf(const OctreeCell<L, N, P, C> * cell,
+                                              const typename C::template LeafItems<const L *> &items) const {}
+
+    template<class L, class N, class P, class C> //L=LeafDataType N=NodeDataType P=Precision C=CellPolicy
+    void OctreeVisitor<L, N, P, C>::ContinueVisit(const std::shared_ptr<OctreeCell<L, N, P, C> > &cell) const {
+        cell->visit(this);
+    }
+
+    template<class L, class N, class P, class C> //L=LeafDataType N=NodeDataType P=Precision C=CellPolicy
+    void OctreeVisitorThreaded<L, N, P, C>::visitRoot(const std::shared_ptr<OctreeCell<L, N, P, C> > rootCell) const {
+        visitPreRoot(rootCell);
+        rootCell->visit(this);
+        visitPostRoot(rootCell);
+    }
+
+    inline std::array<bool, 8> getArrayOfChildsToProcess() {
+        std::array<bool, 8> a;
+        a.fill(true);
+        return a;
+    }
+
+    template<class LeafDataType, class NodeDataType, class Precision, class CellPolicy>
+    void OctreeVisitorThreaded<LeafDataType, NodeDataType, Precision, CellPolicy>::visitBranch(const OctreeCell<LeafDataType, NodeDataType, Precision, CellPolicy> * cell,
+                                                                                               const std::shared_ptr<OctreeCell<LeafDataType, NodeDataType, Precision, CellPolicy> > childs[8]) const {
+        auto childsToProcess = getArrayOfChildsToProcess();
+        visitPreBranch(cell, childs, childsToProcess);
+        for (int i = 0; i < 8; ++i) {
+            if(childsToProcess[i]) {
+                childs[i]->visit(this);
+            }
+        }
+        visitPostBranch(cell, childs);
+    }
+
+    template<class L, class N, class P, class C> //L=LeafDataType N=NodeDataType P=Precision C=CellPolicy
+    N& OctreeCell<L, N, P, C>::getNodeData() const {
+        return nodeData;
+    }
+
+    template<class L, class N, class P, class C> //L=LeafDataType N=NodeDataType P=Precision C=CellPolicy
+    bool OctreeCell<L, N, P, C>::getItemPath(const L *item, std::string &path) const {
+        if(getCellType() == OctreeCellType::Leaf) {
+            for (auto &it : data) {
+                if (it == item) {
+                    return true;
+                }
+            }
+            return false;
+        } else {
+            for (int i = 0; i < 8; ++i) {
+                path += std::to_string(i);
+                if (childs[i]->getItemPath(item, path)) {
+                    return true;
+                } else {
+                    path.pop_back();
+                }
+            }
+            return false;
+        }
+    }
+
+    template<class L, class N, class P, class C> //L=LeafDataType N=NodeDataType P=Precision C=CellPolicy
+    std::string OctreeCell<L, N, P, C>::getStringRepresentation(unsigned int level) const {
+        std::string s;
+        if(getCellType() == OctreeCellType::Leaf) {
+            s += "Leaf, items:" + std::to_string(data.size());
+            for (unsigned int i = 0; i < data.size(); ++i) {
+                s += " " + std::to_string((unsigned long long)data[i]);
+            }
+            s += "\n";
+        } else {
+            s += "Branch ";
+            for (int i = 0; i < 8; ++i) {
+                if (i != 0) {
+                    for (unsigned int j = 0; j < level + 1; ++j) {
+                        s += "       ";
+                    }
+                    for (unsigned int j = 0; j < level; ++j) {
+                        s += "  ";
+                    }
+                }
+                s += std::to_string(i) + " " + childs[i]->getStringRepresentation(level + 1);
+            }
+        }
+        return s;
+    }
+
+    template<class L, class N, class P, class C> //L=LeafDataType N=NodeDataType P=Precision C=CellPolicy
+    void OctreeCell<L, N, P, C>::printTreeAndSubtreeData(unsigned int level, OctreeNodeDataPrinter<L, N, P> *printer) const {
+        if(getCellType() == OctreeCellType::Leaf) {
+            printf("Leaf: %s\n", printer->GetDataString(nodeData).c_str());
+        } else {
+            printf("Branch ");
+            printf("%s", printer->GetDataString(nodeData).c_str());
+            for (int i = 0; i < 8; ++i) {
+                if (i != 0) {
+                    for (unsigned int j = 0; j < level + 1; ++j) {
+                        printf("       ");
+                    }
+                    for (unsigned int j = 0; j < level; ++j) {
+                        printf("  ");
+                    }
+                }
+                printf("%d ", i);
+                if (childs[i] == nullptr) {
+                    printf("NULL\n");
+                } else {
+                    childs[i]->printTreeAndSubtreeData(level + 1, printer);
+                }
+            }
+        }
+    }
+
+    template<class P>
+    OctreeVec3<P> getCenterDelta(int index, P halfRadius) {
         /*
            y
            |
@@ -455,549 +1968,2482 @@ namespace AKOctree {
            |/   |/
            6----7
 
-           000---001
-           /|    /|
-          / |   / |
-        010-+-011 |
-         | 100-+-101
-         | /   | /
-         |/    |/
-        110---111
-         */
+           000---001
+           /|    /|
+          / |   / |
+        010-+-011 |
+         | 100-+-101
+         | /   | /
+         |/    |/
+        110---111
+         */
+
+
+        bool up = index < 4;//+y
+        bool right = (bool) (index & 1);//+x
+        bool front = (bool) (index & 2); //+z
+        return OctreeVec3<P>(right ? halfRadius : -halfRadius,
+                             up ? halfRadius : -halfRadius,
+                             front ? halfRadius : -halfRadius);
+    }
+
+    template<class L, class N, class P, class C> //L=LeafDataType N=NodeDataType P=Precision C=CellPolicy
+    template <class T>
+    bool OctreeCell<L, N, P, C>::insert(const L *item, const T *agent) {
+        if(getCellType() == OctreeCellType::Leaf) {
+            return insertIntoLeaf(item, agent);
+        } else {
+            return insertIntoChild(item, agent);
+        }
+    }
+
+    template<class L, class N, class P, class C> //L=LeafDataType N=NodeDataType P=Precision C=CellPolicy
+    template <class T>
+    bool OctreeCell<L, N, P, C>::insertIntoChild(const L *item, const T *agent) {
+        int i = getChildIndex(item, agent);
+        if (i >= 0 && childs[i]->insert(item, agent)) {
+            itemsCount++;
+            return true;
+        }
+        return false;
+    }
+
+    template<class L, class N, class P, class C> //L=LeafDataType N=NodeDataType P=Precision C=CellPolicy
+    template <class T>
+    bool OctreeCell<L, N, P, C>::insertInThread(const L *item, const T *agent) {
+        if(getCellType() == OctreeCellType::Leaf) {
+            return insertIntoLeaf(item, agent);
+        } else {
+            int i = getChildIndex(item, agent);
+            if (i < 0) {
+                return false;
+            }
+            bool inserted;
+            if(childs[i]->isLeaf()) {
+                OctreeLeafLock<typename C::Lock> lock(childs[i]->getLock());
+                inserted = childs[i]->insertInThread(item, agent);
+            } else {
+                inserted = childs[i]->insertInThread(item, agent);
+            }
+            if (inserted) {
+                itemsCount.fetch_add(1);
+            }
+            return inserted;
+        }
+    }
+
+    // https://en.wikipedia.org/wiki/Substitution_failure_is_not_an_error
+    namespace sfinae {
+        template<class>
+        struct sfinae_true : std::true_type {};
+
+        template<class T, class A0>
+        static auto test_equalityOp(int) -> sfinae_true<decltype(*std::declval<T>() == *std::declval<T>())>;
+
+        template<class, class A0>
+        static auto test_equalityOp(long) -> std::false_type;
+
+        template<class T, class L, bool>
+        struct equality {
+            static inline bool isEqual(T t, L l) {return t == l;}
+        };
+
+        template<class T, class L>
+        struct equality<T, L, true> {
+            static inline bool isEqual(T t, L l) {return t == l || *t == *l;}
+        };
+
+        template<class T, class Arg>
+        struct pointer_equality : decltype(test_equalityOp<T, Arg>(0)) {
+            static_assert(std::is_pointer<T>::value && std::is_pointer<Arg>::value, "Template arguments must be pointers");
+
+            static bool isEqual(T t, Arg l) {
+                return equality<T, Arg, decltype(test_equalityOp<T, Arg>(0))::value>::isEqual(t, l);
+            }
+        };
+
+        template<class T, class L, class N, class P>
+        struct is_static_agent : std::is_base_of<OctreeStaticAgent<T, L, N, P>, T> {};
+
+        template<class T, class L, class N, class P>
+        struct is_agent : std::integral_constant<bool, std::is_base_of<OctreeAgent<L, N, P>, T>::value ||
+                                                       is_static_agent<T, L, N, P>::value> {};
+
+        template<class T, class L, class P>
+        static auto test_autoAdjust(int) -> sfinae_true<decltype(std::declval<const T *>()->GetMaxValuesForAutoAdjust(std::declval<const L *>(),
+                                                                                                                   std::declval<const OctreeVec3<P> &>()))>;
+
+        template<class, class, class>
+        static auto test_autoAdjust(long) -> std::false_type;
+
+        template<class T, class L, class P>
+        struct has_autoAdjust : decltype(test_autoAdjust<T, L, P>(0)) {};
+
+        template<class T, class L, class P>
+        static auto test_octant(int) -> sfinae_true<decltype(std::declval<const T *>()->GetItemOctant(std::declval<const L *>(),
+                                                                                                       std::declval<const OctreeVec3<P> &>()))>;
+
+        template<class, class, class>
+        static auto test_octant(long) -> std::false_type;
+
+        // Found on the agent's own type, so a virtual agent only uses its octant extension when passed as itself
+        template<class T, class L, class P>
+        struct has_octant : decltype(test_octant<T, L, P>(0)) {};
+
+        template<class T, class L, class P>
+        static auto test_position(int) -> sfinae_true<decltype(std::declval<const T *>()->GetItemPosition(std::declval<const L *>()))>;
+
+        template<class, class, class>
+        static auto test_position(long) -> std::false_type;
+
+        template<class T, class L, class P>
+        struct has_position : decltype(test_position<T, L, P>(0)) {};
+    }
+
+    // Agent passed to the tree as OctreeAgent, with its octant extension found once per call
+    template<class L, class N, class P>
+    class OctreeOctantAgent : public OctreeStaticAgent<OctreeOctantAgent<L, N, P>, L, N, P> {
+    public:
+        OctreeOctantAgent(const OctreeAgent<L, N, P> *agent, const OctreeAgentOctantExtension<L, N, P> *octantAgent) : agent(agent),
+                                                                                                                       octantAgent(octantAgent),
+                                                                                                                       positionAgent(dynamic_cast<const OctreeAgentPositionExtension<L, N, P> *>(agent)) {}
+
+        bool isItemOverlappingCell(const L *item, const OctreeVec3<P> &cellCenter, const P &cellRadius) const {
+            return agent->isItemOverlappingCell(item, cellCenter, cellRadius);
+        }
+
+        int GetItemOctant(const L *item, const OctreeVec3<P> &cellCenter) const {
+            return octantAgent->GetItemOctant(item, cellCenter);
+        }
+
+        // Only used by trees that keep leaf positions
+        OctreeVec3<P> GetItemPosition(const L *item) const {
+            assert(positionAgent != nullptr && "Leaf positions require an agent with GetItemPosition");
+            return positionAgent->GetItemPosition(item);
+        }
+
+    private:
+        const OctreeAgent<L, N, P> *agent;
+        const OctreeAgentOctantExtension<L, N, P> *octantAgent;
+        const OctreeAgentPositionExtension<L, N, P> *positionAgent;
+    };
+
+    // Auto adjust agent of an agent: the extension of a virtual agent, found with dynamic_cast,
+    // or the static agent itself when it implements the auto adjust methods
+    template<class T, class L, class N, class P, class Enable = void>
+    struct OctreeAutoAdjustAgent {
+        typedef OctreeAgentAutoAdjustExtension<L, N, P> type;
+        static const type *get(const T *agent) { return dynamic_cast<const type *>(agent); }
+    };
+
+    template<class T, class L, class N, class P>
+    struct OctreeAutoAdjustAgent<T, L, N, P, typename std::enable_if<sfinae::is_static_agent<T, L, N, P>::value &&
+                                                                     sfinae::has_autoAdjust<T, L, P>::value>::type> {
+        typedef T type;
+        static const type *get(const T *agent) { return agent; }
+    };
+
+    template<class T, class L, class N, class P>
+    struct OctreeAutoAdjustAgent<T, L, N, P, typename std::enable_if<sfinae::is_static_agent<T, L, N, P>::value &&
+                                                                     !sfinae::has_autoAdjust<T, L, P>::value>::type> {
+        typedef OctreeAgentAutoAdjustExtension<L, N, P> type;
+        static const type *get(const T *) { return nullptr; }
+    };
+
+    // Agent that gives the positions kept in the leaves, the agent itself when its type has GetItemPosition
+    template<class T, class L, class N, class P, class Enable = void>
+    struct OctreePositionAgent {
+        typedef OctreeAgentPositionExtension<L, N, P> type;
+        static const type *get(const T *agent) { return dynamic_cast<const type *>(agent); }
+    };
+
+    template<class T, class L, class N, class P>
+    struct OctreePositionAgent<T, L, N, P, typename std::enable_if<sfinae::has_position<T, L, P>::value>::type> {
+        typedef T type;
+        static const type *get(const T *agent) { return agent; }
+    };
+
+    template<class T, class L, class N, class P>
+    struct OctreePositionAgent<T, L, N, P, typename std::enable_if<sfinae::is_static_agent<T, L, N, P>::value &&
+                                                                   !sfinae::has_position<T, L, P>::value>::type> {
+        typedef OctreeAgentPositionExtension<L, N, P> type;
+        static const type *get(const T *) { return nullptr; }
+    };
+
+    template<class L, class N, class P, class C> //L=LeafDataType N=NodeDataType P=Precision C=CellPolicy
+    template <class T>
+    bool OctreeCell<L, N, P, C>::insertIntoLeaf(const L *item, const T *agent) {
+        for(auto& d : data) {
+            if (sfinae::pointer_equality<const L*, const L*>::isEqual(item, d)) {
+                OCTREE_COUNT(duplicatesRejected, 1);
+                return false;
+            }
+        }
+        if (maxItemsPerCell <= data.size()) {
+            makeBranch(data, item, agent);
+        } else {
+            if (data.size() == data.capacity()) {
+                data.reserve(getLeafCapacity(data.capacity()));
+            }
+            if (positions && positions.size() == positions.capacity()) {
+                positions.reserve(getLeafCapacity(positions.capacity()));
+            }
+            data.push_back(item);
+            if (positions) {
+                positions.push(getItemPosition(item, agent));
+            }
+            itemsCount++;
+        }
+        return true;
+    }
+
+    template<class L, class N, class P, class C> //L=LeafDataType N=NodeDataType P=Precision C=CellPolicy
+    template <class T>
+    bool OctreeCell<L, N, P, C>::remove(const L *item, const T *agent, bool ancestorCollapses) {
+        if(getCellType() == OctreeCellType::Leaf) {
+            for (unsigned int i = 0; i < data.size(); ++i) {
+                if (data[i] == item) {
+                    data[i] = data.back();
+                    data.pop_back();
+                    if (positions) {
+                        positions.remove(i);
+                    }
+                    itemsCount--;
+                    return true;
+                }
+            }
+            return false;
+        } else {
+            // Only the topmost branch that falls below maxItemsPerCell is collapsed
+            bool collapses = itemsCount - 1 < maxItemsPerCell;
+            int index = getChildIndex(item, agent);
+            if (index < 0 || !childs[index]->remove(item, agent, ancestorCollapses || collapses)) {
+                return false;
+            }
+            itemsCount--;
+            if (collapses && !ancestorCollapses) {
+                collapse();
+            }
+            return true;
+        }
+    }
+
+    template<class L, class N, class P, class C> //L=LeafDataType N=NodeDataType P=Precision C=CellPolicy
+    template <class T>
+    int OctreeCell<L, N, P, C>::getChildIndex(const L *item, const T *agent) const {
+        return getChildIndex(item, center, radius, agent);
+    }
+
+    template<class L, class N, class P, class C> //L=LeafDataType N=NodeDataType P=Precision C=CellPolicy
+    template <class T>
+    int OctreeCell<L, N, P, C>::getChildIndex(const L *item,
+                                              const OctreeVec3<P> &center,
+                                              P radius,
+                                              const T *agent) {
+        return getChildIndex(item, center, radius, agent, sfinae::has_octant<T, L, P>());
+    }
+
+    template<class L, class N, class P, class C> //L=LeafDataType N=NodeDataType P=Precision C=CellPolicy
+    template <class T>
+    int OctreeCell<L, N, P, C>::getChildIndex(const L *item,
+                                              const OctreeVec3<P> &center,
+                                              P radius,
+                                              const T *agent,
+                                              std::true_type) {
+        return agent->GetItemOctant(item, center);
+    }
+
+    template<class L, class N, class P, class C> //L=LeafDataType N=NodeDataType P=Precision C=CellPolicy
+    template <class T>
+    int OctreeCell<L, N, P, C>::getChildIndex(const L *item,
+                                              const OctreeVec3<P> &center,
+                                              P radius,
+                                              const T *agent,
+                                              std::false_type) {
+        P halfRadius = radius / P(2);
+        for (int i = 0; i < 8; ++i) {
+            OctreeVec3<P> newCenter = center + getCenterDelta(i, halfRadius);
+            OCTREE_COUNT(overlapTests, 1);
+            if (agent->isItemOverlappingCell(item, newCenter, halfRadius)) {
+                return i;
+            }
+        }
+        return -1;
+    }
+
+    template<class L, class N, class P, class C> //L=LeafDataType N=NodeDataType P=Precision C=CellPolicy
+    void OctreeCell<L, N, P, C>::collapse() {
+        LeafItems items;
+        items.reserve(itemsCount);
+        collectItems(items);
+        if (hasLeafPositions()) {
+            positions.enable();
+            positions.reserve(items.size());
+            collectPositions(positions);
+        }
+        for (int i = 0; i < 8; ++i) {
+            childs[i].reset();
+        }
+        data.swap(items);
+        state.type.store(OctreeCellType::Leaf, std::memory_order_relaxed);
+    }
+
+    template<class L, class N, class P, class C> //L=LeafDataType N=NodeDataType P=Precision C=CellPolicy
+    void OctreeCell<L, N, P, C>::moveCell(OctreeVec3<P> center, P radius) {
+        assert(this->isLeaf());
+        this->center = center;
+        this->radius = radius;
+    }
+
+    template<class L, class N, class P, class C> //L=LeafDataType N=NodeDataType P=Precision C=CellPolicy
+    unsigned int OctreeCell<L, N, P, C>::forceCountItems() const {
+        ReadGuard guard(*this);
+        if(guard.isLeaf()) {
+            return (unsigned int)data.size();
+        } else {
+            unsigned int items = 0;
+            for (int i = 0; i < 8; ++i) {
+                items += childs[i]->forceCountItems();
+            }
+            return items;
+        }
+    }
+
+    template<class L, class N, class P, class C> //L=LeafDataType N=NodeDataType P=Precision C=CellPolicy
+    void OctreeCell<L, N, P, C>::visit(const OctreeVisitor<L, N, P, C> *visitor) const {
+        ReadGuard guard(*this);
+        if(guard.isLeaf()) {
+            visitor->visitLeaf(this, data);
+        } else {
+            visitor->visitBranch(this, childs);
+        }
+    }
+
+    template<class L, class N, class P, class C> //L=LeafDataType N=NodeDataType P=Precision C=CellPolicy
+    void OctreeCell<L, N, P, C>::visit(const OctreeVisitorThreaded<L, N, P, C> *visitor) const {
+        ReadGuard guard(*this);
+        if(guard.isLeaf()) {
+            visitor->visitLeaf(this, data);
+        } else {
+            visitor->visitBranch(this, childs);
+        }
+    }
 
+    template<class L, class N, class P, class C> //L=LeafDataType N=NodeDataType P=Precision C=CellPolicy
+    template <class Items>
+    void OctreeCell<L, N, P, C>::collectItems(Items &items) const {
+        ReadGuard guard(*this);
+        if(guard.isLeaf()) {
+            items.insert(items.end(), data.begin(), data.end());
+        } else {
+            for (int i = 0; i < 8; ++i) {
+                childs[i]->collectItems(items);
+            }
+        }
+    }
 
-        bool up = index < 4;//+y
-        bool right = (bool) (index & 1);//+x
-        bool front = (bool) (index & 2); //+z
-        return OctreeVec3<P>(right ? halfRadius : -halfRadius,
-                             up ? halfRadius : -halfRadius,
-                             front ? halfRadius : -halfRadius);
+    // Same order as collectItems()
+    template<class L, class N, class P, class C> //L=LeafDataType N=NodeDataType P=Precision C=CellPolicy
+    void OctreeCell<L, N, P, C>::collectPositions(OctreeLeafPositions<P> &positions) const {
+        if(getCellType() == OctreeCellType::Leaf) {
+            positions.append(this->positions);
+        } else {
+            for (int i = 0; i < 8; ++i) {
+                childs[i]->collectPositions(positions);
+            }
+        }
+    }
+
+    // Either every leaf of a tree keeps positions or none does
+    template<class L, class N, class P, class C> //L=LeafDataType N=NodeDataType P=Precision C=CellPolicy
+    bool OctreeCell<L, N, P, C>::hasLeafPositions() const {
+        if(getCellType() == OctreeCellType::Leaf) {
+            return bool(positions);
+        }
+        return childs[0]->hasLeafPositions();
+    }
+
+    template<class L, class N, class P, class C> //L=LeafDataType N=NodeDataType P=Precision C=CellPolicy
+    template <class T>
+    void OctreeCell<L, N, P, C>::addLeafPositions(const T *agent) {
+        if(getCellType() == OctreeCellType::Leaf) {
+            positions.reset();
+            positions.enable();
+            positions.reserve(data.size());
+            for (auto &item : data) {
+                positions.push(getItemPosition(item, agent));
+            }
+        } else {
+            for (int i = 0; i < 8; ++i) {
+                childs[i]->addLeafPositions(agent);
+            }
+        }
+    }
+
+    template<class L, class N, class P, class C> //L=LeafDataType N=NodeDataType P=Precision C=CellPolicy
+    template <class T>
+    OctreeVec3<P> OctreeCell<L, N, P, C>::getItemPosition(const L *item, const T *agent) {
+        auto positionAgent = OctreePositionAgent<T, L, N, P>::get(agent);
+        assert(positionAgent != nullptr && "Leaf positions require an agent with GetItemPosition");
+        return positionAgent->GetItemPosition(item);
+    }
+
+    template<class P> // P=Precision
+    bool isPointInsideBox(const OctreeVec3<P> &point, const OctreeVec3<P> &min, const OctreeVec3<P> &max) {
+        return point.x >= min.x && point.x <= max.x &&
+               point.y >= min.y && point.y <= max.y &&
+               point.z >= min.z && point.z <= max.z;
+    }
+
+    template<class P> // P=Precision
+    P getSquaredDistance(const OctreeVec3<P> &a, const OctreeVec3<P> &b) {
+        OctreeVec3<P> d = a - b;
+        return d.x * d.x + d.y * d.y + d.z * d.z;
+    }
+
+    template<class P> // P=Precision
+    P getSquaredDistanceToCell(const OctreeVec3<P> &point, const OctreeVec3<P> &cellCenter, P cellRadius) {
+        P dx = std::max(P(0), std::abs(point.x - cellCenter.x) - cellRadius);
+        P dy = std::max(P(0), std::abs(point.y - cellCenter.y) - cellRadius);
+        P dz = std::max(P(0), std::abs(point.z - cellCenter.z) - cellRadius);
+        return dx * dx + dy * dy + dz * dz;
+    }
+
+    template<class P> // P=Precision
+    P getSquaredDistanceToCellCorner(const OctreeVec3<P> &point, const OctreeVec3<P> &cellCenter, P cellRadius) {
+        P dx = std::abs(point.x - cellCenter.x) + cellRadius;
+        P dy = std::abs(point.y - cellCenter.y) + cellRadius;
+        P dz = std::abs(point.z - cellCenter.z) + cellRadius;
+        return dx * dx + dy * dy + dz * dz;
+    }
+
+    // How a cell lies against a query region, an Inside cell takes all of its items without looking at them
+    enum class OctreeCellOverlap : uint8_t {
+        Outside,
+        Inside,
+        Partial
+    };
+
+    template<class P> // P=Precision
+    OctreeCellOverlap getBoxCellOverlap(const OctreeVec3<P> &min, const OctreeVec3<P> &max, const OctreeVec3<P> &cellCenter, P cellRadius) {
+        OctreeVec3<P> cellMin = cellCenter - OctreeVec3<P>(cellRadius);
+        OctreeVec3<P> cellMax = cellCenter + OctreeVec3<P>(cellRadius);
+
+        if (cellMax.x < min.x || cellMin.x > max.x ||
+            cellMax.y < min.y || cellMin.y > max.y ||
+            cellMax.z < min.z || cellMin.z > max.z) {
+            return OctreeCellOverlap::Outside;
+        }
+        if (isPointInsideBox(cellMin, min, max) && isPointInsideBox(cellMax, min, max)) {
+            return OctreeCellOverlap::Inside;
+        }
+        return OctreeCellOverlap::Partial;
+    }
+
+    template<class P> // P=Precision
+    OctreeCellOverlap getSphereCellOverlap(const OctreeVec3<P> &point, P squaredRadius, const OctreeVec3<P> &cellCenter, P cellRadius) {
+        if (getSquaredDistanceToCell(point, cellCenter, cellRadius) > squaredRadius) {
+            return OctreeCellOverlap::Outside;
+        }
+        if (getSquaredDistanceToCellCorner(point, cellCenter, cellRadius) <= squaredRadius) {
+            return OctreeCellOverlap::Inside;
+        }
+        return OctreeCellOverlap::Partial;
+    }
+
+    template<class L, class N, class P, class C> //L=LeafDataType N=NodeDataType P=Precision C=CellPolicy
+    template <class T>
+    void OctreeCell<L, N, P, C>::queryBox(const OctreeVec3<P> &min,
+                                          const OctreeVec3<P> &max,
+                                          const T *agent,
+                                          std::vector<const L *> &items) const {
+        OctreeCellOverlap overlap = getBoxCellOverlap(min, max, center, radius);
+        if (overlap == OctreeCellOverlap::Outside) {
+            return;
+        }
+        if (overlap == OctreeCellOverlap::Inside) {
+            collectItems(items);
+            return;
+        }
+        ReadGuard guard(*this);
+        if(guard.isLeaf()) {
+            if (positions) {
+                uint8_t inside[OctreeLeafScanBlock];
+                for (size_t begin = 0; begin < data.size(); begin += OctreeLeafScanBlock) {
+                    size_t end = std::min(data.size(), begin + OctreeLeafScanBlock);
+                    positions.markInsideBox(min, max, begin, end, inside);
+                    for (size_t i = begin; i < end; ++i) {
+                        if (inside[i - begin]) {
+                            items.push_back(data[i]);
+                        }
+                    }
+                }
+                return;
+            }
+            for (auto &item : data) {
+                if (isPointInsideBox(agent->GetItemPosition(item), min, max)) {
+                    items.push_back(item);
+                }
+            }
+        } else {
+            for (int i = 0; i < 8; ++i) {
+                childs[i]->queryBox(min, max, agent, items);
+            }
+        }
+    }
+
+    template<class L, class N, class P, class C> //L=LeafDataType N=NodeDataType P=Precision C=CellPolicy
+    template <class T>
+    void OctreeCell<L, N, P, C>::queryRadius(const OctreeVec3<P> &point,
+                                             P squaredRadius,
+                                             const T *agent,
+                                             std::vector<const L *> &items) const {
+        OctreeCellOverlap overlap = getSphereCellOverlap(point, squaredRadius, center, radius);
+        if (overlap == OctreeCellOverlap::Outside) {
+            return;
+        }
+        if (overlap == OctreeCellOverlap::Inside) {
+            collectItems(items);
+            return;
+        }
+        ReadGuard guard(*this);
+        if(guard.isLeaf()) {
+            if (positions) {
+                uint8_t inside[OctreeLeafScanBlock];
+                for (size_t begin = 0; begin < data.size(); begin += OctreeLeafScanBlock) {
+                    size_t end = std::min(data.size(), begin + OctreeLeafScanBlock);
+                    positions.markInsideRadius(point, squaredRadius, begin, end, inside);
+                    for (size_t i = begin; i < end; ++i) {
+                        if (inside[i - begin]) {
+                            items.push_back(data[i]);
+                        }
+                    }
+                }
+                return;
+            }
+            for (auto &item : data) {
+                if (getSquaredDistance(point, agent->GetItemPosition(item)) <= squaredRadius) {
+                    items.push_back(item);
+                }
+            }
+        } else {
+            for (int i = 0; i < 8; ++i) {
+                childs[i]->queryRadius(point, squaredRadius, agent, items);
+            }
+        }
+    }
+
+    template<class L, class N, class P, class C> //L=LeafDataType N=NodeDataType P=Precision C=CellPolicy
+    template <class T>
+    unsigned int OctreeCell<L, N, P, C>::countRadius(const OctreeVec3<P> &point,
+                                                     P squaredRadius,
+                                                     const T *agent) const {
+        OctreeCellOverlap overlap = getSphereCellOverlap(point, squaredRadius, center, radius);
+        if (overlap == OctreeCellOverlap::Outside) {
+            return 0;
+        }
+        if (overlap == OctreeCellOverlap::Inside) {
+            return itemsCount;
+        }
+        unsigned int count = 0;
+        ReadGuard guard(*this);
+        if(guard.isLeaf()) {
+            if (positions) {
+                return positions.countInsideRadius(point, squaredRadius);
+            }
+            for (auto &item : data) {
+                if (getSquaredDistance(point, agent->GetItemPosition(item)) <= squaredRadius) {
+                    count++;
+                }
+            }
+        } else {
+            for (int i = 0; i < 8; ++i) {
+                count += childs[i]->countRadius(point, squaredRadius, agent);
+            }
+        }
+        return count;
+    }
+
+    template<class L, class N, class P, class C> //L=LeafDataType N=NodeDataType P=Precision C=CellPolicy
+    template <class T>
+    unsigned int OctreeCell<L, N, P, C>::countBox(const OctreeVec3<P> &min,
+                                                  const OctreeVec3<P> &max,
+                                                  const T *agent) const {
+        OctreeCellOverlap overlap = getBoxCellOverlap(min, max, center, radius);
+        if (overlap == OctreeCellOverlap::Outside) {
+            return 0;
+        }
+        if (overlap == OctreeCellOverlap::Inside) {
+            return itemsCount;
+        }
+        unsigned int count = 0;
+        ReadGuard guard(*this);
+        if(guard.isLeaf()) {
+            if (positions) {
+                uint8_t inside[OctreeLeafScanBlock];
+                for (size_t begin = 0; begin < data.size(); begin += OctreeLeafScanBlock) {
+                    size_t end = std::min(data.size(), begin + OctreeLeafScanBlock);
+                    positions.markInsideBox(min, max, begin, end, inside);
+                    for (size_t i = begin; i < end; ++i) {
+                        count += inside[i - begin];
+                    }
+                }
+                return count;
+            }
+            for (auto &item : data) {
+                if (isPointInsideBox(agent->GetItemPosition(item), min, max)) {
+                    count++;
+                }
+            }
+        } else {
+            for (int i = 0; i < 8; ++i) {
+                count += childs[i]->countBox(min, max, agent);
+            }
+        }
+        return count;
+    }
+
+    template<class P> // P=Precision
+    bool intersectRayWithSlab(P origin, P direction, P slabCenter, P slabRadius, P &tNear, P &tFar) {
+        if (direction == P(0)) {
+            return std::abs(origin - slabCenter) <= slabRadius;
+        }
+        P t1 = (slabCenter - slabRadius - origin) / direction;
+        P t2 = (slabCenter + slabRadius - origin) / direction;
+        if (t1 > t2) {
+            std::swap(t1, t2);
+        }
+        tNear = std::max(tNear, t1);
+        tFar = std::min(tFar, t2);
+        return tNear <= tFar;
+    }
+
+    template<class P> // P=Precision
+    bool intersectRayWithCell(const OctreeVec3<P> &origin, const OctreeVec3<P> &direction,
+                              const OctreeVec3<P> &cellCenter, P cellRadius, P &tNear) {
+        P tFar = std::numeric_limits<P>::max();
+        tNear = P(0);
+        return intersectRayWithSlab(origin.x, direction.x, cellCenter.x, cellRadius, tNear, tFar) &&
+               intersectRayWithSlab(origin.y, direction.y, cellCenter.y, cellRadius, tNear, tFar) &&
+               intersectRayWithSlab(origin.z, direction.z, cellCenter.z, cellRadius, tNear, tFar);
+    }
+
+    // Child indices XOR-ed with this mask are ordered front to back along the ray (see getCenterDelta)
+    template<class P> // P=Precision
+    int getRayChildOrderMask(const OctreeVec3<P> &direction) {
+        return (direction.x < P(0) ? 1 : 0) | (direction.z < P(0) ? 2 : 0) | (direction.y > P(0) ? 4 : 0);
+    }
+
+    template<class L, class N, class P, class C> //L=LeafDataType N=NodeDataType P=Precision C=CellPolicy
+    template <class T>
+    void OctreeCell<L, N, P, C>::raycast(const OctreeVec3<P> &origin,
+                                         const OctreeVec3<P> &direction,
+                                         int childOrderMask,
+                                         const T *agent,
+                                         OctreeRayHit<L, P> &hit) const {
+        ReadGuard guard(*this);
+        if(guard.isLeaf()) {
+            for (auto &item : data) {
+                P distance;
+                if (agent->IsItemIntersectingRay(item, origin, direction, distance) &&
+                    distance >= P(0) && distance < hit.distance) {
+                    hit.item = item;
+                    hit.distance = distance;
+                }
+            }
+        } else {
+            for (int i = 0; i < 8; ++i) {
+                auto &child = childs[i ^ childOrderMask];
+                P tNear;
+                if (intersectRayWithCell(origin, direction, child->center, child->radius, tNear) && tNear < hit.distance) {
+                    child->raycast(origin, direction, childOrderMask, agent, hit);
+                }
+            }
+        }
+    }
+
+    template<class L, class N, class P, class C> //L=LeafDataType N=NodeDataType P=Precision C=CellPolicy
+    template <class T>
+    void OctreeCell<L, N, P, C>::raycastAll(const OctreeVec3<P> &origin,
+                                            const OctreeVec3<P> &direction,
+                                            P maxDistance,
+                                            int childOrderMask,
+                                            const T *agent,
+                                            std::vector<OctreeRayHit<L, P> > &hits) const {
+        ReadGuard guard(*this);
+        if(guard.isLeaf()) {
+            for (auto &item : data) {
+                P distance;
+                if (agent->IsItemIntersectingRay(item, origin, direction, distance) &&
+                    distance >= P(0) && distance <= maxDistance) {
+                    hits.push_back({item, distance});
+                }
+            }
+        } else {
+            for (int i = 0; i < 8; ++i) {
+                auto &child = childs[i ^ childOrderMask];
+                P tNear;
+                if (intersectRayWithCell(origin, direction, child->center, child->radius, tNear) && tNear <= maxDistance) {
+                    child->raycastAll(origin, direction, maxDistance, childOrderMask, agent, hits);
+                }
+            }
+        }
+    }
+
+    template<class L, class N, class P, class C> //L=LeafDataType N=NodeDataType P=Precision C=CellPolicy
+    bool OctreeCell<L, N, P, C>::isEqual(OctreeCell<L, N, P, C>  const &rhs) const {
+        if(getCellType() != rhs.getCellType()) {
+            return false;
+        }
+        if(getCellType() == OctreeCellType::Leaf) {
+            if (data.size() != rhs.data.size()) {
+                return false;
+            }
+            for (unsigned int i = 0; i < data.size(); ++i) {
+                bool found = false;
+                for (unsigned int j = 0; j < data.size(); ++j) {
+                    if (data[i] == rhs.data[j]) {
+                        found = true;
+                        break;
+                    }
+                }
+                if (!found) {
+                    return false;
+                }
+            }
+        } else {
+            for (int i = 0; i < 8; ++i) {
+                bool equal = *childs[i] == *rhs.childs[i];
+                if (!equal) {
+                    return false;
+                }
+            }
+        }
+        return true;
+    }
+
+    template<class L, class N, class P, class C> //L=LeafDataType N=NodeDataType P=Precision C=CellPolicy
+    template <class T>
+    void OctreeCell<L, N, P, C>::makeBranch(const LeafItems &items, const L *item, const T *agent) {
+        OCTREE_COUNT(splits, 1);
+        OCTREE_COUNT(splitReinserts, items.size());
+        createChilds();
+        itemsCount.store(0);
+        // The cell is still a leaf for everyone, so the items go straight to the children
+        for (unsigned int i = 0; i < items.size(); ++i) {
+            insertIntoChild(items[i], agent);
+        }
+        insertIntoChild(item, agent);
+        LeafItems().swap(data);
+        positions.reset();
+        state.type.store(OctreeCellType::Branch, std::memory_order_release);
+    }
+
+    template<class L, class N, class P, class C> //L=LeafDataType N=NodeDataType P=Precision C=CellPolicy
+    OctreeCellBlock<L, N, P, C>::OctreeCellBlock(unsigned int maxItemsPerCell, OctreeVec3<P> center, P halfRadius) {
+        for (int i = 0; i < 8; ++i) {
+            new (&cells[i]) OctreeCell<L, N, P, C>(maxItemsPerCell, center + getCenterDelta(i, halfRadius), halfRadius, i);
+        }
+    }
+
+    // Children get exactly the geometry insert() tests items against
+    template<class L, class N, class P, class C> //L=LeafDataType N=NodeDataType P=Precision C=CellPolicy
+    void OctreeCell<L, N, P, C>::createChilds() {
+        auto block = std::make_shared<OctreeCellBlock<L, N, P, C> >(maxItemsPerCell, center, radius / P(2));
+        for (int i = 0; i < 8; ++i) {
+            childs[i] = std::shared_ptr<OctreeCell<L, N, P, C> >(block, block->getCell(i));
+            childs[i]->epoch = epoch;
+            if (positions) {
+                childs[i]->positions.enable();
+            }
+        }
+    }
+
+    // Copy of a single cell that shares the children of this one
+    template<class L, class N, class P, class C> //L=LeafDataType N=NodeDataType P=Precision C=CellPolicy
+    std::shared_ptr<OctreeCell<L, N, P, C> > OctreeCell<L, N, P, C>::copy(uint32_t epoch) const {
+        auto cell = std::make_shared<OctreeCell<L, N, P, C> >(maxItemsPerCell, center, radius, cellIndex, getCellType());
+        cell->data = data;
+        cell->positions = positions;
+        for (int i = 0; i < 8; ++i) {
+            cell->childs[i] = childs[i];
+        }
+        cell->itemsCount.store(itemsCount.load());
+        cell->nodeData = nodeData;
+        cell->epoch = epoch;
+        return cell;
+    }
+
+    // Enough levels for the items to spread into leaves if they were uniform, plus one
+    inline unsigned int getMortonLevels(size_t itemsCount, unsigned int maxItemsPerCell) {
+        unsigned int levels = 1;
+        size_t itemsPerCell = itemsCount / std::max(1u, maxItemsPerCell);
+        while (itemsPerCell > 1 && levels < 20) {
+            itemsPerCell /= 8;
+            levels++;
+        }
+        return levels + 1;
+    }
+
+    // LSD radix sort on the lowest bits of the codes, stable so items keep insertion order within a code
+    inline void sortMortonKeys(std::vector<OctreeMortonKey> &keys, unsigned int bits) {
+        std::vector<OctreeMortonKey> sorted(keys.size());
+        for (unsigned int shift = 0; shift < bits; shift += 8) {
+            std::array<size_t, 257> offsets;
+            offsets.fill(0);
+            for (auto &key : keys) {
+                offsets[((key.code >> shift) & 0xFF) + 1]++;
+            }
+            std::partial_sum(offsets.begin(), offsets.end(), offsets.begin());
+            for (auto &key : keys) {
+                sorted[offsets[(key.code >> shift) & 0xFF]++] = key;
+            }
+            keys.swap(sorted);
+        }
+    }
+
+    template<class L> // L=LeafDataType
+    bool hasMoreUniqueItemsThan(const L *items,
+                                const std::vector<OctreeMortonKey> &keys,
+                                size_t begin,
+                                size_t end,
+                                unsigned int limit) {
+        if (end - begin <= limit) {
+            return false;
+        }
+        std::vector<const L *> unique;
+        unique.reserve(limit + 1);
+        for (size_t i = begin; i < end; ++i) {
+            const L *item = &items[keys[i].index];
+            bool found = false;
+            for (auto &u : unique) {
+                if (sfinae::pointer_equality<const L*, const L*>::isEqual(item, u)) {
+                    found = true;
+                    break;
+                }
+            }
+            if (!found) {
+                unique.push_back(item);
+                if (unique.size() > limit) {
+                    return true;
+                }
+            }
+        }
+        return false;
+    }
+
+    // Appends the items of keys[begin, end) in insertion order to items[from, ...), skipping the ones
+    // equal to an item appended before, so the same duplicates are rejected as in insertIntoLeaf()
+    template<class L, class Items> // L=LeafDataType
+    void appendUniqueItems(const L *items,
+                           std::vector<OctreeMortonKey> &keys,
+                           size_t begin,
+                           size_t end,
+                           Items &leafItems,
+                           size_t from) {
+        std::sort(keys.begin() + begin, keys.begin() + end, [](const OctreeMortonKey &a, const OctreeMortonKey &b) {
+            return a.index < b.index;
+        });
+        for (size_t i = begin; i < end; ++i) {
+            const L *item = &items[keys[i].index];
+            bool found = false;
+            for (size_t j = from; j < leafItems.size(); ++j) {
+                if (sfinae::pointer_equality<const L*, const L*>::isEqual(item, leafItems[j])) {
+                    found = true;
+                    break;
+                }
+            }
+            if (!found) {
+                leafItems.push_back(item);
+            }
+        }
+    }
+
+    // keys hold the items of this empty leaf, in insertion order
+    template<class L, class N, class P, class C> //L=LeafDataType N=NodeDataType P=Precision C=CellPolicy
+    template <class T>
+    void OctreeCell<L, N, P, C>::build(const L *items, std::vector<OctreeMortonKey> &keys, const T *agent) {
+        if (!hasMoreUniqueItemsThan(items, keys, 0, keys.size(), maxItemsPerCell)) {
+            buildLeaf(items, keys, 0, keys.size(), agent);
+            return;
+        }
+        unsigned int levels = getMortonLevels(keys.size(), maxItemsPerCell);
+        bool hasUnclassifiedItems = computeMortonCodes(items, keys.data(), keys.data() + keys.size(), levels, center, radius, agent);
+        sortMortonKeys(keys, 3 * levels);
+        buildBranch(items, keys, 0, keys.size(), 0, levels, hasUnclassifiedItems, agent);
+    }
+
+    template<class L, class N, class P, class C> //L=LeafDataType N=NodeDataType P=Precision C=CellPolicy
+    template <class T>
+    bool OctreeCell<L, N, P, C>::computeMortonCodes(const L *items,
+                                                    OctreeMortonKey *begin,
+                                                    OctreeMortonKey *end,
+                                                    unsigned int levels,
+                                                    const OctreeVec3<P> &center,
+                                                    P radius,
+                                                    const T *agent) {
+        bool hasUnclassifiedItems = false;
+        for (OctreeMortonKey *key = begin; key != end; ++key) {
+            OctreeVec3<P> cellCenter = center;
+            P cellRadius = radius;
+            key->code = 0;
+            key->levels = levels;
+            for (unsigned int level = 0; level < levels; ++level) {
+                int index = getChildIndex(&items[key->index], cellCenter, cellRadius, agent);
+                if (index < 0) {
+                    key->code <<= 3 * (levels - level);
+                    key->levels = level;
+                    hasUnclassifiedItems = true;
+                    break;
+                }
+                key->code = (key->code << 3) | uint64_t(index);
+                cellRadius /= P(2);
+                cellCenter = cellCenter + getCenterDelta(index, cellRadius);
+            }
+        }
+        return hasUnclassifiedItems;
+    }
+
+    template<class L, class N, class P, class C> //L=LeafDataType N=NodeDataType P=Precision C=CellPolicy
+    template <class T>
+    void OctreeCell<L, N, P, C>::buildRange(const L *items,
+                                            std::vector<OctreeMortonKey> &keys,
+                                            size_t begin,
+                                            size_t end,
+                                            unsigned int level,
+                                            unsigned int levels,
+                                            bool hasUnclassifiedItems,
+                                            const T *agent,
+                                            std::vector<BuildTask> *tasks,
+                                            unsigned int taskLevel) {
+        if (tasks != nullptr && level == taskLevel) {
+            tasks->push_back({this, begin, end});
+        } else if (!hasMoreUniqueItemsThan(items, keys, begin, end, maxItemsPerCell)) {
+            buildLeaf(items, keys, begin, end, agent);
+        } else if (level == levels) {
+            // The codes are exhausted, so this cell gets codes of its own
+            std::vector<OctreeMortonKey> cellKeys(keys.begin() + begin, keys.begin() + end);
+            std::sort(cellKeys.begin(), cellKeys.end(), [](const OctreeMortonKey &a, const OctreeMortonKey &b) {
+                return a.index < b.index;
+            });
+            build(items, cellKeys, agent);
+        } else {
+            buildBranch(items, keys, begin, end, level, levels, hasUnclassifiedItems, agent, tasks, taskLevel);
+        }
+    }
+
+    template<class L, class N, class P, class C> //L=LeafDataType N=NodeDataType P=Precision C=CellPolicy
+    template <class T>
+    void OctreeCell<L, N, P, C>::buildBranch(const L *items,
+                                             std::vector<OctreeMortonKey> &keys,
+                                             size_t begin,
+                                             size_t end,
+                                             unsigned int level,
+                                             unsigned int levels,
+                                             bool hasUnclassifiedItems,
+                                             const T *agent,
+                                             std::vector<BuildTask> *tasks,
+                                             unsigned int taskLevel) {
+        if (hasUnclassifiedItems) {
+            // Items that no child accepts are dropped, as insert() does
+            end = std::stable_partition(keys.begin() + begin, keys.begin() + end, [level](const OctreeMortonKey &key) {
+                return key.levels > level;
+            }) - keys.begin();
+        }
+        createChilds();
+        positions.reset();
+        itemsCount.store(0);
+        unsigned int shift = 3 * (levels - level - 1);
+        size_t childBegin = begin;
+        for (int i = 0; i < 8; ++i) {
+            size_t childEnd = std::upper_bound(keys.begin() + childBegin, keys.begin() + end, i, [shift](int index, const OctreeMortonKey &key) {
+                return index < int((key.code >> shift) & 7);
+            }) - keys.begin();
+            childs[i]->buildRange(items, keys, childBegin, childEnd, level + 1, levels, hasUnclassifiedItems, agent, tasks, taskLevel);
+            itemsCount += childs[i]->itemsCount;
+            childBegin = childEnd;
+        }
+        state.type.store(OctreeCellType::Branch, std::memory_order_relaxed);
+    }
+
+    template<class L, class N, class P, class C> //L=LeafDataType N=NodeDataType P=Precision C=CellPolicy
+    template <class T>
+    void OctreeCell<L, N, P, C>::buildLeaf(const L *items, std::vector<OctreeMortonKey> &keys, size_t begin, size_t end, const T *agent) {
+        data.reserve(end - begin);
+        appendUniqueItems(items, keys, begin, end, data, 0);
+        if (positions) {
+            positions.reserve(data.size());
+            for (auto &item : data) {
+                positions.push(getItemPosition(item, agent));
+            }
+        }
+        itemsCount.store((unsigned int)data.size());
     }
 
-    template<class L, class N, class P> //L=LeafDataType N=NodeDataType P=Precision
-    bool OctreeCell<L, N, P>::insert(const L *item, const OctreeAgent<L, N, P> *agent) {
-        if(internalCellType == OctreeCellType::Leaf) {
-            return insertIntoLeaf(item, agent);
+    // Adds the subtree to stats. With tasks, subtrees holding at most grain items are queued there instead.
+    template<class L, class N, class P, class C> //L=LeafDataType N=NodeDataType P=Precision C=CellPolicy
+    void OctreeCell<L, N, P, C>::collectStats(OctreeStats &stats,
+                                              unsigned int depth,
+                                              unsigned int grain,
+                                              std::vector<StatsTask> *tasks) const {
+        if (tasks != nullptr && (getCellType() == OctreeCellType::Leaf || itemsCount <= grain)) {
+            tasks->push_back({this, depth});
+            return;
+        }
+        stats.nodes++;
+        stats.cellBytes += sizeof(OctreeCell<L, N, P, C>) - sizeof(N);
+        stats.nodeDataBytes += sizeof(N);
+        if(getCellType() == OctreeCellType::Leaf) {
+            stats.leaves++;
+            if (data.empty()) {
+                stats.emptyLeaves++;
+            }
+            OctreeStats::addToHistogram(stats.depthHistogram, depth);
+            OctreeStats::addToHistogram(stats.occupancyHistogram, data.size());
+            stats.leafDataBytes += getAllocatedBytes(data);
+            if (positions) {
+                stats.leafPositionsBytes += positions.getAllocatedBytes();
+            }
         } else {
-            P halfRadius = this->radius / P(2);
+            stats.branches++;
+            // Children sharing an owner come from one OctreeCellBlock, the others were copied alone
             for (int i = 0; i < 8; ++i) {
-                OctreeVec3<P> newCenter = this->center + getCenterDelta(i, halfRadius);
-                if (agent->isItemOverlappingCell(item, newCenter, halfRadius)) {
-                    return childs[i]->insert(item, agent);
+                int sharing = 0;
+                bool counted = false;
+                for (int j = 0; j < 8; ++j) {
+                    if (!childs[i].owner_before(childs[j]) && !childs[j].owner_before(childs[i])) {
+                        counted = counted || j < i;
+                        sharing++;
+                    }
+                }
+                if (!counted) {
+                    stats.controlBlockBytes += sharing > 1 ? getBlockControlBytes() : getCellControlBytes();
                 }
             }
-            return false;
+            for (int i = 0; i < 8; ++i) {
+                childs[i]->collectStats(stats, depth + 1, grain, tasks);
+            }
         }
     }
 
-    template<class L, class N, class P> //L=LeafDataType N=NodeDataType P=Precision
-    bool OctreeCell<L, N, P>::insertInThread(const L *item, const OctreeAgent<L, N, P> *agent) {
-        if(internalCellType == OctreeCellType::Leaf) {
-            return insertIntoLeaf(item, agent);
-        } else {
-            P halfRadius = this->radius / P(2);
+    template<class L, class N, class P, class C> //L=LeafDataType N=NodeDataType P=Precision C=CellPolicy
+    size_t OctreeCell<L, N, P, C>::getCellControlBytes() {
+        static const size_t bytes = getSharedControlBytes<OctreeCell<L, N, P, C> >(1u, OctreeVec3<P>(), P(1));
+        return bytes;
+    }
+
+    template<class L, class N, class P, class C> //L=LeafDataType N=NodeDataType P=Precision C=CellPolicy
+    size_t OctreeCell<L, N, P, C>::getBlockControlBytes() {
+        static const size_t bytes = getSharedControlBytes<OctreeCellBlock<L, N, P, C> >(1u, OctreeVec3<P>(), P(1)) +
+                                    sizeof(OctreeCellBlock<L, N, P, C>) - 8 * sizeof(OctreeCell<L, N, P, C>);
+        return bytes;
+    }
+
+    // Refreshes the counts of the branches built above the subtrees of the parallel bulk build
+    template<class L, class N, class P, class C> //L=LeafDataType N=NodeDataType P=Precision C=CellPolicy
+    unsigned int OctreeCell<L, N, P, C>::recountItems(unsigned int levels) {
+        if (getCellType() == OctreeCellType::Branch && levels > 0) {
+            unsigned int count = 0;
             for (int i = 0; i < 8; ++i) {
-                OctreeVec3<P> newCenter = this->center + getCenterDelta(i, halfRadius);
-                if (agent->isItemOverlappingCell(item, newCenter, halfRadius)) {
-                    if(childs[i]->isLeaf()) {
-                        std::lock_guard<std::mutex> lock(childs[i]->getMutex());
-                        return childs[i]->insertInThread(item, agent);
-                    } else {
-                        return childs[i]->insertInThread(item, agent);
-                    }
-                }
+                count += childs[i]->recountItems(levels - 1);
             }
-            return true;
+            itemsCount.store(count);
         }
+        return itemsCount;
     }
 
-    // https://en.wikipedia.org/wiki/Substitution_failure_is_not_an_error
-    namespace sfinae {
-        template<class>
-        struct sfinae_true : std::true_type {};
+    template<class L, class N, class P, class C> //L=LeafDataType N=NodeDataType P=Precision C=CellPolicy
+    Octree<L, N, P, C>::Octree(unsigned int maxItemsPerCell,
+                               OctreeVec3<P> center,
+                               P radius,
+                               unsigned int threadsNumber) : center(center),
+                                                          radius(radius),
+                                                          maxItemsPerCell(maxItemsPerCell),
+                                                          threadsNumber(threadsNumber) {
+        if(threadsNumber == 0) {
+            this->threadsNumber = std::thread::hardware_concurrency();
+        }
+        if (this->threadsNumber != 1) {
+            threadPool = std::make_shared<OctreeThreadPool>(this->threadsNumber);
+            this->threadsNumber = threadPool->getThreadsNumber();
+        }
+        root = std::make_shared<OctreeCell<L, N, P, C> >(maxItemsPerCell, center, radius);
+        itemsCount.store(0);
+    }
 
-        template<class T, class A0>
-        static auto test_equalityOp(int) -> sfinae_true<decltype(*std::declval<T>() == *std::declval<T>())>;
+    template<class L, class N, class P, class C> //L=LeafDataType N=NodeDataType P=Precision C=CellPolicy
+    Octree<L, N, P, C>::Octree(unsigned int maxItemsPerCell,
+                               OctreeVec3<P> center,
+                               P radius,
+                               std::shared_ptr<OctreeThreadPool> threadPool) : center(center),
+                                                                            radius(radius),
+                                                                            maxItemsPerCell(maxItemsPerCell),
+                                                                            threadsNumber(threadPool ? threadPool->getThreadsNumber() : 1),
+                                                                            threadPool(threadPool) {
+        assert(threadPool && "The thread pool must not be null");
+        root = std::make_shared<OctreeCell<L, N, P, C> >(maxItemsPerCell, center, radius);
+        itemsCount.store(0);
+    }
 
-        template<class, class A0>
-        static auto test_equalityOp(long) -> std::false_type;
+    template<class L, class N, class P, class C> //L=LeafDataType N=NodeDataType P=Precision C=CellPolicy
+    void Octree<L, N, P, C>::clear() {
+        root = std::make_shared<OctreeCell<L, N, P, C> >(maxItemsPerCell, center, radius);
+        root->epoch = epoch;
+        if (leafPositionsEnabled) {
+            root->positions.enable();
+        }
+        itemsCount.store(0);
+        publishSnapshot();
+    }
 
-        template<class T, class L, bool>
-        struct equality {
-            static inline bool isEqual(T t, L l) {return t == l;}
-        };
+    template<class L, class N, class P, class C> //L=LeafDataType N=NodeDataType P=Precision C=CellPolicy
+    Octree<L, N, P, C>::Octree(const Octree<L, N, P, C> *tree) : center(tree->center),
+                                                           radius(tree->radius),
+                                                           maxItemsPerCell(tree->maxItemsPerCell),
+                                                           root(tree->root) {
+        itemsCount.store(tree->itemsCount.load());
+    }
 
-        template<class T, class L>
-        struct equality<T, L, true> {
-            static inline bool isEqual(T t, L l) {return t == l || *t == *l;}
-        };
+    template<class L, class N, class P, class C> //L=LeafDataType N=NodeDataType P=Precision C=CellPolicy
+    template <class T>
+    void Octree<L, N, P, C>::enableLeafPositions(const T *agent) {
+        assert(!snapshotsEnabled && "Leaf positions have to be enabled before snapshots");
+        leafPositionsEnabled = true;
+        root->addLeafPositions(agent);
+    }
 
-        template<class T, class Arg>
-        struct pointer_equality : decltype(test_equalityOp<T, Arg>(0)) {
-            static_assert(std::is_pointer<T>::value && std::is_pointer<Arg>::value, "Template arguments must be pointers");
+    template<class L, class N, class P, class C> //L=LeafDataType N=NodeDataType P=Precision C=CellPolicy
+    void Octree<L, N, P, C>::enableSnapshots() {
+        snapshotsEnabled = true;
+        publishSnapshot();
+    }
 
-            static bool isEqual(T t, Arg l) {
-                return equality<T, Arg, decltype(test_equalityOp<T, Arg>(0))::value>::isEqual(t, l);
+    template<class L, class N, class P, class C> //L=LeafDataType N=NodeDataType P=Precision C=CellPolicy
+    std::shared_ptr<const Octree<L, N, P, C> > Octree<L, N, P, C>::snapshot() const {
+        return std::atomic_load(&publishedSnapshot);
+    }
+
+    // Cells of older epochs may be reachable from a published version, the next change copies them
+    template<class L, class N, class P, class C> //L=LeafDataType N=NodeDataType P=Precision C=CellPolicy
+    void Octree<L, N, P, C>::publishSnapshot() {
+        if (snapshotsEnabled) {
+            std::atomic_store(&publishedSnapshot, std::shared_ptr<const Octree<L, N, P, C> >(new Octree<L, N, P, C>(this)));
+            epoch++;
+        }
+    }
+
+    template<class L, class N, class P, class C> //L=LeafDataType N=NodeDataType P=Precision C=CellPolicy
+    void Octree<L, N, P, C>::makeRootWritable() {
+        if (snapshotsEnabled && root->epoch != epoch) {
+            root = root->copy(epoch);
+        }
+    }
+
+    // Copies the cells an insert, remove or update of the item walks through, in place changes
+    // then only touch cells of the current epoch
+    template<class L, class N, class P, class C> //L=LeafDataType N=NodeDataType P=Precision C=CellPolicy
+    template <class T>
+    void Octree<L, N, P, C>::makePathWritable(const L *item, const T *agent) {
+        if (!snapshotsEnabled) {
+            return;
+        }
+        makeRootWritable();
+        OctreeCell<L, N, P, C> *cell = root.get();
+        while (!cell->isLeaf()) {
+            int index = cell->getChildIndex(item, agent);
+            if (index < 0) {
+                return;
             }
-        };
+            auto &child = cell->childs[index];
+            if (child->epoch != epoch) {
+                child = child->copy(epoch);
+            }
+            cell = child.get();
+        }
     }
 
-    template<class L, class N, class P> //L=LeafDataType N=NodeDataType P=Precision
-    bool OctreeCell<L, N, P>::insertIntoLeaf(const L *item, const OctreeAgent<L, N, P> *agent) {
-        for(auto& d : data) {
-            if (sfinae::pointer_equality<const L*, const L*>::isEqual(item, d)) {
+    template<class L, class N, class P, class C> //L=LeafDataType N=NodeDataType P=Precision C=CellPolicy
+    template <class T>
+    void Octree<L, N, P, C>::insert(const L *item, const T *agent) {
+        static_assert(sfinae::is_agent<T, L, N, P>::value, "Agent has wrong class");
+        OCTREE_COUNTERS_SCOPE();
+        OCTREE_COUNT(overlapTests, 1);
+        if (agent->isItemOverlappingCell(item, center, radius)) {
+            makePathWritable(item, agent);
+            if(root->insert(item, agent)) {
+                itemsCount.fetch_add(1);
+            }
+        }
+        publishSnapshot();
+    }
+
+    template<class L, class N, class P, class C> //L=LeafDataType N=NodeDataType P=Precision C=CellPolicy
+    template <class T>
+    void Octree<L, N, P, C>::concurrentInsert(const L *item, const T *agent) {
+        static_assert(sfinae::is_agent<T, L, N, P>::value, "Agent has wrong class");
+        static_assert(C::concurrentInserts, "concurrentInsert() needs a cell policy with a lock in every cell");
+        OCTREE_COUNTERS_SCOPE();
+        assert(!snapshotsEnabled && "Snapshots require a single writer");
+        if (insertIntoRoot(item, agent)) {
+            itemsCount.fetch_add(1);
+        }
+    }
+
+    // A thread that finds a leaf locks it and checks again, since the leaf may have become a branch
+    // in between. Branches are published with their children filled, so they are walked without locks.
+    template<class L, class N, class P, class C> //L=LeafDataType N=NodeDataType P=Precision C=CellPolicy
+    template <class T>
+    bool Octree<L, N, P, C>::insertIntoRoot(const L *item, const T *agent) {
+        OCTREE_COUNT(overlapTests, 1);
+        if (!agent->isItemOverlappingCell(item, center, radius)) {
+            return false;
+        }
+        if (root->isLeaf()) {
+            OctreeLeafLock<typename C::Lock> lock(root->getLock());
+            return root->insertInThread(item, agent);
+        }
+        return root->insertInThread(item, agent);
+    }
+
+    template<class L, class N, class P, class C> //L=LeafDataType N=NodeDataType P=Precision C=CellPolicy
+    template <class T>
+    bool Octree<L, N, P, C>::remove(const L *item, const T *agent) {
+        OCTREE_COUNTERS_SCOPE();
+        OCTREE_COUNT(overlapTests, 1);
+        if (agent->isItemOverlappingCell(item, center, radius)) {
+            makePathWritable(item, agent);
+            if(root->remove(item, agent, false)) {
+                itemsCount.fetch_sub(1);
+                publishSnapshot();
+                return true;
+            }
+        }
+        return false;
+    }
+
+    template<class L, class N, class P, class C> //L=LeafDataType N=NodeDataType P=Precision C=CellPolicy
+    template <class T>
+    bool Octree<L, N, P, C>::update(const L *item, const L *previousItem, const T *agent) {
+        OCTREE_COUNTERS_SCOPE();
+        OCTREE_COUNT(overlapTests, 1);
+        if (!agent->isItemOverlappingCell(previousItem, center, radius)) {
+            return false;
+        }
+        makePathWritable(previousItem, agent);
+        OCTREE_COUNT(overlapTests, 1);
+        if (agent->isItemOverlappingCell(item, center, radius)) {
+            makePathWritable(item, agent);
+        }
+
+        std::vector<OctreeCell<L, N, P, C> *> path;
+        std::vector<int> pathIndices;
+        OctreeCell<L, N, P, C> *leaf = root.get();
+        while (!leaf->isLeaf()) {
+            path.push_back(leaf);
+            int index = leaf->getChildIndex(previousItem, agent);
+            if (index < 0) {
                 return false;
             }
+            pathIndices.push_back(index);
+            leaf = leaf->childs[index].get();
         }
-        if (maxItemsPerCell <= data.size()) {
-            makeBranch(data, item, agent);
+
+        auto position = std::find(leaf->data.begin(), leaf->data.end(), item);
+        if (position == leaf->data.end()) {
+            return false;
+        }
+
+        // The item stays only if insert() would still pick the same leaf, an item on a shared face
+        // of two cells belongs to the first of them
+        int ancestor = -1;
+        OCTREE_COUNT(overlapTests, 1);
+        if (agent->isItemOverlappingCell(item, center, radius)) {
+            ancestor = 0;
+            while (ancestor < (int)path.size() && path[ancestor]->getChildIndex(item, agent) == pathIndices[ancestor]) {
+                ancestor++;
+            }
+            if (ancestor == (int)path.size()) {
+                if (leaf->positions) {
+                    leaf->positions.set(position - leaf->data.begin(), OctreeCell<L, N, P, C>::getItemPosition(item, agent));
+                }
+                publishSnapshot();
+                return true;
+            }
+        }
+
+        if (leaf->positions) {
+            leaf->positions.remove(position - leaf->data.begin());
+        }
+        *position = leaf->data.back();
+        leaf->data.pop_back();
+        leaf->itemsCount--;
+        for (unsigned int i = ancestor + 1; i < path.size(); ++i) {
+            path[i]->itemsCount--;
+        }
+        for (unsigned int i = ancestor + 1; i < path.size(); ++i) {
+            if (path[i]->itemsCount < maxItemsPerCell) {
+                path[i]->collapse();
+                break;
+            }
+        }
+
+        if (ancestor >= 0) {
+            int index = path[ancestor]->getChildIndex(item, agent);
+            if (index >= 0 && path[ancestor]->childs[index]->insert(item, agent)) {
+                publishSnapshot();
+                return true;
+            }
+        }
+
+        // The item left the tree or was rejected as a duplicate in its new leaf
+        for (int i = 0; i <= ancestor; ++i) {
+            path[i]->itemsCount--;
+        }
+        for (int i = 0; i <= ancestor; ++i) {
+            if (path[i]->itemsCount < maxItemsPerCell) {
+                path[i]->collapse();
+                break;
+            }
+        }
+        itemsCount.fetch_sub(1);
+        publishSnapshot();
+        return false;
+    }
+
+    template<class L, class N, class P, class C> //L=LeafDataType N=NodeDataType P=Precision C=CellPolicy
+    void Octree<L, N, P, C>::insert(const L *items,
+                                    const unsigned int itemsCount,
+                                    const OctreeAgent<L, N, P> *agentInsert,
+                                    const OctreeAgentAutoAdjustExtension<L, N, P> *agentAdjust,
+                                    bool autoAdjustTree) {
+        auto octantAgent = dynamic_cast<const OctreeAgentOctantExtension<L, N, P> *>(agentInsert);
+        if (octantAgent != nullptr) {
+            OctreeOctantAgent<L, N, P> agent(agentInsert, octantAgent);
+            insertItems(items, itemsCount, &agent, agentAdjust, autoAdjustTree);
         } else {
-            data.push_back(item);
+            insertItems(items, itemsCount, agentInsert, agentAdjust, autoAdjustTree);
         }
-        return true;
     }
 
-    template<class L, class N, class P> //L=LeafDataType N=NodeDataType P=Precision
-    void OctreeCell<L, N, P>::moveCell(OctreeVec3<P> center, P radius) {
-        assert(this->isLeaf());
-        this->center = center;
-        this->radius = radius;
+    template<class L, class N, class P, class C> //L=LeafDataType N=NodeDataType P=Precision C=CellPolicy
+    template <class T, class U>
+    void Octree<L, N, P, C>::insertItems(const L *items,
+                                         const unsigned int itemsCount,
+                                         const T *agentInsert,
+                                         const U *agentAdjust,
+                                         bool autoAdjustTree) {
+
+        OCTREE_COUNTERS_SCOPE();
+        assert((autoAdjustTree || radius > P(0)) && "Radius has to be > 0");
+
+        if (autoAdjustTree && agentAdjust != nullptr && this->itemsCount == 0) {
+            makeRootWritable();
+            adjustToItems(items, itemsCount, agentAdjust);
+        }
+
+        // Cells created by the inserts belong to the current epoch, so copying the paths up front is enough
+        if (snapshotsEnabled) {
+            for (unsigned int i = 0; i < itemsCount; ++i) {
+                OCTREE_COUNT(overlapTests, 1);
+                if (agentInsert->isItemOverlappingCell(&items[i], center, radius)) {
+                    makePathWritable(&items[i], agentInsert);
+                }
+            }
+        }
+
+        if (threadsNumber != 1 && C::concurrentInserts) {
+            std::atomic_uint nextItem(0);
+            runInThreads([&](unsigned int thread) {
+                OctreeTraceSpan span(tracer.get(), thread, "insertThread");
+                insertThread(items, itemsCount, nextItem, agentInsert);
+            });
+        } else {
+            for (unsigned int i = 0; i < itemsCount; ++i) {
+                OCTREE_COUNT(overlapTests, 1);
+                if (agentInsert->isItemOverlappingCell(&items[i], center, radius)) {
+                    if(root->insert(&items[i], agentInsert)) {
+                        this->itemsCount++;
+                    }
+                }
+            }
+        }
+        publishSnapshot();
     }
 
-    template<class L, class N, class P> //L=LeafDataType N=NodeDataType P=Precision
-    unsigned int OctreeCell<L, N, P>::forceCountItems() const {
-        if(internalCellType == OctreeCellType::Leaf) {
-            return (unsigned int)data.size();
+    template<class L, class N, class P, class C> //L=LeafDataType N=NodeDataType P=Precision C=CellPolicy
+    template <class T>
+    void Octree<L, N, P, C>::insert(const L *items,
+                                    const unsigned int itemsCount,
+                                    const T *agent,
+                                    bool autoAdjustTree) {
+
+        static_assert(sfinae::is_agent<T, L, N, P>::value, "Agent has wrong class");
+
+        auto adj = OctreeAutoAdjustAgent<T, L, N, P>::get(agent);
+        if(autoAdjustTree && adj == nullptr) {
+            //printf("WARNING: To use auto adjust agent has to implement OctreeAgentAutoAdjustExtension\n");
+            insertItems(items, itemsCount, agent, adj, false);
         } else {
-            unsigned int items = 0;
-            for (int i = 0; i < 8; ++i) {
-                items += childs[i]->forceCountItems();
+            insertItems(items, itemsCount, agent, adj, autoAdjustTree);
+        }
+    }
+
+    template<class L, class N, class P, class C> //L=LeafDataType N=NodeDataType P=Precision C=CellPolicy
+    template <class T>
+    void Octree<L, N, P, C>::insert(const L *items,
+                                    const unsigned int itemsCount,
+                                    const T *agent) {
+
+        static_assert(sfinae::is_agent<T, L, N, P>::value, "Agent has wrong class");
+        auto adj = OctreeAutoAdjustAgent<T, L, N, P>::get(agent);
+        insertItems(items, itemsCount, agent, adj, adj != nullptr);
+    }
+
+    template<class L, class N, class P, class C> //L=LeafDataType N=NodeDataType P=Precision C=CellPolicy
+    void Octree<L, N, P, C>::insert(std::vector<L> &items,
+                                    const OctreeAgent<L, N, P> *agentInsert,
+                                    const OctreeAgentAutoAdjustExtension<L, N, P> *agentAdjust,
+                                    bool autoAdjustTree) {
+        insert(items.data(), (unsigned int)items.size(), agentInsert, agentAdjust, autoAdjustTree);
+    }
+
+    template<class L, class N, class P, class C> //L=LeafDataType N=NodeDataType P=Precision C=CellPolicy
+    template <class T>
+    void Octree<L, N, P, C>::insert(std::vector<L> &items, const T *agent, bool autoAdjustTree) {
+        insert(items.data(), (unsigned int)items.size(), agent, autoAdjustTree);
+    }
+
+    template<class L, class N, class P, class C> //L=LeafDataType N=NodeDataType P=Precision C=CellPolicy
+    template <class T>
+    void Octree<L, N, P, C>::insert(std::vector<L> &items, const T *agent) {
+        insert(items.data(), (unsigned int)items.size(), agent);
+    }
+
+    template<class L, class N, class P, class C> //L=LeafDataType N=NodeDataType P=Precision C=CellPolicy
+    void Octree<L, N, P, C>::bulkInsert(const L *items,
+                                        const unsigned int itemsCount,
+                                        const OctreeAgent<L, N, P> *agentInsert,
+                                        const OctreeAgentAutoAdjustExtension<L, N, P> *agentAdjust,
+                                        bool autoAdjustTree) {
+        auto octantAgent = dynamic_cast<const OctreeAgentOctantExtension<L, N, P> *>(agentInsert);
+        if (octantAgent != nullptr) {
+            OctreeOctantAgent<L, N, P> agent(agentInsert, octantAgent);
+            bulkInsertItems(items, itemsCount, &agent, agentAdjust, autoAdjustTree);
+        } else {
+            bulkInsertItems(items, itemsCount, agentInsert, agentAdjust, autoAdjustTree);
+        }
+    }
+
+    // Builds the whole tree from sorted item paths instead of splitting leaves one insert at a time.
+    // The result is equal to inserting the items one by one; a tree that is not empty falls back to insert().
+    template<class L, class N, class P, class C> //L=LeafDataType N=NodeDataType P=Precision C=CellPolicy
+    template <class T, class U>
+    void Octree<L, N, P, C>::bulkInsertItems(const L *items,
+                                             const unsigned int itemsCount,
+                                             const T *agentInsert,
+                                             const U *agentAdjust,
+                                             bool autoAdjustTree) {
+
+        OCTREE_COUNTERS_SCOPE();
+        if (this->itemsCount != 0 || !root->isLeaf()) {
+            insertItems(items, itemsCount, agentInsert, agentAdjust, autoAdjustTree);
+            return;
+        }
+
+        assert((autoAdjustTree || radius > P(0)) && "Radius has to be > 0");
+
+        makeRootWritable();
+        if (autoAdjustTree && agentAdjust != nullptr) {
+            adjustToItems(items, itemsCount, agentAdjust);
+        }
+
+        if (threadsNumber != 1) {
+            buildInThreads(items, itemsCount, agentInsert);
+        } else {
+            std::vector<OctreeMortonKey> keys;
+            keys.reserve(itemsCount);
+            for (unsigned int i = 0; i < itemsCount; ++i) {
+                OCTREE_COUNT(overlapTests, 1);
+                if (agentInsert->isItemOverlappingCell(&items[i], center, radius)) {
+                    keys.push_back({0, i, 0});
+                }
             }
-            return items;
+            root->build(items, keys, agentInsert);
         }
+        this->itemsCount.store(root->itemsCount);
+        publishSnapshot();
     }
 
-    template<class L, class N, class P> //L=LeafDataType N=NodeDataType P=Precision
-    void OctreeCell<L, N, P>::visit(const OctreeVisitor<L, N, P> *visitor) const {
-        if(internalCellType == OctreeCellType::Leaf) {
-            visitor->visitLeaf(this, data);
+    template<class L, class N, class P, class C> //L=LeafDataType N=NodeDataType P=Precision C=CellPolicy
+    void Octree<L, N, P, C>::runInThreads(const std::function<void(unsigned int)> &job) const {
+#ifdef OCTREE_INSTRUMENTATION
+        std::function<void(unsigned int)> countedJob = [&](unsigned int thread) {
+            OCTREE_COUNTERS_SCOPE();
+            job(thread);
+        };
+        const std::function<void(unsigned int)> &threadJob = countedJob;
+#else
+        const std::function<void(unsigned int)> &threadJob = job;
+#endif
+        if (tracer) {
+            tracer->prepare(threadsNumber);
+        }
+        if (threadPool) {
+            threadPool->run(threadJob);
         } else {
-            visitor->visitBranch(this, childs);
+            threadJob(0);
+        }
+    }
+
+    // Same steps as OctreeCell::build(), with the codes, the sort and the subtrees below the first levels
+    // split between threads. Every subtree covers its own slice of the keys, so no cell is shared.
+    template<class L, class N, class P, class C> //L=LeafDataType N=NodeDataType P=Precision C=CellPolicy
+    template <class T>
+    void Octree<L, N, P, C>::buildInThreads(const L *items,
+                                            const unsigned int itemsCount,
+                                            const T *agent) {
+        std::vector<std::vector<OctreeMortonKey> > threadKeys(threadsNumber);
+        runInThreads([&](unsigned int thread) {
+            unsigned int from = (unsigned int)((uint64_t)itemsCount * thread / threadsNumber);
+            unsigned int to = (unsigned int)((uint64_t)itemsCount * (thread + 1) / threadsNumber);
+            threadKeys[thread].reserve(to - from);
+            for (unsigned int i = from; i < to; ++i) {
+                OCTREE_COUNT(overlapTests, 1);
+                if (agent->isItemOverlappingCell(&items[i], center, radius)) {
+                    threadKeys[thread].push_back({0, i, 0});
+                }
+            }
+        });
+        std::vector<OctreeMortonKey> keys;
+        keys.reserve(itemsCount);
+        for (auto &k : threadKeys) {
+            keys.insert(keys.end(), k.begin(), k.end());
+            std::vector<OctreeMortonKey>().swap(k);
+        }
+
+        if (!hasMoreUniqueItemsThan(items, keys, 0, keys.size(), maxItemsPerCell)) {
+            root->buildLeaf(items, keys, 0, keys.size(), agent);
+            return;
+        }
+
+        unsigned int levels = getMortonLevels(keys.size(), maxItemsPerCell);
+        std::atomic<bool> hasUnclassifiedItems(false);
+        runInThreads([&](unsigned int thread) {
+            size_t from = keys.size() * thread / threadsNumber;
+            size_t to = keys.size() * (thread + 1) / threadsNumber;
+            if (OctreeCell<L, N, P, C>::computeMortonCodes(items, keys.data() + from, keys.data() + to, levels, center, radius, agent)) {
+                hasUnclassifiedItems = true;
+            }
+        });
+        sortMortonKeysInThreads(keys, 3 * levels);
+
+        // Enough subtrees for every thread to get several, so uneven ones even out
+        unsigned int taskLevel = 1;
+        for (size_t cells = 8; cells < 4 * threadsNumber && taskLevel < levels; cells *= 8) {
+            taskLevel++;
+        }
+        std::vector<typename OctreeCell<L, N, P, C>::BuildTask> tasks;
+        root->buildBranch(items, keys, 0, keys.size(), 0, levels, hasUnclassifiedItems, agent, &tasks, taskLevel);
+        std::sort(tasks.begin(), tasks.end(), [](const typename OctreeCell<L, N, P, C>::BuildTask &a,
+                                                 const typename OctreeCell<L, N, P, C>::BuildTask &b) {
+            return a.end - a.begin > b.end - b.begin;
+        });
+
+        std::atomic_uint nextTask(0);
+        runInThreads([&](unsigned int thread) {
+            OctreeTraceSpan span(tracer.get(), thread, "buildThread");
+            for (unsigned int i = nextTask++; i < tasks.size(); i = nextTask++) {
+                OctreeTraceSpan taskSpan(tracer.get(), thread, "buildTask", tasks[i].end - tasks[i].begin);
+                tasks[i].cell->buildRange(items, keys, tasks[i].begin, tasks[i].end, taskLevel, levels, hasUnclassifiedItems, agent);
+            }
+        });
+        root->recountItems(taskLevel);
+    }
+
+    // sortMortonKeys() with every thread counting and scattering its own slice of the keys
+    template<class L, class N, class P, class C> //L=LeafDataType N=NodeDataType P=Precision C=CellPolicy
+    void Octree<L, N, P, C>::sortMortonKeysInThreads(std::vector<OctreeMortonKey> &keys, unsigned int bits) const {
+        std::vector<OctreeMortonKey> sorted(keys.size());
+        std::vector<std::array<size_t, 256> > offsets(threadsNumber);
+        for (unsigned int shift = 0; shift < bits; shift += 8) {
+            runInThreads([&](unsigned int thread) {
+                size_t from = keys.size() * thread / threadsNumber;
+                size_t to = keys.size() * (thread + 1) / threadsNumber;
+                offsets[thread].fill(0);
+                for (size_t i = from; i < to; ++i) {
+                    offsets[thread][(keys[i].code >> shift) & 0xFF]++;
+                }
+            });
+            size_t offset = 0;
+            for (unsigned int digit = 0; digit < 256; ++digit) {
+                for (unsigned int thread = 0; thread < threadsNumber; ++thread) {
+                    size_t count = offsets[thread][digit];
+                    offsets[thread][digit] = offset;
+                    offset += count;
+                }
+            }
+            runInThreads([&](unsigned int thread) {
+                size_t from = keys.size() * thread / threadsNumber;
+                size_t to = keys.size() * (thread + 1) / threadsNumber;
+                for (size_t i = from; i < to; ++i) {
+                    sorted[offsets[thread][(keys[i].code >> shift) & 0xFF]++] = keys[i];
+                }
+            });
+            keys.swap(sorted);
+        }
+    }
+
+    template<class L, class N, class P, class C> //L=LeafDataType N=NodeDataType P=Precision C=CellPolicy
+    template <class T>
+    void Octree<L, N, P, C>::bulkInsert(const L *items, const unsigned int itemsCount, const T *agent) {
+
+        static_assert(sfinae::is_agent<T, L, N, P>::value, "Agent has wrong class");
+        auto adj = OctreeAutoAdjustAgent<T, L, N, P>::get(agent);
+        bulkInsertItems(items, itemsCount, agent, adj, adj != nullptr);
+    }
+
+    template<class L, class N, class P, class C> //L=LeafDataType N=NodeDataType P=Precision C=CellPolicy
+    template <class T>
+    void Octree<L, N, P, C>::bulkInsert(std::vector<L> &items, const T *agent) {
+        bulkInsert(items.data(), (unsigned int)items.size(), agent);
+    }
+
+    // Grows center and radius to the cube around them and around every item
+    template<class L, class P, class U> //L=LeafDataType P=Precision
+    void adjustBoundsToItems(const L *items,
+                             const unsigned int itemsCount,
+                             const U *agentAdjust,
+                             OctreeVec3<P> &center,
+                             P &radius) {
+        OctreeVec3<P> max = center + OctreeVec3<P>(radius);
+        OctreeVec3<P> min = center - OctreeVec3<P>(radius);
+
+        for (unsigned int i = 0; i < itemsCount; ++i) {
+            max = agentAdjust->GetMaxValuesForAutoAdjust(&items[i], max);
+            min = agentAdjust->GetMinValuesForAutoAdjust(&items[i], min);
+        }
+        center = (max + min) / P(2);
+        radius = std::max(std::abs(center.x - max.x), std::abs(center.y - max.y));
+        radius = std::max(radius, std::abs(center.z - max.z));
+    }
+
+    template<class L, class N, class P, class C> //L=LeafDataType N=NodeDataType P=Precision C=CellPolicy
+    template <class U>
+    void Octree<L, N, P, C>::adjustToItems(const L *items,
+                                           const unsigned int itemsCount,
+                                           const U *agentAdjust) {
+        adjustBoundsToItems(items, itemsCount, agentAdjust, center, radius);
+        root->moveCell(center, radius);
+    }
+
+    template<class L, class N, class P, class C> //L=LeafDataType N=NodeDataType P=Precision C=CellPolicy
+    std::string Octree<L, N, P, C>::getItemPath(L *item) const {
+        std::string v;
+        root->getItemPath(item, v);
+        return v;
+    }
+
+    template<class L, class N, class P, class C> //L=LeafDataType N=NodeDataType P=Precision C=CellPolicy
+    OctreeCounters Octree<L, N, P, C>::getCounters() const {
+#ifdef OCTREE_INSTRUMENTATION
+        return counters.get();
+#else
+        return OctreeCounters();
+#endif
+    }
+
+    template<class L, class N, class P, class C> //L=LeafDataType N=NodeDataType P=Precision C=CellPolicy
+    void Octree<L, N, P, C>::resetCounters() {
+#ifdef OCTREE_INSTRUMENTATION
+        counters.reset();
+#endif
+    }
+
+    // The cells above the subtrees of about grain items are measured here, the subtrees are claimed by the
+    // threads largest first and every thread sums into its own stats
+    template<class L, class N, class P, class C> //L=LeafDataType N=NodeDataType P=Precision C=CellPolicy
+    OctreeStats Octree<L, N, P, C>::stats() const {
+        OctreeStats result;
+        result.controlBlockBytes = OctreeCell<L, N, P, C>::getCellControlBytes();
+        if (threadsNumber == 1) {
+            root->collectStats(result, 0, 0, nullptr);
+            return result;
+        }
+        unsigned int grain = std::max(maxItemsPerCell, root->itemsCount.load() / (8 * threadsNumber));
+        std::vector<typename OctreeCell<L, N, P, C>::StatsTask> tasks;
+        root->collectStats(result, 0, grain, &tasks);
+        std::sort(tasks.begin(), tasks.end(), [](const typename OctreeCell<L, N, P, C>::StatsTask &a,
+                                                 const typename OctreeCell<L, N, P, C>::StatsTask &b) {
+            return a.cell->itemsCount > b.cell->itemsCount;
+        });
+
+        std::vector<OctreeStats> threadStats(threadsNumber);
+        std::atomic_uint nextTask(0);
+        runInThreads([&](unsigned int thread) {
+            for (unsigned int i = nextTask++; i < tasks.size(); i = nextTask++) {
+                tasks[i].cell->collectStats(threadStats[thread], tasks[i].depth, 0, nullptr);
+            }
+        });
+        for (auto &stats : threadStats) {
+            result.add(stats);
+        }
+        return result;
+    }
+
+    template<class L, class N, class P, class C> //L=LeafDataType N=NodeDataType P=Precision C=CellPolicy
+    void Octree<L, N, P, C>::visit(const OctreeVisitor<L, N, P, C> *visitor) const {
+        if (threadsNumber != 1) {
+            //printf("WARNING: visiting with multiple tree requires OctreeVisitorThreaded\nUsing 1 thread\n");
         }
+        visitor->visitRoot(root);
     }
 
-    template<class L, class N, class P> //L=LeafDataType N=NodeDataType P=Precision
-    void OctreeCell<L, N, P>::visit(const OctreeVisitorThreaded<L, N, P> *visitor) const {
-        if(internalCellType == OctreeCellType::Leaf) {
-            visitor->visitLeaf(this, data);
+    template<class L, class N, class P, class C> //L=LeafDataType N=NodeDataType P=Precision C=CellPolicy
+    void Octree<L, N, P, C>::visit(const OctreeVisitorThreaded<L, N, P, C> *visitor) const {
+        if (threadsNumber != 1) {
+            visitor->visitPreRoot(root);
+            visitInThreads(visitor);
+            visitor->visitPostRoot(root);
         } else {
-            visitor->visitBranch(this, childs);
+            visitor->visitRoot(root);
         }
     }
 
-    template<class L, class N, class P> //L=LeafDataType N=NodeDataType P=Precision
-    bool OctreeCell<L, N, P>::isEqual(OctreeCell<L, N, P>  const &rhs) const {
-        if(internalCellType != rhs.internalCellType) {
-            return false;
-        }
-        if(internalCellType == OctreeCellType::Leaf) {
-            if (data.size() != rhs.data.size()) {
-                return false;
-            }
-            for (unsigned int i = 0; i < data.size(); ++i) {
+    // Fork-join traversal with work stealing. Subtrees holding more than the grain are split into a task
+    // per child down to any depth, smaller ones are visited by a single thread, so a cluster of items in
+    // one corner of the tree is shared between all threads.
+    template<class L, class N, class P, class C> //L=LeafDataType N=NodeDataType P=Precision C=CellPolicy
+    void Octree<L, N, P, C>::visitInThreads(const OctreeVisitorThreaded<L, N, P, C> *visitor) const {
+        unsigned int grain = std::max(maxItemsPerCell, root->itemsCount.load() / (8 * threadsNumber));
+        std::vector<VisitQueue> queues(threadsNumber);
+        std::atomic_uint pendingTasks(1);
+        queues[0].tasks.push_back({root.get(), nullptr});
+
+        runInThreads([&](unsigned int thread) {
+            OctreeTraceSpan span(tracer.get(), thread, "visitThread");
+            while (pendingTasks.load(std::memory_order_acquire) != 0) {
+                VisitTask task = {nullptr, nullptr};
                 bool found = false;
-                for (unsigned int j = 0; j < data.size(); ++j) {
-                    if (data[i] == rhs.data[j]) {
+                for (unsigned int i = 0; i < threadsNumber && !found; ++i) {
+                    auto &queue = queues[(thread + i) % threadsNumber];
+                    std::lock_guard<OctreeSpinLock> lock(queue.lock);
+                    if (!queue.tasks.empty()) {
+                        if (i == 0) {
+                            task = queue.tasks.back();
+                            queue.tasks.pop_back();
+                        } else {
+                            task = queue.tasks.front();
+                            queue.tasks.pop_front();
+                        }
                         found = true;
-                        break;
                     }
                 }
-                if (!found) {
-                    return false;
-                }
-            }
-        } else {
-            for (int i = 0; i < 8; ++i) {
-                bool equal = *childs[i] == *rhs.childs[i];
-                if (!equal) {
-                    return false;
+                if (found) {
+                    OctreeTraceSpan taskSpan(tracer.get(), thread, "visitTask", task.cell->itemsCount);
+#ifdef OCTREE_INSTRUMENTATION
+                    auto start = std::chrono::steady_clock::now();
+                    visitTask(visitor, task, grain, queues[thread], pendingTasks);
+                    auto end = std::chrono::steady_clock::now();
+                    OctreeCounters *threadCounters = getThreadCounters();
+                    if (threadCounters->visitThreadNanoseconds.size() <= thread) {
+                        threadCounters->visitThreadNanoseconds.resize(thread + 1, 0);
+                    }
+                    threadCounters->visitThreadNanoseconds[thread] += (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count();
+                    threadCounters->visitTasks++;
+#else
+                    visitTask(visitor, task, grain, queues[thread], pendingTasks);
+#endif
+                    pendingTasks.fetch_sub(1, std::memory_order_acq_rel);
+                } else {
+                    std::this_thread::yield();
                 }
             }
-        }
-        return true;
+        });
     }
 
-    template<class L, class N, class P> //L=LeafDataType N=NodeDataType P=Precision
-    void OctreeCell<L, N, P>::makeBranch(const std::vector<const L *> &items, const L *item, const OctreeAgent<L, N, P> *agent) {
-        float halfRadius = radius / 2.0f;
-        for (int i = 0; i < 8; ++i) {
+    template<class L, class N, class P, class C> //L=LeafDataType N=NodeDataType P=Precision C=CellPolicy
+    void Octree<L, N, P, C>::visitTask(const OctreeVisitorThreaded<L, N, P, C> *visitor,
+                                       const VisitTask &task,
+                                       unsigned int grain,
+                                       VisitQueue &queue,
+                                       std::atomic_uint &pendingTasks) const {
+        auto cell = task.cell;
+        if (cell->isLeaf() || cell->itemsCount.load() <= grain) {
+            cell->visit(visitor);
+            finishVisitTask(visitor, task.parent);
+            return;
+        }
 
-            bool up = i < 4;//+y
-            bool right = (i & 1) == 1;//+x
-            bool front = ((i >> 1) & 1) != 0; //+z
-            OctreeVec3<P> newCenter = this->center + OctreeVec3<P>(right ? halfRadius : -halfRadius,
-                                                                   up ? halfRadius : -halfRadius,
-                                                                   front ? halfRadius : -halfRadius);
-            childs[i] = std::make_shared<OctreeCell<L, N, P> >(maxItemsPerCell, newCenter, halfRadius, i);
+        auto childsToProcess = getArrayOfChildsToProcess();
+        visitor->visitPreBranch(cell, cell->childs, childsToProcess);
+        int childsToVisitCount = (int)std::count(childsToProcess.begin(), childsToProcess.end(), true);
+        if (childsToVisitCount == 0) {
+            visitor->visitPostBranch(cell, cell->childs);
+            finishVisitTask(visitor, task.parent);
+            return;
         }
-        internalCellType = OctreeCellType::Branch;
-        for (unsigned int i = 0; i < items.size(); ++i) {
-            this->insert(items[i], agent);
+
+        auto continuation = new VisitContinuation();
+        continuation->cell = cell;
+        continuation->remaining.store(childsToVisitCount);
+        continuation->parent = task.parent;
+
+        pendingTasks.fetch_add(childsToVisitCount, std::memory_order_acq_rel);
+        std::lock_guard<OctreeSpinLock> lock(queue.lock);
+        for (int i = 0; i < 8; ++i) {
+            if (childsToProcess[i]) {
+                queue.tasks.push_back({cell->childs[i].get(), continuation});
+            }
         }
-        this->insert(item, agent);
-        cellType = OctreeCellType::Branch;
     }
 
-    template<class L, class N, class P> //L=LeafDataType N=NodeDataType P=Precision
-    Octree<L, N, P>::Octree(unsigned int maxItemsPerCell,
-                            OctreeVec3<P> center,
-                            P radius,
-                            unsigned int threadsNumber) : center(center),
-                                                          radius(radius),
-                                                          maxItemsPerCell(maxItemsPerCell),
-                                                          threadsNumber(threadsNumber) {
-        if(threadsNumber == 0) {
-            this->threadsNumber = std::thread::hardware_concurrency();
+    template<class L, class N, class P, class C> //L=LeafDataType N=NodeDataType P=Precision C=CellPolicy
+    void Octree<L, N, P, C>::finishVisitTask(const OctreeVisitorThreaded<L, N, P, C> *visitor,
+                                             VisitContinuation *continuation) const {
+        while (continuation != nullptr && continuation->remaining.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+            visitor->visitPostBranch(continuation->cell, continuation->cell->childs);
+            auto parent = continuation->parent;
+            delete continuation;
+            continuation = parent;
         }
-        root = std::make_shared<OctreeCell<L, N, P> >(maxItemsPerCell, center, radius);
-        itemsCount.store(0);
     }
 
-    template<class L, class N, class P> //L=LeafDataType N=NodeDataType P=Precision
-    void Octree<L, N, P>::clear() {
-        root = std::make_shared<OctreeCell<L, N, P> >(maxItemsPerCell, center, radius);
-        itemsCount.store(0);
+    template<class L, class N, class P, class C> //L=LeafDataType N=NodeDataType P=Precision C=CellPolicy
+    template <class T>
+    void Octree<L, N, P, C>::queryBox(const OctreeVec3<P> &min,
+                                      const OctreeVec3<P> &max,
+                                      const T *agent,
+                                      std::vector<const L *> &items) const {
+        root->queryBox(min, max, agent, items);
     }
 
-    template<class L, class N, class P> //L=LeafDataType N=NodeDataType P=Precision
-    void Octree<L, N, P>::insert(const L *item, const OctreeAgent<L, N, P> *agent) {
-        if (agent->isItemOverlappingCell(item, center, radius)) {
-            if(root->insert(item, agent)) {
-                itemsCount.fetch_add(1);
+    template<class L, class N, class P, class C> //L=LeafDataType N=NodeDataType P=Precision C=CellPolicy
+    template <class T>
+    std::vector<const L *> Octree<L, N, P, C>::findKNearest(const OctreeVec3<P> &point,
+                                                            unsigned int k,
+                                                            const T *agent) const {
+        // Cells and items share one queue ordered by distance, so an item popped
+        // from the queue is closer than every cell that has not been opened yet.
+        struct Candidate {
+            P distance;
+            const OctreeCell<L, N, P, C> *cell;
+            const L *item;
+            bool operator>(const Candidate &rhs) const { return distance > rhs.distance; }
+        };
+
+        std::vector<const L *> nearest;
+        if (k == 0) {
+            return nearest;
+        }
+        nearest.reserve(k);
+
+        std::priority_queue<Candidate, std::vector<Candidate>, std::greater<Candidate> > candidates;
+        candidates.push({getSquaredDistanceToCell(point, root->center, root->radius), root.get(), nullptr});
+
+        while (!candidates.empty() && nearest.size() < k) {
+            Candidate candidate = candidates.top();
+            candidates.pop();
+            if (candidate.cell == nullptr) {
+                nearest.push_back(candidate.item);
+            } else {
+                typename OctreeCell<L, N, P, C>::ReadGuard guard(*candidate.cell);
+                if (guard.isLeaf()) {
+                    auto &data = candidate.cell->data;
+                    auto positions = candidate.cell->getPositions();
+                    for (size_t i = 0; i < data.size(); ++i) {
+                        OctreeVec3<P> position = positions ? positions->get(i) : agent->GetItemPosition(data[i]);
+                        candidates.push({getSquaredDistance(point, position), nullptr, data[i]});
+                    }
+                } else {
+                    for (int i = 0; i < 8; ++i) {
+                        auto &child = candidate.cell->childs[i];
+                        candidates.push({getSquaredDistanceToCell(point, child->center, child->radius), child.get(), nullptr});
+                    }
+                }
             }
         }
+        return nearest;
     }
 
-    template<class L, class N, class P> //L=LeafDataType N=NodeDataType P=Precision
-    void Octree<L, N, P>::insert(const L *items,
-                                 const unsigned int itemsCount,
-                                 const OctreeAgent<L, N, P> *agentInsert,
-                                 const OctreeAgentAutoAdjustExtension<L, N, P> *agentAdjust,
-                                 bool autoAdjustTree) {
+    template<class L, class N, class P, class C> //L=LeafDataType N=NodeDataType P=Precision C=CellPolicy
+    template <class T>
+    void Octree<L, N, P, C>::queryRadius(const OctreeVec3<P> &point,
+                                         P radius,
+                                         const T *agent,
+                                         std::vector<const L *> &items) const {
+        root->queryRadius(point, radius * radius, agent, items);
+    }
 
-        assert((autoAdjustTree || radius > P(0)) && "Radius has to be > 0");
+    template<class L, class N, class P, class C> //L=LeafDataType N=NodeDataType P=Precision C=CellPolicy
+    template <class T>
+    unsigned int Octree<L, N, P, C>::countBox(const OctreeVec3<P> &min,
+                                              const OctreeVec3<P> &max,
+                                              const T *agent) const {
+        return root->countBox(min, max, agent);
+    }
 
-        if (autoAdjustTree && agentAdjust != nullptr && this->itemsCount == 0) {
+    template<class L, class N, class P, class C> //L=LeafDataType N=NodeDataType P=Precision C=CellPolicy
+    template <class T>
+    unsigned int Octree<L, N, P, C>::countRadius(const OctreeVec3<P> &point,
+                                                 P radius,
+                                                 const T *agent) const {
+        return root->countRadius(point, radius * radius, agent);
+    }
 
-            OctreeVec3<P> max = center + OctreeVec3<P>(radius);
-            OctreeVec3<P> min = center - OctreeVec3<P>(radius);
+    // Only cells pierced by the ray are searched, so items are expected to lie inside the cell they were inserted into
+    template<class L, class N, class P, class C> //L=LeafDataType N=NodeDataType P=Precision C=CellPolicy
+    template <class T>
+    const L *Octree<L, N, P, C>::raycast(const OctreeVec3<P> &origin,
+                                         const OctreeVec3<P> &direction,
+                                         const T *agent,
+                                         P *distance,
+                                         P maxDistance) const {
+        OctreeRayHit<L, P> hit = {nullptr, maxDistance};
+        P tNear;
+        if (intersectRayWithCell(origin, direction, root->center, root->radius, tNear) && tNear <= maxDistance) {
+            root->raycast(origin, direction, getRayChildOrderMask(direction), agent, hit);
+        }
+        if (distance != nullptr && hit.item != nullptr) {
+            *distance = hit.distance;
+        }
+        return hit.item;
+    }
 
-            for (unsigned int i = 0; i < itemsCount; ++i) {
-                max = agentAdjust->GetMaxValuesForAutoAdjust(&items[i], max);
-                min = agentAdjust->GetMinValuesForAutoAdjust(&items[i], min);
-            }
-            center = (max + min) / P(2);
-            radius = std::max(std::abs(center.x - max.x), std::abs(center.y - max.y));
-            radius = std::max(radius, glm::abs(center.z - max.z));
-            root->moveCell(center, radius);
+    template<class L, class N, class P, class C> //L=LeafDataType N=NodeDataType P=Precision C=CellPolicy
+    template <class T>
+    void Octree<L, N, P, C>::raycastAll(const OctreeVec3<P> &origin,
+                                        const OctreeVec3<P> &direction,
+                                        const T *agent,
+                                        std::vector<OctreeRayHit<L, P> > &hits,
+                                        P maxDistance) const {
+        size_t firstHit = hits.size();
+        P tNear;
+        if (intersectRayWithCell(origin, direction, root->center, root->radius, tNear) && tNear <= maxDistance) {
+            root->raycastAll(origin, direction, maxDistance, getRayChildOrderMask(direction), agent, hits);
         }
+        std::stable_sort(hits.begin() + firstHit, hits.end(), [](const OctreeRayHit<L, P> &a, const OctreeRayHit<L, P> &b) {
+            return a.distance < b.distance;
+        });
+    }
 
-        if (threadsNumber != 1) {
-            itemsToAdd.reserve(itemsCount);
-            for (unsigned int i = 0; i < itemsCount; ++i) {
-                itemsToAdd.push_back(&items[i]);
-            }
-            for (unsigned int i = 0; i < threadsNumber; ++i) {
-                threads.push_back(std::thread(&Octree::insertThread, this, agentInsert));
-            }
-            for (unsigned int i = 0; i < threadsNumber; ++i) {
-                threads[i].join();
+    template<class L, class N, class P, class C> //L=LeafDataType N=NodeDataType P=Precision C=CellPolicy
+    template <class T>
+    void Octree<L, N, P, C>::insertThread(const L *items,
+                                          const unsigned int itemsCount,
+                                          std::atomic_uint &nextItem,
+                                          const T *agent) {
+        // Threads claim ranges of the items with a compare and swap. The ranges shrink with the items
+        // left, so the claims are rare at the start and the threads still finish together.
+        const unsigned int minItemsToClaim = 16;
+        unsigned int inserted = 0;
+        unsigned int from = nextItem.load(std::memory_order_relaxed);
+        while (from < itemsCount) {
+            unsigned int itemsToClaim = std::max(minItemsToClaim, (itemsCount - from) / (2 * threadsNumber));
+            unsigned int to = std::min(itemsCount, from + itemsToClaim);
+            if (!nextItem.compare_exchange_weak(from, to, std::memory_order_relaxed)) {
+                continue;
             }
-            threads.clear();
-        } else {
-            for (unsigned int i = 0; i < itemsCount; ++i) {
-                if (agentInsert->isItemOverlappingCell(&items[i], center, radius)) {
-                    if(root->insert(&items[i], agentInsert)) {
-                        this->itemsCount++;
-                    }
+            for (unsigned int i = from; i < to; ++i) {
+                if (insertIntoRoot(&items[i], agent)) {
+                    inserted++;
                 }
             }
+            from = nextItem.load(std::memory_order_relaxed);
         }
+        this->itemsCount.fetch_add(inserted);
     }
 
+    // The leaves are taken from an Octree bulk built from the items, so both trees agree on where
+    // every item goes. Subtrees below OctreeLinearMaxDepth are merged into one leaf.
     template<class L, class N, class P> //L=LeafDataType N=NodeDataType P=Precision
     template <class T>
-    void Octree<L, N, P>::insert(const L *items,
-                                 const unsigned int itemsCount,
-                                 const T *agent,
-                                 bool autoAdjustTree) {
+    void LinearOctree<L, N, P>::build(const L *items, const unsigned int itemsCount, const T *agent) {
+        Octree<L, N, P, OctreeSingleWriterCellPolicy> tree(maxItemsPerCell, center, radius, threadsNumber);
+        tree.bulkInsert(items, itemsCount, agent);
+        center = tree.center;
+        radius = tree.radius;
+
+        clear();
+        this->items.reserve(tree.getItemsCount());
+        addLeaves(tree.root.get(), 0, 0);
+    }
 
-        static_assert(std::is_base_of<OctreeAgent<L, N, P>, T>::value, "Agent has wrong class");
+    template<class L, class N, class P> //L=LeafDataType N=NodeDataType P=Precision
+    void LinearOctree<L, N, P>::clear() {
+        std::vector<OctreeLinearLeaf>().swap(leaves);
+        std::vector<const L *>().swap(items);
+    }
 
-        auto adj = dynamic_cast< const OctreeAgentAutoAdjustExtension<L, N, P>* > (agent);
-        if(autoAdjustTree && adj == nullptr) {
-            //printf("WARNING: To use auto adjust agent has to implement OctreeAgentAutoAdjustExtension\n");
-            insert(items, itemsCount, agent, nullptr, false);
-        } else {
-            insert(items, itemsCount, agent, adj, autoAdjustTree);
+    template<class L, class N, class P> //L=LeafDataType N=NodeDataType P=Precision
+    void LinearOctree<L, N, P>::addLeaves(const OctreeCell<L, N, P, OctreeSingleWriterCellPolicy> *cell, uint64_t code, unsigned int depth) {
+        if (cell->isLeaf() || depth == OctreeLinearMaxDepth) {
+            size_t begin = items.size();
+            if (cell->isLeaf()) {
+                items.insert(items.end(), cell->data.begin(), cell->data.end());
+            } else {
+                cell->collectItems(items);
+            }
+            if (items.size() > begin) {
+                leaves.push_back({code << 3 * (OctreeLinearMaxDepth - depth), depth, (unsigned int)begin});
+            }
+            return;
+        }
+        for (int i = 0; i < 8; ++i) {
+            addLeaves(cell->childs[i].get(), (code << 3) | uint64_t(i), depth + 1);
         }
     }
 
     template<class L, class N, class P> //L=LeafDataType N=NodeDataType P=Precision
-    template <class T>
-    void Octree<L, N, P>::insert(const L *items,
-                                 const unsigned int itemsCount,
-                                 const T *agent) {
+    unsigned int LinearOctree<L, N, P>::getLeafEnd(size_t leaf) const {
+        return leaf + 1 < leaves.size() ? leaves[leaf + 1].begin : (unsigned int)items.size();
+    }
 
-        static_assert(std::is_base_of<OctreeAgent<L, N, P>, T>::value, "Agent has wrong class");
-        auto adj = dynamic_cast< const OctreeAgentAutoAdjustExtension<L, N, P>* > (agent);
-        insert(items, itemsCount, agent, adj, adj != nullptr);
+    // Leaves in [begin, end) are inside node, the ones of its child are next to each other
+    template<class L, class N, class P> //L=LeafDataType N=NodeDataType P=Precision
+    size_t LinearOctree<L, N, P>::getChildLeavesEnd(size_t begin,
+                                                    size_t end,
+                                                    const OctreeLinearNode<P> &node,
+                                                    int child) const {
+        unsigned int shift = 3 * (OctreeLinearMaxDepth - node.depth - 1);
+        return std::upper_bound(leaves.begin() + begin, leaves.begin() + end, child, [shift](int index, const OctreeLinearLeaf &leaf) {
+            return index < int((leaf.code >> shift) & 7);
+        }) - leaves.begin();
     }
 
     template<class L, class N, class P> //L=LeafDataType N=NodeDataType P=Precision
-    void Octree<L, N, P>::insert(std::vector<L> &items,
-                                 const OctreeAgent<L, N, P> *agentInsert,
-                                 const OctreeAgentAutoAdjustExtension<L, N, P> *agentAdjust,
-                                 bool autoAdjustTree) {
+    OctreeLinearNode<P> LinearOctree<L, N, P>::getChildNode(const OctreeLinearNode<P> &node, int child) const {
+        P halfRadius = node.radius / P(2);
+        return {node.code | (uint64_t(child) << 3 * (OctreeLinearMaxDepth - node.depth - 1)),
+                node.depth + 1,
+                node.center + getCenterDelta(child, halfRadius),
+                halfRadius};
+    }
 
-        if (autoAdjustTree && agentAdjust != nullptr && this->itemsCount == 0) {
+    template<class L, class N, class P> //L=LeafDataType N=NodeDataType P=Precision
+    int LinearOctree<L, N, P>::findLeaf(const OctreeVec3<P> &position) const {
+        if (std::abs(position.x - center.x) > radius ||
+            std::abs(position.y - center.y) > radius ||
+            std::abs(position.z - center.z) > radius) {
+            return -1;
+        }
+        // Same choice as getChildIndex() for a point, ties go to -x, +y and -z
+        uint64_t code = 0;
+        OctreeVec3<P> cellCenter = center;
+        P cellRadius = radius;
+        for (unsigned int depth = 0; depth < OctreeLinearMaxDepth; ++depth) {
+            int index = (position.x > cellCenter.x ? 1 : 0) | (position.z > cellCenter.z ? 2 : 0) | (position.y < cellCenter.y ? 4 : 0);
+            code = (code << 3) | uint64_t(index);
+            cellRadius /= P(2);
+            cellCenter = cellCenter + getCenterDelta(index, cellRadius);
+        }
 
-            OctreeVec3<P> max = center + OctreeVec3<P>(radius);
-            OctreeVec3<P> min = center - OctreeVec3<P>(radius);
+        auto leaf = std::upper_bound(leaves.begin(), leaves.end(), code, [](uint64_t c, const OctreeLinearLeaf &l) {
+            return c < l.code;
+        });
+        if (leaf == leaves.begin()) {
+            return -1;
+        }
+        --leaf;
+        unsigned int shift = 3 * (OctreeLinearMaxDepth - leaf->depth);
+        if ((leaf->code >> shift) != (code >> shift)) {
+            return -1;
+        }
+        return int(leaf - leaves.begin());
+    }
 
-            for (auto& item : items) {
-                max = agentAdjust->GetMaxValuesForAutoAdjust(&item, max);
-                min = agentAdjust->GetMinValuesForAutoAdjust(&item, min);
-            }
-            center = (max + min) / P(2);
-            radius = std::max(std::abs(center.x - max.x), std::abs(center.y - max.y));
-            radius = std::max(radius, glm::abs(center.z - max.z));
-            root->moveCell(center, radius);
+    template<class L, class N, class P> //L=LeafDataType N=NodeDataType P=Precision
+    template <class T>
+    void LinearOctree<L, N, P>::queryBox(const OctreeVec3<P> &min,
+                                         const OctreeVec3<P> &max,
+                                         const T *agent,
+                                         std::vector<const L *> &items) const {
+        queryBox(min, max, agent, items, 0, leaves.size(), {0, 0, center, radius});
+    }
 
+    template<class L, class N, class P> //L=LeafDataType N=NodeDataType P=Precision
+    template <class T>
+    void LinearOctree<L, N, P>::queryBox(const OctreeVec3<P> &min,
+                                         const OctreeVec3<P> &max,
+                                         const T *agent,
+                                         std::vector<const L *> &items,
+                                         size_t begin,
+                                         size_t end,
+                                         const OctreeLinearNode<P> &node) const {
+        if (begin == end) {
+            return;
         }
-
-        if (threadsNumber != 1) {
-            itemsToAdd.reserve(items.size());
-            for (unsigned int i = 0; i < items.size(); ++i) {
-                itemsToAdd.push_back(&items[i]);
-            }
-            if (threadsNumber == 0) {
-                threadsNumber = std::thread::hardware_concurrency();
-            }
-            threads.clear();
-            for (unsigned int i = 0; i < threadsNumber; ++i) {
-                threads.push_back(std::thread(&Octree::insertThread, this, agentInsert));
-            }
-            for (unsigned int i = 0; i < threadsNumber; ++i) {
-                threads[i].join();
-            }
-            threads.clear();
-        } else {
-            for (unsigned int i = 0; i < items.size(); ++i) {
-                if (agentInsert->isItemOverlappingCell(&items[i], center, radius)) {
-                    if(root->insert(&items[i], agentInsert)) {
-                        this->itemsCount.fetch_add(1);
-                    }
+        OctreeCellOverlap overlap = getBoxCellOverlap(min, max, node.center, node.radius);
+        if (overlap == OctreeCellOverlap::Outside) {
+            return;
+        }
+        // The items of a subtree are next to each other
+        if (overlap == OctreeCellOverlap::Inside) {
+            items.insert(items.end(), this->items.begin() + leaves[begin].begin, this->items.begin() + getLeafEnd(end - 1));
+            return;
+        }
+        if (end - begin == 1 && leaves[begin].depth == node.depth) {
+            for (unsigned int i = leaves[begin].begin; i < getLeafEnd(begin); ++i) {
+                if (isPointInsideBox(agent->GetItemPosition(this->items[i]), min, max)) {
+                    items.push_back(this->items[i]);
                 }
             }
+            return;
+        }
+        size_t childBegin = begin;
+        for (int i = 0; i < 8; ++i) {
+            size_t childEnd = getChildLeavesEnd(childBegin, end, node, i);
+            queryBox(min, max, agent, items, childBegin, childEnd, getChildNode(node, i));
+            childBegin = childEnd;
         }
     }
 
     template<class L, class N, class P> //L=LeafDataType N=NodeDataType P=Precision
-    template <class T>
-    void Octree<L, N, P>::insert(std::vector<L> &items, const T *agent, bool autoAdjustTree) {
-
-        static_assert(std::is_base_of<OctreeAgent<L, N, P>, T>::value, "Agent has wrong class");
-
-        auto adj = dynamic_cast< const OctreeAgentAutoAdjustExtension<L, N, P>* > (agent);
-        if(autoAdjustTree && adj == nullptr) {
-            //printf("WARNING: To use auto adjust agent has to implement OctreeAgentAutoAdjustExtension\n");
-            insert(items, agent, nullptr, false);
+    void LinearOctree<L, N, P>::visit(const OctreeLinearVisitor<L, N, P> *visitor) const {
+        OctreeLinearNode<P> root = {0, 0, center, radius};
+        if (leaves.empty()) {
+            visitor->visitLeaf(root, items.data(), 0);
         } else {
-            insert(items, agent, adj, autoAdjustTree);
+            visit(visitor, 0, leaves.size(), root);
         }
     }
 
+    // Cells without items are leaves of Octree that LinearOctree does not keep, they are not visited
+    template<class L, class N, class P> //L=LeafDataType N=NodeDataType P=Precision
+    void LinearOctree<L, N, P>::visit(const OctreeLinearVisitor<L, N, P> *visitor,
+                                      size_t begin,
+                                      size_t end,
+                                      const OctreeLinearNode<P> &node) const {
+        if (end - begin == 1 && leaves[begin].depth == node.depth) {
+            visitor->visitLeaf(node, getLeafItems(begin), getLeafItemsCount(begin));
+            return;
+        }
+        if (visitor->visitPreBranch(node)) {
+            size_t childBegin = begin;
+            for (int i = 0; i < 8; ++i) {
+                size_t childEnd = getChildLeavesEnd(childBegin, end, node, i);
+                if (childEnd != childBegin) {
+                    visit(visitor, childBegin, childEnd, getChildNode(node, i));
+                }
+                childBegin = childEnd;
+            }
+        }
+        visitor->visitPostBranch(node);
+    }
+    // Same steps as Octree::bulkInsert() on an empty tree, with cells taken from the pool
     template<class L, class N, class P> //L=LeafDataType N=NodeDataType P=Precision
     template <class T>
-    void Octree<L, N, P>::insert(std::vector<L> &items, const T *agent) {
+    void PooledOctree<L, N, P>::build(const L *items, const unsigned int itemsCount, const T *agent) {
+        static_assert(sfinae::is_agent<T, L, N, P>::value, "Agent has wrong class");
+        clear();
+        auto adj = OctreeAutoAdjustAgent<T, L, N, P>::get(agent);
+        if (adj != nullptr) {
+            adjustBoundsToItems(items, itemsCount, adj, center, radius);
+        }
+        assert(radius > P(0) && "Radius has to be > 0");
 
-        static_assert(std::is_base_of<OctreeAgent<L, N, P>, T>::value, "Agent has wrong class");
-        auto adj = dynamic_cast< const OctreeAgentAutoAdjustExtension<L, N, P>* > (agent);
-        insert(items, agent, adj, adj != nullptr);
+        std::vector<OctreeMortonKey> keys;
+        keys.reserve(itemsCount);
+        for (unsigned int i = 0; i < itemsCount; ++i) {
+            if (agent->isItemOverlappingCell(&items[i], center, radius)) {
+                keys.push_back({0, i, 0});
+            }
+        }
+        this->items.reserve(keys.size());
+        buildCell(items, keys, getRootCell(), agent);
     }
 
     template<class L, class N, class P> //L=LeafDataType N=NodeDataType P=Precision
-    std::string Octree<L, N, P>::getItemPath(L *item) const {
-        std::string v;
-        root->getItemPath(item, v);
-        return v;
+    void PooledOctree<L, N, P>::clear() {
+        std::vector<OctreePooledNode>(1).swap(nodes);
+        std::vector<const L *>().swap(items);
     }
 
+    // keys hold the items of this empty leaf, in insertion order, as in OctreeCell::build()
     template<class L, class N, class P> //L=LeafDataType N=NodeDataType P=Precision
-    void Octree<L, N, P>::visit(const OctreeVisitor<L, N, P> *visitor) const {
-        if (threadsNumber != 1) {
-            //printf("WARNING: visiting with multiple tree requires OctreeVisitorThreaded\nUsing 1 thread\n");
+    template <class T>
+    void PooledOctree<L, N, P>::buildCell(const L *items,
+                                          std::vector<OctreeMortonKey> &keys,
+                                          const OctreePooledCell<P> &cell,
+                                          const T *agent) {
+        if (!hasMoreUniqueItemsThan(items, keys, 0, keys.size(), maxItemsPerCell)) {
+            buildLeaf(items, keys, 0, keys.size(), cell.index);
+            return;
         }
-        visitor->visitRoot(root);
+        unsigned int levels = getMortonLevels(keys.size(), maxItemsPerCell);
+        bool hasUnclassifiedItems = OctreeCell<L, N, P, OctreeSingleWriterCellPolicy>::computeMortonCodes(
+            items, keys.data(), keys.data() + keys.size(), levels, cell.center, cell.radius, agent);
+        sortMortonKeys(keys, 3 * levels);
+        buildBranch(items, keys, 0, keys.size(), 0, levels, hasUnclassifiedItems, cell, agent);
     }
 
     template<class L, class N, class P> //L=LeafDataType N=NodeDataType P=Precision
-    void Octree<L, N, P>::visit(const OctreeVisitorThreaded<L, N, P> *visitor) const {
-        if (threadsNumber != 1) {
-            visitor->visitPreRoot(root);
-            if (root->isLeaf()) {
-                root->visit(visitor);
-            } else {
-                auto childsToVisit = getArrayOfChildsToProcess();
-                visitor->visitPreBranch(root.get(), root->getChilds(), childsToVisit);
-                int childsToVisitCount = std::count_if(childsToVisit.begin(), childsToVisit.end(), [](bool b) {return b;});
-                std::array< std::vector<int>, 16 > toVisit;
-                std::array<std::shared_ptr<OctreeCell<L, N, P> >, 8 > roots;
-                if(threadsNumber <= 8) {
-                    roots[0] = root;
-                    for (unsigned int i = 0; i < threadsNumber; ++i) {
-                        int from = (childsToVisitCount * i) / threadsNumber;
-                        int to = std::min<int>(childsToVisitCount, (childsToVisitCount * (i+1)) / threadsNumber);
-                        int skipped = 0;
-                        for (int j = from; j < to; ++j) {
-                            if(childsToVisit[j+skipped]) {
-                                toVisit[i].push_back(j+skipped);
-                            } else {
-                                j--;
-                                skipped++;
-                            }
-                        }
-                        threads.push_back(std::thread(&Octree::visitThread, this, std::ref(visitor), std::ref(roots), std::ref(toVisit[i])));
-                    }
-                    for (unsigned int i = 0; i < threadsNumber; ++i) {
-                        threads[i].join();
-                    }
-                    threads.clear();
+    template <class T>
+    void PooledOctree<L, N, P>::buildRange(const L *items,
+                                           std::vector<OctreeMortonKey> &keys,
+                                           size_t begin,
+                                           size_t end,
+                                           unsigned int level,
+                                           unsigned int levels,
+                                           bool hasUnclassifiedItems,
+                                           const OctreePooledCell<P> &cell,
+                                           const T *agent) {
+        if (!hasMoreUniqueItemsThan(items, keys, begin, end, maxItemsPerCell)) {
+            buildLeaf(items, keys, begin, end, cell.index);
+        } else if (level == levels) {
+            std::vector<OctreeMortonKey> cellKeys(keys.begin() + begin, keys.begin() + end);
+            std::sort(cellKeys.begin(), cellKeys.end(), [](const OctreeMortonKey &a, const OctreeMortonKey &b) {
+                return a.index < b.index;
+            });
+            buildCell(items, cellKeys, cell, agent);
+        } else {
+            buildBranch(items, keys, begin, end, level, levels, hasUnclassifiedItems, cell, agent);
+        }
+    }
 
-                } else {
-                    auto childs = root->getChilds();
-                    std::array<std::array<bool, 8>, 8 > childsToProcessArray;
+    // The pool grows while the children are built, so cells are kept by index
+    template<class L, class N, class P> //L=LeafDataType N=NodeDataType P=Precision
+    template <class T>
+    void PooledOctree<L, N, P>::buildBranch(const L *items,
+                                            std::vector<OctreeMortonKey> &keys,
+                                            size_t begin,
+                                            size_t end,
+                                            unsigned int level,
+                                            unsigned int levels,
+                                            bool hasUnclassifiedItems,
+                                            const OctreePooledCell<P> &cell,
+                                            const T *agent) {
+        if (hasUnclassifiedItems) {
+            end = std::stable_partition(keys.begin() + begin, keys.begin() + end, [level](const OctreeMortonKey &key) {
+                return key.levels > level;
+            }) - keys.begin();
+        }
+        size_t childs = nodes.size();
+        assert(childs + 8 <= std::numeric_limits<uint32_t>::max());
+        nodes.resize(childs + 8);
+        nodes[cell.index].childs = uint32_t(childs);
+        size_t itemsBegin = this->items.size();
+
+        unsigned int shift = 3 * (levels - level - 1);
+        size_t childBegin = begin;
+        for (int i = 0; i < 8; ++i) {
+            size_t childEnd = std::upper_bound(keys.begin() + childBegin, keys.begin() + end, i, [shift](int index, const OctreeMortonKey &key) {
+                return index < int((key.code >> shift) & 7);
+            }) - keys.begin();
+            buildRange(items, keys, childBegin, childEnd, level + 1, levels, hasUnclassifiedItems, getChildCell(cell, i), agent);
+            childBegin = childEnd;
+        }
+        nodes[cell.index].itemsBegin = uint32_t(itemsBegin);
+        nodes[cell.index].itemsCount = uint32_t(this->items.size() - itemsBegin);
+    }
 
-                    for (int i = 0; i < 8; ++i) {
-                        childsToProcessArray[i] = getArrayOfChildsToProcess();
-                        roots[i] = childs[i];
-                    }
-                    for (int i = 0; i < 8; ++i) {
-                        if(!childsToVisit[i]) {
-                            for (int j = 0; j < 8; ++j) {
-                                childsToProcessArray[i][j]=false;
-                            }
-                            continue;
-                        }
-                        if(childs[i]->isLeaf()) {
-                            visitor->visitLeaf(childs[i].get(), childs[i]->getData());
-                        } else {
-                            visitor->visitPreBranch(childs[i].get(), childs[i]->getChilds(), childsToProcessArray[i]);
-                        }
-                    }
+    template<class L, class N, class P> //L=LeafDataType N=NodeDataType P=Precision
+    void PooledOctree<L, N, P>::buildLeaf(const L *items, std::vector<OctreeMortonKey> &keys, size_t begin, size_t end, uint32_t node) {
+        size_t itemsBegin = this->items.size();
+        appendUniqueItems(items, keys, begin, end, this->items, itemsBegin);
+        nodes[node].itemsBegin = uint32_t(itemsBegin);
+        nodes[node].itemsCount = uint32_t(this->items.size() - itemsBegin);
+    }
 
-                    int numberOfElementsToVisit = std::accumulate(childsToProcessArray.begin(), childsToProcessArray.end(), 0,
-                                                                  [](const int& counter, std::array<bool, 8> elements) {
-                                                                      return counter + std::count_if(elements.begin(),
-                                                                                                     elements.end(),
-                                                                                                     [](bool b) {return b;});
-                                                                  });
-
-                    int accumulator = 0;
-                    for (unsigned int i = 0; i < threadsNumber; ++i) {
-                        int from = (numberOfElementsToVisit * i) / threadsNumber;
-                        int to = std::min<int>(numberOfElementsToVisit, (numberOfElementsToVisit * (i+1)) / threadsNumber);
-                        int elementsToPush = to-from;
-
-                        for (int j = 0; j < elementsToPush; ++j) {
-                            int rootCellIndex = accumulator/8;
-                            int childCellIndex = accumulator%8;
-                            if(childsToProcessArray[rootCellIndex][childCellIndex]) {
-                                toVisit[i].push_back(accumulator);
-                            } else {
-                                j--;
-                            }
-                            accumulator++;
-                        }
-                        threads.push_back(std::thread(&Octree::visitThread, this, std::ref(visitor), std::ref(roots), std::ref(toVisit[i])));
-                    }
+    template<class L, class N, class P> //L=LeafDataType N=NodeDataType P=Precision
+    OctreePooledCell<P> PooledOctree<L, N, P>::getChildCell(const OctreePooledCell<P> &cell, int child) const {
+        P halfRadius = cell.radius / P(2);
+        return {nodes[cell.index].childs + uint32_t(child),
+                cell.depth + 1,
+                cell.center + getCenterDelta(child, halfRadius),
+                halfRadius};
+    }
 
-                    for (auto& thread : threads) {
-                        thread.join();
-                    }
-                    threads.clear();
+    template<class L, class N, class P> //L=LeafDataType N=NodeDataType P=Precision
+    template <class T>
+    void PooledOctree<L, N, P>::queryBox(const OctreeVec3<P> &min,
+                                         const OctreeVec3<P> &max,
+                                         const T *agent,
+                                         std::vector<const L *> &items) const {
+        queryBox(min, max, agent, items, getRootCell());
+    }
 
-                    for (int i = 0; i < 8; ++i) {
-                        if(!childs[i]->isLeaf()) {
-                            visitor->visitPostBranch(childs[i].get(), childs[i]->getChilds());
-                        }
-                    }
+    template<class L, class N, class P> //L=LeafDataType N=NodeDataType P=Precision
+    template <class T>
+    void PooledOctree<L, N, P>::queryBox(const OctreeVec3<P> &min,
+                                         const OctreeVec3<P> &max,
+                                         const T *agent,
+                                         std::vector<const L *> &items,
+                                         const OctreePooledCell<P> &cell) const {
+        const OctreePooledNode &node = nodes[cell.index];
+        if (node.itemsCount == 0) {
+            return;
+        }
+        OctreeCellOverlap overlap = getBoxCellOverlap(min, max, cell.center, cell.radius);
+        if (overlap == OctreeCellOverlap::Outside) {
+            return;
+        }
+        auto begin = this->items.begin() + node.itemsBegin;
+        auto end = begin + node.itemsCount;
+        if (overlap == OctreeCellOverlap::Inside) {
+            items.insert(items.end(), begin, end);
+            return;
+        }
+        if (node.childs == 0) {
+            for (auto item = begin; item != end; ++item) {
+                if (isPointInsideBox(agent->GetItemPosition(*item), min, max)) {
+                    items.push_back(*item);
+                }
+            }
+            return;
+        }
+        for (int i = 0; i < 8; ++i) {
+            queryBox(min, max, agent, items, getChildCell(cell, i));
+        }
+    }
+
+    template<class L, class N, class P> //L=LeafDataType N=NodeDataType P=Precision
+    template <class T>
+    void PooledOctree<L, N, P>::queryRadius(const OctreeVec3<P> &point,
+                                            P radius,
+                                            const T *agent,
+                                            std::vector<const L *> &items) const {
+        queryRadius(point, radius * radius, agent, items, getRootCell());
+    }
 
+    template<class L, class N, class P> //L=LeafDataType N=NodeDataType P=Precision
+    template <class T>
+    void PooledOctree<L, N, P>::queryRadius(const OctreeVec3<P> &point,
+                                            P squaredRadius,
+                                            const T *agent,
+                                            std::vector<const L *> &items,
+                                            const OctreePooledCell<P> &cell) const {
+        const OctreePooledNode &node = nodes[cell.index];
+        if (node.itemsCount == 0) {
+            return;
+        }
+        OctreeCellOverlap overlap = getSphereCellOverlap(point, squaredRadius, cell.center, cell.radius);
+        if (overlap == OctreeCellOverlap::Outside) {
+            return;
+        }
+        auto begin = this->items.begin() + node.itemsBegin;
+        auto end = begin + node.itemsCount;
+        if (overlap == OctreeCellOverlap::Inside) {
+            items.insert(items.end(), begin, end);
+            return;
+        }
+        if (node.childs == 0) {
+            for (auto item = begin; item != end; ++item) {
+                if (getSquaredDistance(point, agent->GetItemPosition(*item)) <= squaredRadius) {
+                    items.push_back(*item);
                 }
-                visitor->visitPostBranch(root.get(), root->getChilds());
             }
+            return;
+        }
+        for (int i = 0; i < 8; ++i) {
+            queryRadius(point, squaredRadius, agent, items, getChildCell(cell, i));
+        }
+    }
 
-            visitor->visitPostRoot(root);
+    template<class L, class N, class P> //L=LeafDataType N=NodeDataType P=Precision
+    template <class T>
+    unsigned int PooledOctree<L, N, P>::countRadius(const OctreeVec3<P> &point,
+                                                    P radius,
+                                                    const T *agent) const {
+        return countRadius(point, radius * radius, agent, getRootCell());
+    }
 
-        } else {
-            visitor->visitRoot(root);
+    template<class L, class N, class P> //L=LeafDataType N=NodeDataType P=Precision
+    template <class T>
+    unsigned int PooledOctree<L, N, P>::countRadius(const OctreeVec3<P> &point,
+                                                    P squaredRadius,
+                                                    const T *agent,
+                                                    const OctreePooledCell<P> &cell) const {
+        const OctreePooledNode &node = nodes[cell.index];
+        OctreeCellOverlap overlap = getSphereCellOverlap(point, squaredRadius, cell.center, cell.radius);
+        if (node.itemsCount == 0 || overlap == OctreeCellOverlap::Outside) {
+            return 0;
+        }
+        if (overlap == OctreeCellOverlap::Inside) {
+            return node.itemsCount;
+        }
+        unsigned int count = 0;
+        if (node.childs == 0) {
+            for (uint32_t i = node.itemsBegin; i < node.itemsBegin + node.itemsCount; ++i) {
+                if (getSquaredDistance(point, agent->GetItemPosition(items[i])) <= squaredRadius) {
+                    count++;
+                }
+            }
+            return count;
+        }
+        for (int i = 0; i < 8; ++i) {
+            count += countRadius(point, squaredRadius, agent, getChildCell(cell, i));
         }
+        return count;
     }
 
     template<class L, class N, class P> //L=LeafDataType N=NodeDataType P=Precision
-    void Octree<L, N, P>::insertThread(const OctreeAgent<L, N, P> *agent) {
-        unsigned int itemsToBatch = threadsNumber * threadsNumber;
+    template <class T>
+    std::vector<const L *> PooledOctree<L, N, P>::findKNearest(const OctreeVec3<P> &point,
+                                                               unsigned int k,
+                                                               const T *agent) const {
+        // Cells and items share one queue ordered by distance, as in Octree::findKNearest().
+        // Empty cells are never opened, so they are not queued.
+        struct Candidate {
+            P distance;
+            OctreePooledCell<P> cell;
+            const L *item;
+            bool operator>(const Candidate &rhs) const { return distance > rhs.distance; }
+        };
 
-        while (!itemsToAdd.empty()) {
-            threadsMutex.lock();
-            if (itemsToAdd.empty()) {
-                threadsMutex.unlock();
-                break;
+        std::vector<const L *> nearest;
+        if (k == 0) {
+            return nearest;
+        }
+        nearest.reserve(k);
+
+        std::priority_queue<Candidate, std::vector<Candidate>, std::greater<Candidate> > candidates;
+        candidates.push({getSquaredDistanceToCell(point, center, radius), getRootCell(), nullptr});
+
+        while (!candidates.empty() && nearest.size() < k) {
+            Candidate candidate = candidates.top();
+            candidates.pop();
+            if (candidate.item != nullptr) {
+                nearest.push_back(candidate.item);
+                continue;
             }
-            std::vector<const L *> tempItems;
-            tempItems.reserve(itemsToBatch);
-            for (unsigned int i = 0; i < itemsToBatch; ++i) {
-                if (itemsToAdd.empty()) {
-                    break;
+            const OctreePooledNode &node = nodes[candidate.cell.index];
+            if (node.childs == 0) {
+                for (uint32_t i = node.itemsBegin; i < node.itemsBegin + node.itemsCount; ++i) {
+                    candidates.push({getSquaredDistance(point, agent->GetItemPosition(items[i])), candidate.cell, items[i]});
                 }
-                auto item = itemsToAdd[itemsToAdd.size() - 1];
-                tempItems.push_back(item);
-                itemsToAdd.pop_back();
-                this->itemsCount.fetch_add(1);
-            }
-            threadsMutex.unlock();
-            for(auto& item : tempItems) {
-                if (agent->isItemOverlappingCell(item, center, radius)) {
-                    if(root -> isLeaf()) {
-                        root->getMutex().lock();
-                        root->insertInThread(item, agent);
-                        root->getMutex().unlock();
-                    } else {
-                        root->insertInThread(item, agent);
+            } else {
+                for (int i = 0; i < 8; ++i) {
+                    OctreePooledCell<P> child = getChildCell(candidate.cell, i);
+                    if (nodes[child.index].itemsCount != 0) {
+                        candidates.push({getSquaredDistanceToCell(point, child.center, child.radius), child, nullptr});
                     }
                 }
             }
         }
+        return nearest;
     }
 
     template<class L, class N, class P> //L=LeafDataType N=NodeDataType P=Precision
-    void Octree<L, N, P>::visitThread(const OctreeVisitorThreaded<L, N, P> *visitor,
-                                      std::array<std::shared_ptr<OctreeCell<L, N, P> >, 8 > threadRoots,
-                                      std::vector<int> toVisit) const {
-
-        for(auto& index : toVisit) {
-            int rootIndex = index / 8;
-            int cellIndex = index % 8;
+    void PooledOctree<L, N, P>::visit(const OctreePooledVisitor<L, N, P> *visitor) const {
+        visit(visitor, getRootCell());
+    }
 
-            if (!threadRoots[rootIndex]->isLeaf()) {
-                auto childs = threadRoots[rootIndex]->getChilds();
-                childs[cellIndex] -> visit(visitor);
-            } else {
-                visitor->visitLeaf(threadRoots[rootIndex].get(), threadRoots[rootIndex]->getData());
+    template<class L, class N, class P> //L=LeafDataType N=NodeDataType P=Precision
+    void PooledOctree<L, N, P>::visit(const OctreePooledVisitor<L, N, P> *visitor,
+                                      const OctreePooledCell<P> &cell) const {
+        const OctreePooledNode &node = nodes[cell.index];
+        if (node.childs == 0) {
+            visitor->visitLeaf(cell, items.data() + node.itemsBegin, node.itemsCount);
+            return;
+        }
+        if (visitor->visitPreBranch(cell)) {
+            for (int i = 0; i < 8; ++i) {
+                visit(visitor, getChildCell(cell, i));
             }
         }
+        visitor->visitPostBranch(cell);
     }
+
 }
 
 #endif /* defined(__AKOctree__Octree__) */
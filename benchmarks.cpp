@@ -0,0 +1,491 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "Octree.h"
+
+using namespace AKOctree;
+
+// Items equal by position, so the duplicates distribution exercises the rejection of duplicates
+// instead of splitting a leaf of identical points forever
+struct BenchPoint {
+    OctreeVec3<double> position;
+    double mass;
+
+    inline bool operator == (const BenchPoint &b) const {
+        return position.x == b.position.x && position.y == b.position.y && position.z == b.position.z;
+    }
+};
+
+struct BenchNode {
+    double x, y, z;
+    double mass;
+};
+
+typedef Octree<BenchPoint, BenchNode, double> BenchOctree;
+
+class BenchAgent : public OctreeStaticAgent<BenchAgent, BenchPoint, BenchNode, double> {
+
+public:
+    bool isItemOverlappingCell(const BenchPoint *item,
+                               const OctreeVec3<double> &cellCenter,
+                               const double &cellRadius) const {
+        return std::abs(item->position.x - cellCenter.x) <= cellRadius &&
+               std::abs(item->position.y - cellCenter.y) <= cellRadius &&
+               std::abs(item->position.z - cellCenter.z) <= cellRadius;
+    }
+
+    OctreeVec3<double> GetItemPosition(const BenchPoint *item) const {
+        return item->position;
+    }
+
+    int GetItemOctant(const BenchPoint *item, const OctreeVec3<double> &cellCenter) const {
+        return (item->position.x > cellCenter.x ? 1 : 0) |
+               (item->position.z > cellCenter.z ? 2 : 0) |
+               (item->position.y < cellCenter.y ? 4 : 0);
+    }
+};
+
+// Center of mass of every cell, the workload of the visit tests
+class BenchVisitor : public OctreeVisitorThreaded<BenchPoint, BenchNode, double> {
+
+public:
+    virtual void visitPreBranch(const OctreeCell<BenchPoint, BenchNode, double> * cell,
+                                const std::shared_ptr<OctreeCell<BenchPoint, BenchNode, double> > childs[8],
+                                std::array<bool, 8>& childsToProcess) const override {
+        cell->getNodeData() = BenchNode();
+    }
+
+    virtual void visitPostBranch(const OctreeCell<BenchPoint, BenchNode, double> * cell,
+                                 const std::shared_ptr<OctreeCell<BenchPoint, BenchNode, double> > childs[8]) const override {
+        auto &nodeData = cell->getNodeData();
+        for (int i = 0; i < 8; ++i) {
+            const auto &child = childs[i]->getNodeData();
+            nodeData.x += child.x * child.mass;
+            nodeData.y += child.y * child.mass;
+            nodeData.z += child.z * child.mass;
+            nodeData.mass += child.mass;
+        }
+        normalize(nodeData);
+    }
+
+    virtual void visitLeaf(const OctreeCell<BenchPoint, BenchNode, double> * cell,
+                           const std::vector<const BenchPoint *> &items) const override {
+        auto &nodeData = cell->getNodeData();
+        nodeData = BenchNode();
+        for (auto item : items) {
+            nodeData.x += item->position.x * item->mass;
+            nodeData.y += item->position.y * item->mass;
+            nodeData.z += item->position.z * item->mass;
+            nodeData.mass += item->mass;
+        }
+        normalize(nodeData);
+    }
+
+private:
+    static void normalize(BenchNode &nodeData) {
+        if (nodeData.mass > 0.0) {
+            nodeData.x /= nodeData.mass;
+            nodeData.y /= nodeData.mass;
+            nodeData.z /= nodeData.mass;
+        }
+    }
+};
+
+// Every distribution fills the cube of radius 100 around the origin
+const double benchRadius = 100.0;
+
+double clampToBox(double value) {
+    return std::min(std::max(value, -benchRadius), benchRadius);
+}
+
+OctreeVec3<double> randomDirection(std::mt19937_64 &random) {
+    std::normal_distribution<double> normal(0.0, 1.0);
+    OctreeVec3<double> v;
+    double length = 0.0;
+    while (length < 1e-9) {
+        v = OctreeVec3<double>(normal(random), normal(random), normal(random));
+        length = std::sqrt(v.x * v.x + v.y * v.y + v.z * v.z);
+    }
+    return OctreeVec3<double>(v.x / length, v.y / length, v.z / length);
+}
+
+void generateUniform(std::vector<BenchPoint> &points, std::mt19937_64 &random) {
+    std::uniform_real_distribution<double> coordinate(-benchRadius, benchRadius);
+    for (auto &p : points) {
+        p.position = OctreeVec3<double>(coordinate(random), coordinate(random), coordinate(random));
+    }
+}
+
+// Gaussian blobs of different sizes, like galaxies or crowds
+void generateClusters(std::vector<BenchPoint> &points, std::mt19937_64 &random) {
+    const unsigned int clusters = 32;
+    std::uniform_real_distribution<double> coordinate(-0.8 * benchRadius, 0.8 * benchRadius);
+    std::uniform_real_distribution<double> spread(1.0, 8.0);
+    std::vector<OctreeVec3<double> > centers;
+    std::vector<double> sigmas;
+    for (unsigned int i = 0; i < clusters; ++i) {
+        centers.push_back(OctreeVec3<double>(coordinate(random), coordinate(random), coordinate(random)));
+        sigmas.push_back(spread(random));
+    }
+    std::uniform_int_distribution<unsigned int> cluster(0, clusters - 1);
+    std::normal_distribution<double> normal(0.0, 1.0);
+    for (auto &p : points) {
+        unsigned int c = cluster(random);
+        p.position = OctreeVec3<double>(clampToBox(centers[c].x + sigmas[c] * normal(random)),
+                                        clampToBox(centers[c].y + sigmas[c] * normal(random)),
+                                        clampToBox(centers[c].z + sigmas[c] * normal(random)));
+    }
+}
+
+// Points on a sphere, like a scanned surface, leaving the inside of the tree empty
+void generateSurface(std::vector<BenchPoint> &points, std::mt19937_64 &random) {
+    for (auto &p : points) {
+        OctreeVec3<double> d = randomDirection(random);
+        p.position = OctreeVec3<double>(0.8 * benchRadius * d.x, 0.8 * benchRadius * d.y, 0.8 * benchRadius * d.z);
+    }
+}
+
+// Every position appears 16 times on average, all but the first copy is rejected by the tree
+void generateDuplicates(std::vector<BenchPoint> &points, std::mt19937_64 &random) {
+    std::vector<BenchPoint> unique(std::max<size_t>(1, points.size() / 16));
+    generateUniform(unique, random);
+    std::uniform_int_distribution<size_t> pick(0, unique.size() - 1);
+    for (auto &p : points) {
+        p.position = unique[pick(random)].position;
+    }
+}
+
+// Density falling with a high power of the distance to the origin, so a few cells hold most items
+void generateSkewed(std::vector<BenchPoint> &points, std::mt19937_64 &random) {
+    std::uniform_real_distribution<double> unit(0.0, 1.0);
+    for (auto &p : points) {
+        OctreeVec3<double> d = randomDirection(random);
+        double r = benchRadius * std::pow(unit(random), 8.0);
+        p.position = OctreeVec3<double>(r * d.x, r * d.y, r * d.z);
+    }
+}
+
+struct BenchDistribution {
+    const char *name;
+    void (*generate)(std::vector<BenchPoint> &points, std::mt19937_64 &random);
+};
+
+const BenchDistribution benchDistributions[] = {
+    {"uniform", generateUniform},
+    {"clusters", generateClusters},
+    {"surface", generateSurface},
+    {"duplicates", generateDuplicates},
+    {"skewed", generateSkewed},
+};
+
+struct BenchOptions {
+    std::vector<std::string> distributions;
+    std::vector<size_t> sizes = {1000, 10000, 100000, 1000000};
+    std::vector<unsigned int> threads;
+    std::vector<unsigned int> maxItemsPerCell = {4, 16, 64};
+    unsigned int repeats = 3;
+    unsigned int queries = 1000;
+    std::string output;
+    std::string trace;
+};
+
+struct BenchResult {
+    std::string distribution;
+    size_t size;
+    unsigned int threads;
+    unsigned int maxItemsPerCell;
+    unsigned int items;
+    double insertMs;
+    double bulkInsertMs;
+    double visitMs;
+    double queryRadiusUs;
+    double statsMs;
+    OctreeStats stats;
+    // Counters of one insert and one visit, all zero unless built with OCTREE_INSTRUMENTATION
+    OctreeCounters insertCounters;
+    OctreeCounters visitCounters;
+};
+
+template <class F>
+double bestOf(unsigned int repeats, F run) {
+    double best = std::numeric_limits<double>::max();
+    for (unsigned int i = 0; i < repeats; ++i) {
+        auto start = std::chrono::steady_clock::now();
+        run();
+        auto end = std::chrono::steady_clock::now();
+        best = std::min(best, std::chrono::duration<double, std::milli>(end - start).count());
+    }
+    return best;
+}
+
+// Only the insertion is timed, starting the thread pool of the tree and freeing the tree stay outside
+template <class F>
+double bestOfInserts(unsigned int repeats, unsigned int maxItemsPerCell, unsigned int threads,
+                     std::shared_ptr<OctreeTracer> tracer, OctreeCounters *counters, F insert) {
+    double best = std::numeric_limits<double>::max();
+    for (unsigned int i = 0; i < repeats; ++i) {
+        std::unique_ptr<BenchOctree> tree(new BenchOctree(maxItemsPerCell, OctreeVec3<double>(0), benchRadius, threads));
+        tree->setTracer(tracer);
+        auto start = std::chrono::steady_clock::now();
+        insert(*tree);
+        auto end = std::chrono::steady_clock::now();
+        best = std::min(best, std::chrono::duration<double, std::milli>(end - start).count());
+        if (counters) {
+            *counters = tree->getCounters();
+        }
+        tree.reset();
+    }
+    return best;
+}
+
+BenchResult runBenchmark(const std::vector<BenchPoint> &points,
+                         const std::vector<OctreeVec3<double> > &queries,
+                         unsigned int threads,
+                         unsigned int maxItemsPerCell,
+                         unsigned int repeats,
+                         std::shared_ptr<OctreeTracer> tracer) {
+    BenchAgent agent;
+    BenchVisitor visitor;
+    BenchResult result = BenchResult();
+    result.size = points.size();
+    result.threads = threads;
+    result.maxItemsPerCell = maxItemsPerCell;
+    if (tracer) {
+        tracer->clear();
+    }
+
+    const BenchPoint *items = points.data();
+    unsigned int count = (unsigned int)points.size();
+    result.insertMs = bestOfInserts(repeats, maxItemsPerCell, threads, tracer, &result.insertCounters, [&](BenchOctree &tree) {
+        tree.insert(items, count, &agent);
+    });
+    result.bulkInsertMs = bestOfInserts(repeats, maxItemsPerCell, threads, tracer, nullptr, [&](BenchOctree &tree) {
+        tree.bulkInsert(items, count, &agent);
+    });
+
+    BenchOctree tree(maxItemsPerCell, OctreeVec3<double>(0), benchRadius, threads);
+    tree.bulkInsert(items, count, &agent);
+    result.items = tree.getItemsCount();
+    tree.setTracer(tracer);
+    result.visitMs = bestOf(repeats, [&]() {
+        tree.resetCounters();
+        tree.visit(&visitor);
+    });
+    result.visitCounters = tree.getCounters();
+
+    // Radius of about 1% of the volume of the tree for the uniform distribution
+    std::vector<const BenchPoint *> found;
+    double queriesMs = bestOf(repeats, [&]() {
+        for (auto &query : queries) {
+            found.clear();
+            tree.queryRadius(query, 0.27 * benchRadius, &agent, found);
+        }
+    });
+    result.queryRadiusUs = queries.empty() ? 0.0 : 1000.0 * queriesMs / queries.size();
+
+    result.statsMs = bestOf(repeats, [&]() {
+        result.stats = tree.stats();
+    });
+    return result;
+}
+
+void writeHistogram(std::ostream &out, const std::vector<size_t> &histogram) {
+    out << "[";
+    for (size_t i = 0; i < histogram.size(); ++i) {
+        out << (i ? ", " : "") << histogram[i];
+    }
+    out << "]";
+}
+
+void writeCounters(std::ostream &out, const OctreeCounters &counters) {
+    out << "{\"overlapTests\": " << counters.overlapTests << ", ";
+    out << "\"splits\": " << counters.splits << ", ";
+    out << "\"splitReinserts\": " << counters.splitReinserts << ", ";
+    out << "\"duplicatesRejected\": " << counters.duplicatesRejected << ", ";
+    out << "\"lockAcquisitions\": " << counters.lockAcquisitions << ", ";
+    out << "\"contendedLocks\": " << counters.contendedLocks << ", ";
+    out << "\"visitTasks\": " << counters.visitTasks << ", ";
+    out << "\"visitThreadNanoseconds\": ";
+    writeHistogram(out, std::vector<size_t>(counters.visitThreadNanoseconds.begin(), counters.visitThreadNanoseconds.end()));
+    out << "}";
+}
+
+void writeJson(std::ostream &out, const std::vector<BenchResult> &results) {
+    out << "{\n";
+    out << "  \"hardwareThreads\": " << std::thread::hardware_concurrency() << ",\n";
+    out << "  \"results\": [";
+    for (size_t i = 0; i < results.size(); ++i) {
+        const BenchResult &r = results[i];
+        out << (i ? "," : "") << "\n    {";
+        out << "\"distribution\": \"" << r.distribution << "\", ";
+        out << "\"size\": " << r.size << ", ";
+        out << "\"threads\": " << r.threads << ", ";
+        out << "\"maxItemsPerCell\": " << r.maxItemsPerCell << ", ";
+        out << "\"items\": " << r.items << ", ";
+        out << "\"insertMs\": " << r.insertMs << ", ";
+        out << "\"bulkInsertMs\": " << r.bulkInsertMs << ", ";
+        out << "\"visitMs\": " << r.visitMs << ", ";
+        out << "\"queryRadiusUs\": " << r.queryRadiusUs << ", ";
+        out << "\"statsMs\": " << r.statsMs << ", ";
+        out << "\"nodes\": " << r.stats.nodes << ", ";
+        out << "\"leaves\": " << r.stats.leaves << ", ";
+        out << "\"emptyLeafRatio\": " << r.stats.getEmptyLeafRatio() << ", ";
+        out << "\"totalBytes\": " << r.stats.getTotalBytes() << ", ";
+        out << "\"depthHistogram\": ";
+        writeHistogram(out, r.stats.depthHistogram);
+#ifdef OCTREE_INSTRUMENTATION
+        out << ", \"insertCounters\": ";
+        writeCounters(out, r.insertCounters);
+        out << ", \"visitCounters\": ";
+        writeCounters(out, r.visitCounters);
+#endif
+        out << "}";
+    }
+    out << "\n  ]\n}\n";
+}
+
+template <class T>
+std::vector<T> parseList(const char *text) {
+    std::vector<T> values;
+    std::stringstream stream(text);
+    std::string value;
+    while (std::getline(stream, value, ',')) {
+        std::stringstream number(value);
+        T v = T();
+        number >> v;
+        values.push_back(v);
+    }
+    return values;
+}
+
+std::vector<std::string> parseNames(const char *text) {
+    std::vector<std::string> values;
+    std::stringstream stream(text);
+    std::string value;
+    while (std::getline(stream, value, ',')) {
+        values.push_back(value);
+    }
+    return values;
+}
+
+void printUsage() {
+    printf("Usage: Benchmarks.out [options]\n"
+           "  --distributions uniform,clusters,surface,duplicates,skewed\n"
+           "  --sizes 1000,10000,100000,1000000   items per run, up to 100000000\n"
+           "  --threads 1,2,4                     default 1 and powers of two up to the hardware threads\n"
+           "  --cells 4,16,64                     maxItemsPerCell values\n"
+           "  --repeats 3                         best of this many runs is reported\n"
+           "  --queries 1000                      radius queries per run\n"
+           "  --output results.json               JSON goes to stdout without it\n"
+           "  --trace trace.json                  Chrome trace of the threaded runs of the last configuration\n");
+}
+
+int main(int argc, char **argv) {
+    BenchOptions options;
+    for (const auto &distribution : benchDistributions) {
+        options.distributions.push_back(distribution.name);
+    }
+    unsigned int hardwareThreads = std::max(1u, std::thread::hardware_concurrency());
+    for (unsigned int t = 1; t < hardwareThreads; t *= 2) {
+        options.threads.push_back(t);
+    }
+    options.threads.push_back(hardwareThreads);
+
+    for (int i = 1; i < argc; ++i) {
+        bool hasValue = i + 1 < argc;
+        if (!strcmp(argv[i], "--distributions") && hasValue) {
+            options.distributions = parseNames(argv[++i]);
+        } else if (!strcmp(argv[i], "--sizes") && hasValue) {
+            options.sizes = parseList<size_t>(argv[++i]);
+        } else if (!strcmp(argv[i], "--threads") && hasValue) {
+            options.threads = parseList<unsigned int>(argv[++i]);
+        } else if (!strcmp(argv[i], "--cells") && hasValue) {
+            options.maxItemsPerCell = parseList<unsigned int>(argv[++i]);
+        } else if (!strcmp(argv[i], "--repeats") && hasValue) {
+            options.repeats = std::max(1u, (unsigned int)atoi(argv[++i]));
+        } else if (!strcmp(argv[i], "--queries") && hasValue) {
+            options.queries = (unsigned int)atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "--output") && hasValue) {
+            options.output = argv[++i];
+        } else if (!strcmp(argv[i], "--trace") && hasValue) {
+            options.trace = argv[++i];
+        } else {
+            printUsage();
+            return 1;
+        }
+    }
+
+    // A tree needs at least one thread and one item per cell
+    if (std::count(options.threads.begin(), options.threads.end(), 0u) ||
+        std::count(options.maxItemsPerCell.begin(), options.maxItemsPerCell.end(), 0u)) {
+        printf("--threads and --cells values must be positive\n");
+        printUsage();
+        return 1;
+    }
+
+    std::shared_ptr<OctreeTracer> tracer;
+    if (!options.trace.empty()) {
+        tracer = std::make_shared<OctreeTracer>();
+    }
+    std::vector<BenchResult> results;
+    for (const auto &name : options.distributions) {
+        const BenchDistribution *distribution = nullptr;
+        for (const auto &d : benchDistributions) {
+            if (name == d.name) {
+                distribution = &d;
+            }
+        }
+        if (distribution == nullptr) {
+            fprintf(stderr, "Unknown distribution %s\n", name.c_str());
+            return 1;
+        }
+        for (size_t size : options.sizes) {
+            // Same data for every thread count and cell size, and for every run of the suite
+            std::mt19937_64 random(size);
+            std::vector<BenchPoint> points(size);
+            distribution->generate(points, random);
+            std::uniform_real_distribution<double> mass(0.5, 2.0);
+            for (auto &p : points) {
+                p.mass = mass(random);
+            }
+            std::vector<OctreeVec3<double> > queries;
+            std::uniform_int_distribution<size_t> pick(0, size - 1);
+            for (unsigned int i = 0; i < options.queries && size > 0; ++i) {
+                queries.push_back(points[pick(random)].position);
+            }
+
+            for (unsigned int threads : options.threads) {
+                for (unsigned int maxItemsPerCell : options.maxItemsPerCell) {
+                    BenchResult result = runBenchmark(points, queries, threads, maxItemsPerCell, options.repeats, tracer);
+                    result.distribution = name;
+                    fprintf(stderr, "%s %zu items, %u threads, %u per cell: insert %.2f ms, bulk %.2f ms, visit %.2f ms\n",
+                            name.c_str(), size, threads, maxItemsPerCell, result.insertMs, result.bulkInsertMs, result.visitMs);
+                    results.push_back(result);
+                }
+            }
+        }
+    }
+
+    if (options.output.empty()) {
+        writeJson(std::cout, results);
+    } else {
+        std::ofstream out(options.output);
+        writeJson(out, results);
+    }
+    if (tracer) {
+        std::ofstream out(options.trace);
+        tracer->writeChromeTrace(out);
+    }
+    return 0;
+}
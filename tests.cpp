@@ -2,6 +2,10 @@
 #include <glm/glm.hpp>
 #include <fstream>
 #include <regex>
+#include <map>
+#include <set>
+#include <tuple>
+#include <sstream>
 
 #include "gtest/gtest.h"
 #include "Octree.h"
@@ -87,6 +91,89 @@ public:
     }
 };
 
+class OctreePointAgentPosition : public OctreePointAgent, public OctreeAgentPositionExtension<Point, Point, double> {
+
+public:
+    virtual OctreeVec3<double> GetItemPosition(const Point *item) const override {
+        return OctreeVec3<double>(item->position.x, item->position.y, item->position.z);
+    }
+};
+
+class OctreePointAgentOctant : public OctreePointAgentPosition, public OctreeAgentOctantExtension<Point, Point, double> {
+
+public:
+    virtual int GetItemOctant(const Point *item, const OctreeVec3<double> &cellCenter) const override {
+        return (item->position.x > cellCenter.x ? 1 : 0) |
+               (item->position.z > cellCenter.z ? 2 : 0) |
+               (item->position.y < cellCenter.y ? 4 : 0);
+    }
+};
+
+class OctreePointAgentRay : public OctreePointAgentPosition, public OctreeAgentRayExtension<Point, Point, double> {
+
+public:
+    double pointRadius = 0.01;
+
+    virtual bool IsItemIntersectingRay(const Point *item,
+                                       const OctreeVec3<double> &origin,
+                                       const OctreeVec3<double> &direction,
+                                       double &distance) const override {
+        glm::dvec3 d(direction.x, direction.y, direction.z);
+        glm::dvec3 m = glm::dvec3(origin.x, origin.y, origin.z) - item->position;
+        double a = d.x * d.x + d.y * d.y + d.z * d.z;
+        double b = m.x * d.x + m.y * d.y + m.z * d.z;
+        double c = m.x * m.x + m.y * m.y + m.z * m.z - pointRadius * pointRadius;
+        double discriminant = b * b - a * c;
+        if (discriminant < 0) {
+            return false;
+        }
+        distance = (-b - sqrt(discriminant)) / a;
+        return true;
+    }
+};
+
+class OctreePointStaticAgent : public OctreeStaticAgent<OctreePointStaticAgent, Point, Point, double> {
+
+public:
+    bool isItemOverlappingCell(const Point *item,
+                               const OctreeVec3<double> &cellCenter,
+                               const double &cellRadius) const {
+        return glm::abs(item->position.x - cellCenter.x) <= cellRadius &&
+               glm::abs(item->position.y - cellCenter.y) <= cellRadius &&
+               glm::abs(item->position.z - cellCenter.z) <= cellRadius;
+    }
+
+    OctreeVec3<double> GetItemPosition(const Point *item) const {
+        return OctreeVec3<double>(item->position.x, item->position.y, item->position.z);
+    }
+
+    int GetItemOctant(const Point *item, const OctreeVec3<double> &cellCenter) const {
+        return (item->position.x > cellCenter.x ? 1 : 0) |
+               (item->position.z > cellCenter.z ? 2 : 0) |
+               (item->position.y < cellCenter.y ? 4 : 0);
+    }
+
+    OctreeVec3<double> GetMaxValuesForAutoAdjust(const Point *item, const OctreeVec3<double> &max) const {
+        return OctreeVec3<double>(glm::max(item->position.x, max.x), glm::max(item->position.y, max.y), glm::max(item->position.z, max.z));
+    }
+
+    OctreeVec3<double> GetMinValuesForAutoAdjust(const Point *item, const OctreeVec3<double> &min) const {
+        return OctreeVec3<double>(glm::min(item->position.x, min.x), glm::min(item->position.y, min.y), glm::min(item->position.z, min.z));
+    }
+};
+
+class OctreePointStaticAgentNoAdjust : public OctreeStaticAgent<OctreePointStaticAgentNoAdjust, Point, Point, double> {
+
+public:
+    bool isItemOverlappingCell(const Point *item,
+                               const OctreeVec3<double> &cellCenter,
+                               const double &cellRadius) const {
+        return glm::abs(item->position.x - cellCenter.x) <= cellRadius &&
+               glm::abs(item->position.y - cellCenter.y) <= cellRadius &&
+               glm::abs(item->position.z - cellCenter.z) <= cellRadius;
+    }
+};
+
 class OctreePointVisitor : public OctreeVisitor<Point, Point, double> {
 public:
     virtual void visitRoot(const std::shared_ptr<OctreeCell<Point, Point, double> > rootCell) const override {
@@ -210,6 +297,165 @@ public:
     }
 };
 
+// Records the calls of a threaded visit and checks that every branch sees visitPreBranch, then all
+// of its processed children, then visitPostBranch
+class OctreePointVisitorThreadedOrder : public OctreeVisitorThreaded<Point, Point, double> {
+public:
+    double skipRadius = 0;
+    mutable std::mutex mutex;
+    mutable std::map<const OctreeCell<Point, Point, double> *, std::array<bool, 8> > started;
+    mutable std::set<const OctreeCell<Point, Point, double> *> finished;
+    mutable bool rootFinished = false;
+    mutable unsigned int items = 0;
+    mutable unsigned int errors = 0;
+
+    virtual void visitPreBranch(const OctreeCell<Point, Point, double> * cell,
+                                const std::shared_ptr<OctreeCell<Point, Point, double> > childs[8],
+                                std::array<bool, 8>& childsToProcess) const override {
+        for (int i = 1; i < 8; i += 2) {
+            if (childs[i]->getRadius() <= skipRadius) {
+                childsToProcess[i] = false;
+            }
+        }
+        std::lock_guard<std::mutex> lock(mutex);
+        if (!started.insert(std::make_pair(cell, childsToProcess)).second) {
+            errors++;
+        }
+    }
+
+    virtual void visitPostBranch(const OctreeCell<Point, Point, double> * cell,
+                                 const std::shared_ptr<OctreeCell<Point, Point, double> > childs[8]) const override {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto s = started.find(cell);
+        if (s == started.end()) {
+            errors++;
+            return;
+        }
+        for (int i = 0; i < 8; ++i) {
+            if (s->second[i] != (finished.count(childs[i].get()) == 1)) {
+                errors++;
+            }
+        }
+        finished.insert(cell);
+    }
+
+    virtual void visitLeaf(const OctreeCell<Point, Point, double> * cell,
+                           const std::vector<const Point *> &items) const override {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (!finished.insert(cell).second) {
+            errors++;
+        }
+        this->items += items.size();
+    }
+
+    virtual void visitPostRoot(const std::shared_ptr<OctreeCell<Point, Point, double> > rootCell) const override {
+        std::lock_guard<std::mutex> lock(mutex);
+        rootFinished = finished.count(rootCell.get()) == 1;
+    }
+};
+
+// Non empty leaves of a tree in visiting order, as cell center, radius and sorted items
+typedef std::vector<std::tuple<double, double, double, double, std::vector<const Point *> > > OctreeLeavesList;
+
+class OctreePointLeavesVisitor : public OctreeVisitor<Point, Point, double> {
+public:
+    mutable OctreeLeavesList leaves;
+
+    virtual void visitLeaf(const OctreeCell<Point, Point, double> * const cell,
+                           const std::vector<const Point *> &items) const override {
+        if (!items.empty()) {
+            std::vector<const Point *> sorted(items);
+            std::sort(sorted.begin(), sorted.end());
+            auto c = cell->getCellCenter();
+            leaves.push_back(std::make_tuple(c.x, c.y, c.z, cell->getRadius(), sorted));
+        }
+    }
+};
+
+class OctreePointLinearLeavesVisitor : public OctreeLinearVisitor<Point, Point, double> {
+public:
+    mutable OctreeLeavesList leaves;
+    mutable std::vector<uint64_t> branches;
+    mutable unsigned int errors = 0;
+
+    virtual bool visitPreBranch(const OctreeLinearNode<double> &node) const override {
+        branches.push_back(node.code);
+        return true;
+    }
+
+    virtual void visitPostBranch(const OctreeLinearNode<double> &node) const override {
+        if (branches.empty() || branches.back() != node.code) {
+            errors++;
+        } else {
+            branches.pop_back();
+        }
+    }
+
+    virtual void visitLeaf(const OctreeLinearNode<double> &node,
+                           const Point * const *items,
+                           unsigned int itemsCount) const override {
+        std::vector<const Point *> sorted(items, items + itemsCount);
+        std::sort(sorted.begin(), sorted.end());
+        leaves.push_back(std::make_tuple(node.center.x, node.center.y, node.center.z, node.radius, sorted));
+    }
+};
+
+class OctreePointPooledLeavesVisitor : public OctreePooledVisitor<Point, Point, double> {
+public:
+    mutable OctreeLeavesList leaves;
+    mutable std::vector<uint32_t> branches;
+    mutable unsigned int errors = 0;
+
+    virtual bool visitPreBranch(const OctreePooledCell<double> &cell) const override {
+        branches.push_back(cell.index);
+        return true;
+    }
+
+    virtual void visitPostBranch(const OctreePooledCell<double> &cell) const override {
+        if (branches.empty() || branches.back() != cell.index) {
+            errors++;
+        } else {
+            branches.pop_back();
+        }
+    }
+
+    virtual void visitLeaf(const OctreePooledCell<double> &cell,
+                           const Point * const *items,
+                           unsigned int itemsCount) const override {
+        if (branches.size() != cell.depth) {
+            errors++;
+        }
+        if (itemsCount != 0) {
+            std::vector<const Point *> sorted(items, items + itemsCount);
+            std::sort(sorted.begin(), sorted.end());
+            leaves.push_back(std::make_tuple(cell.center.x, cell.center.y, cell.center.z, cell.radius, sorted));
+        }
+    }
+};
+
+// Counts the leaves whose positions do not match their items
+class OctreePointLeafPositionsVisitor : public OctreeVisitor<Point, Point, double> {
+public:
+    mutable unsigned int errors = 0;
+    mutable unsigned int items = 0;
+
+    virtual void visitLeaf(const OctreeCell<Point, Point, double> * const cell,
+                           const std::vector<const Point *> &items) const override {
+        auto positions = cell->getPositions();
+        this->items += items.size();
+        if (positions == nullptr || positions->size() != items.size()) {
+            errors++;
+            return;
+        }
+        for (unsigned int i = 0; i < items.size(); ++i) {
+            auto position = positions->get(i);
+            if (position.x != items[i]->position.x || position.y != items[i]->position.y || position.z != items[i]->position.z) {
+                errors++;
+            }
+        }
+    }
+};
+
 class OctreePointVisitorThreadedWithBreak : public OctreeVisitorThreaded<Point, Point, double> {
 public:
     float breakThreshold = 1.0f;
@@ -1125,6 +1371,223 @@ TEST_F (OctreeTests, InsertThreadsFrom1To16Test) {
 }
 
 
+TEST_F (OctreeTests, InsertThreadsCountTest) {
+
+    unsigned int pointsToProcess = std::min(points, (unsigned int)2000);
+    std::vector<Point> p(pointsToProcess);
+
+    std::fstream outputFile;
+    outputFile.open("test.txt", std::ios::in | std::ios::binary);
+    outputFile.read((char *) p.data(), pointsToProcess * sizeof(Point));
+    outputFile.close();
+
+    // Items outside of the tree are not inserted
+    for (unsigned int i = 0; i < pointsToProcess; i += 10) {
+        p[i].position.x += 1000;
+    }
+
+    OctreePointAgent agent;
+    Octree<Point, Point, double> single(4, OctreeVec3<double>(0), 100);
+    single.insert(p.data(), pointsToProcess, &agent, nullptr, false);
+    ASSERT_EQ(single.forceGetItemsCount(), single.getItemsCount());
+
+    for (unsigned int threads = 2; threads <= 16; ++threads) {
+        Octree<Point, Point, double> tree(4, OctreeVec3<double>(0), 100, threads);
+        tree.insert(p.data(), pointsToProcess, &agent, nullptr, false);
+        ASSERT_EQ(single.getItemsCount(), tree.getItemsCount());
+        ASSERT_EQ(tree.forceGetItemsCount(), tree.getItemsCount());
+
+        // Items that are already in the tree are not counted again
+        tree.insert(p.data(), pointsToProcess, &agent, nullptr, false);
+        ASSERT_EQ(single.getItemsCount(), tree.getItemsCount());
+        ASSERT_TRUE(tree == single);
+    }
+}
+
+TEST_F (OctreeTests, ConcurrentInsertTest) {
+
+    unsigned int pointsToProcess = std::min(points, (unsigned int)4000);
+    std::vector<Point> p(pointsToProcess);
+
+    std::fstream outputFile;
+    outputFile.open("test.txt", std::ios::in | std::ios::binary);
+    outputFile.read((char *) p.data(), pointsToProcess * sizeof(Point));
+    outputFile.close();
+
+    OctreePointAgent agent;
+    for (unsigned int maxItemsPerCell : {1u, 8u}) {
+        Octree<Point, Point, double> single(maxItemsPerCell, OctreeVec3<double>(0), 100);
+        single.insert(p.data(), pointsToProcess, &agent, nullptr, false);
+
+        // Producers insert interleaved items one by one, so they keep splitting the same leaves
+        for (unsigned int producers = 2; producers <= 8; producers *= 2) {
+            Octree<Point, Point, double> tree(maxItemsPerCell, OctreeVec3<double>(0), 100);
+            std::vector<std::thread> threads;
+            for (unsigned int t = 0; t < producers; ++t) {
+                threads.push_back(std::thread([&, t]() {
+                    for (unsigned int i = t; i < pointsToProcess; i += producers) {
+                        tree.concurrentInsert(&p[i], &agent);
+                    }
+                    for (unsigned int i = 0; i < pointsToProcess; i += producers) {
+                        tree.concurrentInsert(&p[i], &agent);
+                    }
+                }));
+            }
+            for (auto &thread : threads) {
+                thread.join();
+            }
+            ASSERT_EQ(single.getItemsCount(), tree.getItemsCount());
+            ASSERT_EQ(tree.forceGetItemsCount(), tree.getItemsCount());
+            ASSERT_TRUE(tree == single);
+        }
+    }
+}
+
+// Counts the items of the leaves of a tree that readers lock
+class OctreeConcurrentReadCountVisitor : public OctreeVisitor<Point, Point, double, OctreeConcurrentReadCellPolicy> {
+public:
+    mutable unsigned int count = 0;
+
+protected:
+    virtual void visitLeaf(const OctreeCell<Point, Point, double, OctreeConcurrentReadCellPolicy> *cell,
+                           const std::vector<const Point *> &items) const override {
+        count += (unsigned int)items.size();
+    }
+};
+
+TEST_F (OctreeTests, ConcurrentReadersTest) {
+
+    unsigned int pointsToProcess = std::min(points, (unsigned int)4000);
+    std::vector<Point> p(pointsToProcess);
+
+    std::fstream outputFile;
+    outputFile.open("test.txt", std::ios::in | std::ios::binary);
+    outputFile.read((char *) p.data(), pointsToProcess * sizeof(Point));
+    outputFile.close();
+
+    OctreePointAgentPosition agent;
+    unsigned int half = pointsToProcess / 2;
+    OctreeVec3<double> point(10, -5, 20);
+    OctreeVec3<double> min(-20, -30, 0), max(40, 20, 50);
+    Octree<Point, Point, double> control(4, OctreeVec3<double>(0), 100);
+    control.insert(p.data(), half, &agent, nullptr, false);
+    unsigned int radiusBefore = control.countRadius(point, 40, &agent);
+    unsigned int boxBefore = control.countBox(min, max, &agent);
+    control.insert(p.data() + half, pointsToProcess - half, &agent, nullptr, false);
+
+    for (bool leafPositions : {false, true}) {
+        Octree<Point, Point, double, OctreeConcurrentReadCellPolicy> tree(4, OctreeVec3<double>(0), 100);
+        if (leafPositions) {
+            tree.enableLeafPositions(&agent);
+        }
+        tree.insert(p.data(), half, &agent, nullptr, false);
+
+        // Readers only ever see more items, never a torn or freed leaf
+        std::atomic_bool writing(true);
+        std::atomic_uint errors(0);
+        std::vector<std::thread> readers;
+        for (unsigned int r = 0; r < 2; ++r) {
+            readers.push_back(std::thread([&]() {
+                unsigned int lastCount = 0;
+                do {
+                    std::vector<const Point *> items;
+                    tree.queryRadius(point, 40, &agent, items);
+                    unsigned int count = tree.countRadius(point, 40, &agent);
+                    for (auto item : items) {
+                        errors += getSquaredDistance(point, agent.GetItemPosition(item)) > 40.0 * 40.0;
+                    }
+                    errors += items.size() < radiusBefore || count < radiusBefore || count < lastCount;
+                    lastCount = count;
+
+                    items.clear();
+                    tree.queryBox(min, max, &agent, items);
+                    errors += items.size() < boxBefore || tree.countBox(min, max, &agent) < boxBefore;
+                    errors += tree.findKNearest(point, 8, &agent).size() != 8;
+
+                    OctreeConcurrentReadCountVisitor visitor;
+                    tree.visit(&visitor);
+                    errors += visitor.count < half || visitor.count > pointsToProcess;
+                } while (writing.load());
+            }));
+        }
+
+        std::vector<std::thread> producers;
+        for (unsigned int t = 0; t < 4; ++t) {
+            producers.push_back(std::thread([&, t]() {
+                for (unsigned int i = half + t; i < pointsToProcess; i += 4) {
+                    tree.concurrentInsert(&p[i], &agent);
+                }
+            }));
+        }
+        for (auto &producer : producers) {
+            producer.join();
+        }
+        writing = false;
+        for (auto &reader : readers) {
+            reader.join();
+        }
+        ASSERT_EQ(0u, errors.load());
+        ASSERT_EQ(control.getItemsCount(), tree.getItemsCount());
+        ASSERT_EQ(control.countRadius(point, 40, &agent), tree.countRadius(point, 40, &agent));
+        ASSERT_EQ(tree.forceGetItemsCount(), tree.getItemsCount());
+        ASSERT_EQ(control.stats().nodes, tree.stats().nodes);
+    }
+}
+
+// Counts the items of the leaves of a tree whose cells hold no lock
+class OctreeSingleWriterCountVisitor : public OctreeVisitorThreaded<Point, Point, double, OctreeSingleWriterCellPolicy> {
+public:
+    mutable std::atomic_uint count;
+
+    OctreeSingleWriterCountVisitor() { count.store(0); }
+
+    virtual void visitLeaf(const OctreeCell<Point, Point, double, OctreeSingleWriterCellPolicy> * cell,
+                           const std::vector<const Point *> &items) const override {
+        count.fetch_add((unsigned int)items.size());
+    }
+};
+
+TEST_F (OctreeTests, SingleWriterCellPolicyTest) {
+
+    unsigned int pointsToProcess = std::min(points, (unsigned int)4000);
+    std::vector<Point> p(pointsToProcess);
+
+    std::fstream outputFile;
+    outputFile.open("test.txt", std::ios::in | std::ios::binary);
+    outputFile.read((char *) p.data(), pointsToProcess * sizeof(Point));
+    outputFile.close();
+
+    typedef Octree<Point, Point, double, OctreeSingleWriterCellPolicy> SingleWriterOctree;
+    ASSERT_LE(sizeof(OctreeCell<Point, Point, double, OctreeSingleWriterCellPolicy>), sizeof(OctreeCell<Point, Point, double>));
+
+    OctreePointAgentPosition agent;
+    Octree<Point, Point, double> reference(8, OctreeVec3<double>(0), 100);
+    reference.insert(p.data(), pointsToProcess, &agent, nullptr, false);
+
+    // The threads of the tree only serve bulk inserts and visits, inserts still fill it the same way
+    SingleWriterOctree tree(8, OctreeVec3<double>(0), 100, 4);
+    tree.insert(p.data(), pointsToProcess, &agent, nullptr, false);
+    ASSERT_EQ(reference.getItemsCount(), tree.getItemsCount());
+    ASSERT_EQ(reference.getStringRepresentation(), tree.getStringRepresentation());
+
+    SingleWriterOctree bulk(8, OctreeVec3<double>(0), 100, 4);
+    bulk.bulkInsert(p.data(), pointsToProcess, &agent);
+    ASSERT_EQ(reference.getItemsCount(), bulk.getItemsCount());
+    ASSERT_EQ(bulk.forceGetItemsCount(), bulk.getItemsCount());
+
+    OctreeSingleWriterCountVisitor visitor;
+    bulk.visit(&visitor);
+    ASSERT_EQ(reference.getItemsCount(), visitor.count.load());
+
+    std::vector<const Point *> expected, items;
+    reference.queryRadius(OctreeVec3<double>(0), 30, &agent, expected);
+    bulk.queryRadius(OctreeVec3<double>(0), 30, &agent, items);
+    ASSERT_EQ(expected.size(), items.size());
+
+    tree.remove(&p[0], &agent);
+    ASSERT_EQ(reference.getItemsCount() - 1, tree.getItemsCount());
+}
+
 TEST_F (OctreeTests, VisitThreadsFrom1To16Test) {
 
     unsigned int pointsToProcess = std::min(points, (unsigned int)200);
@@ -1241,64 +1704,1697 @@ TEST_F (OctreeTests, VisitWithBreaksThreadsFrom1To16Test) {
     delete []p;
 }
 
-TEST_F (OctreeTests, PerformanceSparseInsertTests) {
-    printf("Using %u threads\n", std::thread::hardware_concurrency());
-    o = new Octree<Point, Point, double>(8, OctreeVec3<double>(0), 100, 0);
-    o2 = new Octree<Point, Point, double>(8, OctreeVec3<double>(0), 100);
+TEST_F (OctreeTests, QueryBoxTest) {
+    o = new Octree<Point, Point, double>(1);
+    OctreePointAgentPosition agent;
+    Point *p = new Point[5];
+    p[0].position = glm::vec3(1,1,1);
+    p[1].position = glm::vec3(2,1,1);
+    p[2].position = glm::vec3(3,1,1);
+    p[3].position = glm::vec3(4,1,1);
+    p[4].position = glm::vec3(5,1,1);
+    o->insert(p, 5, &agent);
 
-    OctreePointAgent agent;
-    Point *p = new Point[points];
-    std::fstream outputFile;
+    std::vector<const Point *> items;
+    o->queryBox(OctreeVec3<double>(1.5, 0, 0), OctreeVec3<double>(4, 2, 2), &agent, items);
+    std::sort(items.begin(), items.end());
+    ASSERT_EQ(3u, items.size());
+    ASSERT_EQ(&p[1], items[0]);
+    ASSERT_EQ(&p[2], items[1]);
+    ASSERT_EQ(&p[3], items[2]);
 
+    items.clear();
+    o->queryBox(OctreeVec3<double>(-10), OctreeVec3<double>(10), &agent, items);
+    ASSERT_EQ(5u, items.size());
+
+    items.clear();
+    o->queryBox(OctreeVec3<double>(-10), OctreeVec3<double>(0), &agent, items);
+    ASSERT_EQ(0u, items.size());
+
+    delete []p;
+}
+
+TEST_F (OctreeTests, QueryBoxBruteForceTest) {
+    unsigned int pointsToProcess = std::min(points, (unsigned int)2000);
+
+    o = new Octree<Point, Point, double>(8, OctreeVec3<double>(0), 100);
+
+    Point *p = new Point[pointsToProcess];
+    OctreePointAgentPosition agent;
+
+    std::fstream outputFile;
     outputFile.open("test.txt", std::ios::in | std::ios::binary);
-    outputFile.read((char *) p, points * sizeof(Point));
+    outputFile.read((char *) p, pointsToProcess * sizeof(Point));
     outputFile.close();
 
+    o->insert(p, pointsToProcess, &agent);
 
-    auto start2 = std::chrono::steady_clock::now();
-    o2->insert(p, points, &agent);
-    auto end2 = std::chrono::steady_clock::now();
-    auto diff2 = end2 - start2;
-    std::cout << "1 thread: " << std::chrono::duration<double, std::milli>(diff2).count() << " ms" << std::endl;
+    for (int i = 0; i < 20; ++i) {
+        OctreeVec3<double> min(-100 + 5 * i, -60 + 3 * i, -90 + 8 * i);
+        OctreeVec3<double> max = min + OctreeVec3<double>(20 + 3 * i, 40, 25);
+        std::vector<const Point *> items;
+        o->queryBox(min, max, &agent, items);
+
+        std::vector<const Point *> expected;
+        for (unsigned int j = 0; j < pointsToProcess; ++j) {
+            if (p[j].position.x >= min.x && p[j].position.x <= max.x &&
+                p[j].position.y >= min.y && p[j].position.y <= max.y &&
+                p[j].position.z >= min.z && p[j].position.z <= max.z) {
+                expected.push_back(&p[j]);
+            }
+        }
+        std::sort(items.begin(), items.end());
+        ASSERT_TRUE(items == expected);
+    }
 
+    delete []p;
+}
 
-    auto start = std::chrono::steady_clock::now();
-    o->insert(p, points, &agent);
-    auto end = std::chrono::steady_clock::now();
-    auto diff = end - start;
-    std::cout << "All threads: " << std::chrono::duration<double, std::milli>(diff).count() << " ms" << std::endl;
+TEST_F (OctreeTests, FindKNearestTest) {
+    o = new Octree<Point, Point, double>(1);
+    OctreePointAgentPosition agent;
+    Point *p = new Point[5];
+    p[0].position = glm::vec3(1,1,1);
+    p[1].position = glm::vec3(2,1,1);
+    p[2].position = glm::vec3(3,1,1);
+    p[3].position = glm::vec3(4,1,1);
+    p[4].position = glm::vec3(5,1,1);
+    o->insert(p, 5, &agent);
+
+    auto nearest = o->findKNearest(OctreeVec3<double>(3.9, 1, 1), 3, &agent);
+    ASSERT_EQ(3u, nearest.size());
+    ASSERT_EQ(&p[3], nearest[0]);
+    ASSERT_EQ(&p[2], nearest[1]);
+    ASSERT_EQ(&p[4], nearest[2]);
+
+    ASSERT_EQ(5u, o->findKNearest(OctreeVec3<double>(0), 10, &agent).size());
+    ASSERT_EQ(0u, o->findKNearest(OctreeVec3<double>(0), 0, &agent).size());
 
-    ASSERT_EQ(o->getItemsCount(), o2->getItemsCount());
-    ASSERT_EQ(o->forceGetItemsCount(), o2->forceGetItemsCount());
-    ASSERT_TRUE(*o == *o2);
     delete []p;
 }
 
-TEST_F (OctreeTests, PerformanceSparseInsertAdjustTests) {
-    o = new Octree<Point, Point, double>(8, OctreeVec3<double>(0), 100, 0);
-    o2 = new Octree<Point, Point, double>(8, OctreeVec3<double>(0), 100);
+TEST_F (OctreeTests, FindKNearestBruteForceTest) {
+    unsigned int pointsToProcess = std::min(points, (unsigned int)2000);
 
-    auto oAdjust = new Octree<Point, Point, double>(8, OctreeVec3<double>(0), 0, 0);
-    auto o2Adjust = new Octree<Point, Point, double>(8, OctreeVec3<double>(0), 0);
+    o = new Octree<Point, Point, double>(8, OctreeVec3<double>(0), 100);
 
-    OctreePointAgent agent;
-    OctreePointAgentAdjust agentAdjust;
-    Point *p = new Point[points];
-    std::fstream outputFile;
+    Point *p = new Point[pointsToProcess];
+    OctreePointAgentPosition agent;
 
+    std::fstream outputFile;
     outputFile.open("test.txt", std::ios::in | std::ios::binary);
-    outputFile.read((char *) p, points * sizeof(Point));
+    outputFile.read((char *) p, pointsToProcess * sizeof(Point));
     outputFile.close();
 
-    auto start2 = std::chrono::steady_clock::now();
-    o2->insert(p, points, &agent);
-    auto end2 = std::chrono::steady_clock::now();
-    auto diff2 = end2 - start2;
-    std::cout << "1 thread: " << std::chrono::duration<double, std::milli>(diff2).count() << " ms" << std::endl;
+    o->insert(p, pointsToProcess, &agent);
 
+    for (int i = 0; i < 20; ++i) {
+        OctreeVec3<double> query(-95 + 9 * i, 80 - 7 * i, -40 + 4 * i);
+        auto distance = [&](const Point *point) {
+            return getSquaredDistance(query, agent.GetItemPosition(point));
+        };
+        auto nearest = o->findKNearest(query, 10, &agent);
 
-    auto start = std::chrono::steady_clock::now();
-    o->insert(p, points, &agent);
+        std::vector<const Point *> expected;
+        for (unsigned int j = 0; j < pointsToProcess; ++j) {
+            expected.push_back(&p[j]);
+        }
+        std::sort(expected.begin(), expected.end(), [&](const Point *a, const Point *b) {
+            return distance(a) < distance(b);
+        });
+
+        ASSERT_EQ(10u, nearest.size());
+        for (unsigned int j = 0; j < nearest.size(); ++j) {
+            ASSERT_DOUBLE_EQ(distance(expected[j]), distance(nearest[j]));
+        }
+    }
+
+    delete []p;
+}
+
+TEST_F (OctreeTests, QueryRadiusTest) {
+    o = new Octree<Point, Point, double>(1);
+    OctreePointAgentPosition agent;
+    Point *p = new Point[5];
+    p[0].position = glm::vec3(1,1,1);
+    p[1].position = glm::vec3(2,1,1);
+    p[2].position = glm::vec3(3,1,1);
+    p[3].position = glm::vec3(4,1,1);
+    p[4].position = glm::vec3(5,1,1);
+    o->insert(p, 5, &agent);
+
+    std::vector<const Point *> items;
+    o->queryRadius(OctreeVec3<double>(3, 1, 1), 1, &agent, items);
+    std::sort(items.begin(), items.end());
+    ASSERT_EQ(3u, items.size());
+    ASSERT_EQ(&p[1], items[0]);
+    ASSERT_EQ(&p[2], items[1]);
+    ASSERT_EQ(&p[3], items[2]);
+    ASSERT_EQ(3, o->countRadius(OctreeVec3<double>(3, 1, 1), 1, &agent));
+    ASSERT_EQ(5, o->countRadius(OctreeVec3<double>(0), 100, &agent));
+    ASSERT_EQ(0, o->countRadius(OctreeVec3<double>(-5), 1, &agent));
+
+    delete []p;
+}
+
+TEST_F (OctreeTests, QueryRadiusBruteForceTest) {
+    unsigned int pointsToProcess = std::min(points, (unsigned int)2000);
+
+    o = new Octree<Point, Point, double>(8, OctreeVec3<double>(0), 100);
+    o2 = new Octree<Point, Point, double>(8, OctreeVec3<double>(0), 100, 4);
+
+    Point *p = new Point[pointsToProcess];
+    OctreePointAgentPosition agent;
+
+    std::fstream outputFile;
+    outputFile.open("test.txt", std::ios::in | std::ios::binary);
+    outputFile.read((char *) p, pointsToProcess * sizeof(Point));
+    outputFile.close();
+
+    o->insert(p, pointsToProcess, &agent);
+    o2->insert(p, pointsToProcess, &agent);
+
+    for (int i = 0; i < 20; ++i) {
+        OctreeVec3<double> query(-95 + 9 * i, 80 - 7 * i, -40 + 4 * i);
+        double radius = 10 + 4 * i;
+        std::vector<const Point *> items;
+        o->queryRadius(query, radius, &agent, items);
+
+        std::vector<const Point *> expected;
+        for (unsigned int j = 0; j < pointsToProcess; ++j) {
+            if (getSquaredDistance(query, agent.GetItemPosition(&p[j])) <= radius * radius) {
+                expected.push_back(&p[j]);
+            }
+        }
+        std::sort(items.begin(), items.end());
+        ASSERT_TRUE(items == expected);
+        ASSERT_EQ(expected.size(), o->countRadius(query, radius, &agent));
+        ASSERT_EQ(expected.size(), o2->countRadius(query, radius, &agent));
+    }
+
+    delete []p;
+}
+
+TEST_F (OctreeTests, RaycastTest) {
+    o = new Octree<Point, Point, double>(1);
+    OctreePointAgentRay agent;
+    Point *p = new Point[5];
+    p[0].position = glm::vec3(1,1,1);
+    p[1].position = glm::vec3(2,1,1);
+    p[2].position = glm::vec3(3,1,1);
+    p[3].position = glm::vec3(4,1,1);
+    p[4].position = glm::vec3(5,1,1);
+    o->insert(p, 5, &agent);
+
+    double distance = 0;
+    ASSERT_EQ(&p[0], o->raycast(OctreeVec3<double>(-8, 1, 1), OctreeVec3<double>(1, 0, 0), &agent, &distance));
+    ASSERT_NEAR(8.99, distance, 0.00001);
+    ASSERT_EQ(&p[4], o->raycast(OctreeVec3<double>(9, 1, 1), OctreeVec3<double>(-1, 0, 0), &agent));
+    ASSERT_EQ(&p[2], o->raycast(OctreeVec3<double>(3, 1, -9), OctreeVec3<double>(0, 0, 2), &agent));
+    ASSERT_EQ(nullptr, o->raycast(OctreeVec3<double>(-8, 2, 1), OctreeVec3<double>(1, 0, 0), &agent));
+    ASSERT_EQ(nullptr, o->raycast(OctreeVec3<double>(-8, 1, 1), OctreeVec3<double>(1, 0, 0), &agent, nullptr, 5));
+
+    std::vector<OctreeRayHit<Point, double> > hits;
+    o->raycastAll(OctreeVec3<double>(9, 1, 1), OctreeVec3<double>(-1, 0, 0), &agent, hits);
+    ASSERT_EQ(5u, hits.size());
+    for (int i = 0; i < 5; ++i) {
+        ASSERT_EQ(&p[4 - i], hits[i].item);
+    }
+
+    hits.clear();
+    o->raycastAll(OctreeVec3<double>(9, 1, 1), OctreeVec3<double>(-1, 0, 0), &agent, hits, 6);
+    ASSERT_EQ(3u, hits.size());
+
+    delete []p;
+}
+
+TEST_F (OctreeTests, RaycastBruteForceTest) {
+    unsigned int pointsToProcess = std::min(points, (unsigned int)2000);
+
+    o = new Octree<Point, Point, double>(8, OctreeVec3<double>(0), 100);
+
+    Point *p = new Point[pointsToProcess];
+    OctreePointAgentRay agent;
+
+    std::fstream outputFile;
+    outputFile.open("test.txt", std::ios::in | std::ios::binary);
+    outputFile.read((char *) p, pointsToProcess * sizeof(Point));
+    outputFile.close();
+
+    o->insert(p, pointsToProcess, &agent);
+
+    for (unsigned int i = 0; i < pointsToProcess; i += pointsToProcess / 20) {
+        OctreeVec3<double> origin(-150.0 + i % 300, 150.0 - i % 200, -150.0);
+        OctreeVec3<double> direction = agent.GetItemPosition(&p[i]) - origin;
+
+        const Point *expected = nullptr;
+        double expectedDistance = std::numeric_limits<double>::max();
+        unsigned int expectedHits = 0;
+        for (unsigned int j = 0; j < pointsToProcess; ++j) {
+            double distance;
+            if (agent.IsItemIntersectingRay(&p[j], origin, direction, distance) && distance >= 0) {
+                expectedHits++;
+                if (distance < expectedDistance) {
+                    expected = &p[j];
+                    expectedDistance = distance;
+                }
+            }
+        }
+
+        double distance = 0;
+        ASSERT_EQ(expected, o->raycast(origin, direction, &agent, &distance));
+        ASSERT_DOUBLE_EQ(expectedDistance, distance);
+
+        std::vector<OctreeRayHit<Point, double> > hits;
+        o->raycastAll(origin, direction, &agent, hits);
+        ASSERT_EQ(expectedHits, hits.size());
+        ASSERT_EQ(expected, hits[0].item);
+        ASSERT_DOUBLE_EQ(expectedDistance, hits[0].distance);
+        for (unsigned int j = 1; j < hits.size(); ++j) {
+            ASSERT_LE(hits[j - 1].distance, hits[j].distance);
+        }
+    }
+
+    delete []p;
+}
+
+TEST_F (OctreeTests, RemoveTest) {
+    o = new Octree<Point, Point, double>(1);
+    o2 = new Octree<Point, Point, double>(1);
+    OctreePointAgent agent;
+    Point *p = new Point[5];
+    p[0].position = glm::vec3(1,1,1);
+    p[1].position = glm::vec3(2,1,1);
+    p[2].position = glm::vec3(3,1,1);
+    p[3].position = glm::vec3(4,1,1);
+    p[4].position = glm::vec3(5,1,1);
+    o->insert(p, 5, &agent);
+    o2->insert(p, 2, &agent);
+
+    ASSERT_TRUE(o->remove(&p[4], &agent));
+    ASSERT_FALSE(o->remove(&p[4], &agent));
+    ASSERT_EQ(4, o->getItemsCount());
+    ASSERT_EQ(4, o->forceGetItemsCount());
+    ASSERT_EQ("3454", o->getItemPath(&p[2]));
+    ASSERT_EQ("34552", o->getItemPath(&p[3]));
+
+    ASSERT_TRUE(o->remove(&p[3], &agent));
+    ASSERT_EQ(3, o->getItemsCount());
+    ASSERT_EQ("3454", o->getItemPath(&p[2]));
+
+    ASSERT_TRUE(o->remove(&p[2], &agent));
+    o2->insert(&p[2], &agent);
+    ASSERT_TRUE(o2->remove(&p[2], &agent));
+    ASSERT_TRUE(*o == *o2);
+
+    ASSERT_TRUE(o->remove(&p[0], &agent));
+    ASSERT_TRUE(o->remove(&p[1], &agent));
+    ASSERT_EQ(0, o->getItemsCount());
+    ASSERT_EQ(0, o->forceGetItemsCount());
+    ASSERT_EQ("Leaf, items:0\n", o->getStringRepresentation());
+
+    delete []p;
+}
+
+TEST_F (OctreeTests, RemoveHalfTest) {
+    unsigned int pointsToProcess = std::min(points, (unsigned int)2000);
+
+    o = new Octree<Point, Point, double>(8, OctreeVec3<double>(0), 100);
+
+    Point *p = new Point[pointsToProcess];
+    OctreePointAgentPosition agent;
+
+    std::fstream outputFile;
+    outputFile.open("test.txt", std::ios::in | std::ios::binary);
+    outputFile.read((char *) p, pointsToProcess * sizeof(Point));
+    outputFile.close();
+
+    o->insert(p, pointsToProcess, &agent);
+    for (unsigned int i = 0; i < pointsToProcess; i += 2) {
+        ASSERT_TRUE(o->remove(&p[i], &agent));
+    }
+    ASSERT_EQ(pointsToProcess / 2, o->getItemsCount());
+    ASSERT_EQ(pointsToProcess / 2, o->forceGetItemsCount());
+
+    std::vector<const Point *> items;
+    o->queryBox(OctreeVec3<double>(-100), OctreeVec3<double>(100), &agent, items);
+    std::sort(items.begin(), items.end());
+    for (unsigned int i = 0; i < items.size(); ++i) {
+        ASSERT_EQ(&p[2 * i + 1], items[i]);
+    }
+    ASSERT_EQ(pointsToProcess / 2, o->countRadius(OctreeVec3<double>(0), 1000, &agent));
+
+    for (unsigned int i = 1; i < pointsToProcess; i += 2) {
+        ASSERT_TRUE(o->remove(&p[i], &agent));
+    }
+    ASSERT_EQ(0, o->forceGetItemsCount());
+    ASSERT_EQ("Leaf, items:0\n", o->getStringRepresentation());
+
+    delete []p;
+}
+
+TEST_F (OctreeTests, UpdateTest) {
+    o = new Octree<Point, Point, double>(1);
+    OctreePointAgent agent;
+    Point *p = new Point[5];
+    p[0].position = glm::vec3(1,1,1);
+    p[1].position = glm::vec3(2,1,1);
+    p[2].position = glm::vec3(3,1,1);
+    p[3].position = glm::vec3(4,1,1);
+    p[4].position = glm::vec3(5,1,1);
+    o->insert(p, 5, &agent);
+
+    Point previous = p[4];
+    p[4].position = glm::vec3(5,1.01,1.01);
+    ASSERT_TRUE(o->update(&p[4], &previous, &agent));
+    ASSERT_EQ("34553", o->getItemPath(&p[4]));
+
+    previous = p[4];
+    p[4].position = glm::vec3(-5,-5,-5);
+    ASSERT_TRUE(o->update(&p[4], &previous, &agent));
+    ASSERT_EQ("4", o->getItemPath(&p[4]));
+    ASSERT_EQ("34552", o->getItemPath(&p[3]));
+    ASSERT_EQ(5, o->getItemsCount());
+    ASSERT_EQ(5, o->forceGetItemsCount());
+
+    previous = p[4];
+    p[4].position = glm::vec3(50,1,1);
+    ASSERT_FALSE(o->update(&p[4], &previous, &agent));
+    ASSERT_EQ(4, o->getItemsCount());
+    ASSERT_EQ(4, o->forceGetItemsCount());
+    ASSERT_FALSE(o->update(&p[4], &previous, &agent));
+
+    delete []p;
+}
+
+TEST_F (OctreeTests, UpdateOntoSharedFaceTest) {
+    o = new Octree<Point, Point, double>(1);
+    OctreePointAgent agent;
+    Point p[2];
+    p[0].position = glm::vec3(1,1,1);
+    p[1].position = glm::vec3(1,1,-1);
+    o->insert(&p[0], &agent);
+    o->insert(&p[1], &agent);
+    ASSERT_EQ("3", o->getItemPath(&p[0]));
+
+    // Still inside its old cell, but insert() would put it into the first of the two cells sharing the face
+    Point previous = p[0];
+    p[0].position = glm::vec3(1,1,0);
+    ASSERT_TRUE(o->update(&p[0], &previous, &agent));
+    ASSERT_EQ('1', o->getItemPath(&p[0])[0]);
+    ASSERT_EQ(2, o->forceGetItemsCount());
+    ASSERT_TRUE(o->remove(&p[0], &agent));
+    ASSERT_TRUE(o->remove(&p[1], &agent));
+    ASSERT_EQ(0, o->getItemsCount());
+}
+
+TEST_F (OctreeTests, UpdateMovingPointsTest) {
+    unsigned int pointsToProcess = std::min(points, (unsigned int)2000);
+
+    o = new Octree<Point, Point, double>(8, OctreeVec3<double>(0), 100);
+
+    Point *p = new Point[pointsToProcess];
+    OctreePointAgentPosition agent;
+
+    std::fstream outputFile;
+    outputFile.open("test.txt", std::ios::in | std::ios::binary);
+    outputFile.read((char *) p, pointsToProcess * sizeof(Point));
+    outputFile.close();
+
+    o->insert(p, pointsToProcess, &agent);
+    for (int step = 0; step < 10; ++step) {
+        for (unsigned int i = 0; i < pointsToProcess; ++i) {
+            Point previous = p[i];
+            p[i].position.x = glm::min(glm::max(p[i].position.x + (i % 7) - 3.0, -100.0), 100.0);
+            p[i].position.y = glm::min(glm::max(p[i].position.y + (i % 5) - 2.0, -100.0), 100.0);
+            p[i].position.z = glm::min(glm::max(p[i].position.z + (i % 3) - 1.0, -100.0), 100.0);
+            ASSERT_TRUE(o->update(&p[i], &previous, &agent));
+        }
+    }
+    ASSERT_EQ(pointsToProcess, o->getItemsCount());
+    ASSERT_EQ(pointsToProcess, o->forceGetItemsCount());
+
+    for (int i = 0; i < 20; ++i) {
+        OctreeVec3<double> query(-95 + 9 * i, 80 - 7 * i, -40 + 4 * i);
+        double radius = 10 + 4 * i;
+        std::vector<const Point *> items;
+        o->queryRadius(query, radius, &agent, items);
+
+        std::vector<const Point *> expected;
+        for (unsigned int j = 0; j < pointsToProcess; ++j) {
+            if (getSquaredDistance(query, agent.GetItemPosition(&p[j])) <= radius * radius) {
+                expected.push_back(&p[j]);
+            }
+        }
+        std::sort(items.begin(), items.end());
+        ASSERT_TRUE(items == expected);
+        ASSERT_EQ(expected.size(), o->countRadius(query, radius, &agent));
+    }
+
+    delete []p;
+}
+
+TEST_F (OctreeTests, BulkInsert5PointsTest) {
+    o = new Octree<Point, Point, double>(1);
+    o2 = new Octree<Point, Point, double>(1);
+    OctreePointAgent agent;
+    Point *p = new Point[6];
+    p[0].position = glm::vec3(1,1,1);
+    p[1].position = glm::vec3(2,1,1);
+    p[2].position = glm::vec3(3,1,1);
+    p[3].position = glm::vec3(4,1,1);
+    p[4].position = glm::vec3(5,1,1);
+    p[5].position = glm::vec3(50,1,1);
+    o->bulkInsert(p, 6, &agent);
+    o2->insert(p, 6, &agent);
+    ASSERT_EQ("3444", o->getItemPath(&p[0]));
+    ASSERT_EQ("3445", o->getItemPath(&p[1]));
+    ASSERT_EQ("3454", o->getItemPath(&p[2]));
+    ASSERT_EQ("34552", o->getItemPath(&p[3]));
+    ASSERT_EQ("34553", o->getItemPath(&p[4]));
+    ASSERT_EQ(5, o->getItemsCount());
+    ASSERT_EQ(5, o->forceGetItemsCount());
+    ASSERT_EQ(o2->getStringRepresentation(), o->getStringRepresentation());
+    ASSERT_TRUE(*o == *o2);
+
+    // A tree that already holds items is extended with regular inserts
+    Point extra;
+    extra.position = glm::vec3(-5,-5,-5);
+    o->bulkInsert(&extra, 1, &agent);
+    ASSERT_EQ("4", o->getItemPath(&extra));
+    ASSERT_EQ(6, o->getItemsCount());
+
+    delete []p;
+}
+
+TEST_F (OctreeTests, BulkInsertDuplicatesTest) {
+    Octree<PointEquality, PointEquality, double> oEquality(2);
+    Octree<PointEquality, PointEquality, double> oEquality2(2);
+    OctreePointEqualityAgent agentEquality;
+    std::vector<PointEquality> pe(12);
+    for (unsigned int i = 0; i < pe.size(); ++i) {
+        pe[i].position = glm::vec3(i % 5 + 1, 1, 1);
+        pe[i].mass = 1.0f;
+    }
+    oEquality.bulkInsert(pe, &agentEquality);
+    oEquality2.insert(pe, &agentEquality);
+    ASSERT_EQ(5, oEquality.getItemsCount());
+    ASSERT_EQ(5, oEquality.forceGetItemsCount());
+    ASSERT_EQ(oEquality2.getStringRepresentation(), oEquality.getStringRepresentation());
+}
+
+TEST_F (OctreeTests, BulkInsertEqualityTest) {
+    unsigned int pointsToProcess = std::min(points, (unsigned int)2000);
+    OctreePointAgent agent;
+    OctreePointAgentAdjust agentAdjust;
+    Point *p = new Point[pointsToProcess];
+    std::fstream outputFile;
+
+    for (auto file : {"test.txt", "denseTest.txt"}) {
+        outputFile.open(file, std::ios::in | std::ios::binary);
+        outputFile.read((char *) p, pointsToProcess * sizeof(Point));
+        outputFile.close();
+
+        for (unsigned int maxItemsPerCell : {1, 3, 8, 64}) {
+            Octree<Point, Point, double> bulk(maxItemsPerCell, OctreeVec3<double>(0), 100);
+            Octree<Point, Point, double> incremental(maxItemsPerCell, OctreeVec3<double>(0), 100);
+            bulk.bulkInsert(p, pointsToProcess, &agent);
+            incremental.insert(p, pointsToProcess, &agent);
+            ASSERT_EQ(incremental.getItemsCount(), bulk.getItemsCount());
+            ASSERT_EQ(incremental.getItemsCount(), bulk.forceGetItemsCount());
+            ASSERT_EQ(incremental.getStringRepresentation(), bulk.getStringRepresentation());
+
+            Octree<Point, Point, double> bulkAdjust(maxItemsPerCell, OctreeVec3<double>(0), 0);
+            Octree<Point, Point, double> incrementalAdjust(maxItemsPerCell, OctreeVec3<double>(0), 0);
+            bulkAdjust.bulkInsert(p, pointsToProcess, &agentAdjust);
+            incrementalAdjust.insert(p, pointsToProcess, &agentAdjust);
+            ASSERT_EQ(pointsToProcess, bulkAdjust.getItemsCount());
+            ASSERT_EQ(incrementalAdjust.getStringRepresentation(), bulkAdjust.getStringRepresentation());
+        }
+    }
+
+    delete []p;
+}
+
+TEST_F (OctreeTests, VisitClusteredThreadsFrom1To16Test) {
+
+    unsigned int pointsToProcess = std::min(points, (unsigned int)4000);
+    std::vector<Point> p(pointsToProcess);
+
+    std::fstream outputFile;
+    outputFile.open("test.txt", std::ios::in | std::ios::binary);
+    outputFile.read((char *) p.data(), pointsToProcess * sizeof(Point));
+    outputFile.close();
+
+    // Most of the items in one small corner, so a single child of the root holds nearly all of them
+    for (unsigned int i = 0; i < pointsToProcess; ++i) {
+        if (i % 16 != 0) {
+            p[i].position = p[i].position * 0.01 + glm::dvec3(60, 60, 60);
+        }
+    }
+
+    OctreePointAgent agent;
+    for (double skipRadius : {0.0, 2.0}) {
+        OctreePointVisitorThreadedOrder control;
+        control.skipRadius = skipRadius;
+        Octree<Point, Point, double> single(4, OctreeVec3<double>(0), 100);
+        single.insert(p, &agent);
+        single.visit(&control);
+        ASSERT_EQ(0u, control.errors);
+        ASSERT_TRUE(control.rootFinished);
+
+        for (unsigned int threads = 2; threads <= 16; ++threads) {
+            OctreePointVisitorThreadedOrder visitor;
+            visitor.skipRadius = skipRadius;
+            Octree<Point, Point, double> tree(4, OctreeVec3<double>(0), 100, threads);
+            tree.insert(p, &agent);
+            tree.visit(&visitor);
+            ASSERT_EQ(0u, visitor.errors);
+            ASSERT_TRUE(visitor.rootFinished);
+            ASSERT_EQ(control.started.size(), visitor.started.size());
+            ASSERT_EQ(control.finished.size(), visitor.finished.size());
+            ASSERT_EQ(control.items, visitor.items);
+        }
+    }
+}
+
+TEST_F (OctreeTests, LinearOctreeTest) {
+
+    unsigned int pointsToProcess = std::min(points, (unsigned int)4000);
+    std::vector<Point> p(pointsToProcess);
+
+    std::fstream outputFile;
+    outputFile.open("test.txt", std::ios::in | std::ios::binary);
+    outputFile.read((char *) p.data(), pointsToProcess * sizeof(Point));
+    outputFile.close();
+
+    // A dense cluster, points on shared faces and one point outside of the tree
+    for (unsigned int i = 0; i < pointsToProcess / 4; ++i) {
+        p[i].position = p[i].position * 0.001 + glm::dvec3(-30, 20, 10);
+    }
+    for (unsigned int i = pointsToProcess / 4; i < pointsToProcess / 4 + 64; ++i) {
+        p[i].position = glm::dvec3(25.0 * (i % 4), 50.0 * ((i / 4) % 4) - 100, -25.0 * ((i / 16) % 4));
+    }
+    p.back().position = glm::dvec3(500);
+
+    OctreePointAgentPosition agent;
+    for (unsigned int threads : {1u, 4u}) {
+        Octree<Point, Point, double> tree(4, OctreeVec3<double>(0), 100);
+        tree.insert(p.data(), pointsToProcess, &agent, nullptr, false);
+        LinearOctree<Point, Point, double> linear(4, OctreeVec3<double>(0), 100, threads);
+        linear.build(p.data(), pointsToProcess, &agent);
+        ASSERT_EQ(tree.getItemsCount(), linear.getItemsCount());
+
+        OctreePointLeavesVisitor treeLeaves;
+        tree.visit(&treeLeaves);
+        OctreePointLinearLeavesVisitor linearLeaves;
+        linear.visit(&linearLeaves);
+        ASSERT_EQ(0u, linearLeaves.errors);
+        ASSERT_TRUE(linearLeaves.branches.empty());
+        ASSERT_EQ(linear.getLeaves().size(), linearLeaves.leaves.size());
+        ASSERT_TRUE(treeLeaves.leaves == linearLeaves.leaves);
+
+        for (unsigned int i = 0; i < pointsToProcess - 1; ++i) {
+            auto &position = p[i].position;
+            int leaf = linear.findLeaf(OctreeVec3<double>(position.x, position.y, position.z));
+            ASSERT_GE(leaf, 0);
+            auto items = linear.getLeafItems(leaf);
+            ASSERT_NE(items + linear.getLeafItemsCount(leaf), std::find(items, items + linear.getLeafItemsCount(leaf), &p[i]));
+        }
+        ASSERT_EQ(-1, linear.findLeaf(OctreeVec3<double>(500)));
+
+        for (double size : {5.0, 30.0, 250.0}) {
+            OctreeVec3<double> min(-30 - size, 20 - size, 10 - size);
+            OctreeVec3<double> max(-30 + size, 20 + size, 10 + size);
+            std::vector<const Point *> expected;
+            std::vector<const Point *> found;
+            tree.queryBox(min, max, &agent, expected);
+            linear.queryBox(min, max, &agent, found);
+            std::sort(expected.begin(), expected.end());
+            std::sort(found.begin(), found.end());
+            ASSERT_TRUE(expected == found);
+        }
+    }
+
+    LinearOctree<Point, Point, double> empty(4, OctreeVec3<double>(0), 100);
+    OctreePointLinearLeavesVisitor emptyLeaves;
+    empty.visit(&emptyLeaves);
+    ASSERT_EQ(1u, emptyLeaves.leaves.size());
+    ASSERT_EQ(-1, empty.findLeaf(OctreeVec3<double>(0)));
+}
+
+TEST_F (OctreeTests, PooledOctreeTest) {
+
+    unsigned int pointsToProcess = std::min(points, (unsigned int)4000);
+    std::vector<Point> p(pointsToProcess);
+
+    std::fstream outputFile;
+    outputFile.open("test.txt", std::ios::in | std::ios::binary);
+    outputFile.read((char *) p.data(), pointsToProcess * sizeof(Point));
+    outputFile.close();
+
+    // A dense cluster and one point outside of the tree
+    for (unsigned int i = 0; i < pointsToProcess / 4; ++i) {
+        p[i].position = p[i].position * 0.001 + glm::dvec3(-30, 20, 10);
+    }
+    p.back().position = glm::dvec3(500);
+
+    OctreePointAgentPosition agent;
+    for (unsigned int maxItems : {1u, 4u}) {
+        Octree<Point, Point, double> tree(maxItems, OctreeVec3<double>(0), 100);
+        tree.insert(p.data(), pointsToProcess, &agent, nullptr, false);
+        PooledOctree<Point, Point, double> pooled(maxItems, OctreeVec3<double>(0), 100);
+        pooled.build(p.data(), pointsToProcess, &agent);
+        ASSERT_EQ(tree.getItemsCount(), pooled.getItemsCount());
+        ASSERT_EQ(tree.stats().nodes, pooled.getNodes().size());
+        ASSERT_EQ(pooled.getItemsCount(), pooled.getNodes()[0].itemsCount);
+        ASSERT_EQ(12u, sizeof(OctreePooledNode));
+
+        // Same cells with the same items
+        OctreePointLeavesVisitor treeLeaves;
+        OctreePointPooledLeavesVisitor pooledLeaves;
+        tree.visit(&treeLeaves);
+        pooled.visit(&pooledLeaves);
+        ASSERT_EQ(0u, pooledLeaves.errors);
+        ASSERT_TRUE(pooledLeaves.branches.empty());
+        ASSERT_TRUE(treeLeaves.leaves == pooledLeaves.leaves);
+
+        for (double size : {0.5, 5.0, 30.0, 250.0}) {
+            OctreeVec3<double> point(-30, 20, 10);
+            OctreeVec3<double> min(-30 - size, 20 - size, 10 - size);
+            OctreeVec3<double> max(-30 + size, 20 + size, 10 + size);
+            std::vector<const Point *> expected;
+            std::vector<const Point *> found;
+            tree.queryBox(min, max, &agent, expected);
+            pooled.queryBox(min, max, &agent, found);
+            std::sort(expected.begin(), expected.end());
+            std::sort(found.begin(), found.end());
+            ASSERT_TRUE(expected == found);
+
+            expected.clear();
+            found.clear();
+            tree.queryRadius(point, size, &agent, expected);
+            pooled.queryRadius(point, size, &agent, found);
+            std::sort(expected.begin(), expected.end());
+            std::sort(found.begin(), found.end());
+            ASSERT_TRUE(expected == found);
+            ASSERT_EQ(tree.countRadius(point, size, &agent), pooled.countRadius(point, size, &agent));
+        }
+
+        // Ties may come in another order, the distances may not
+        for (unsigned int i = 0; i < 20; ++i) {
+            OctreeVec3<double> query(p[i * 97].position.x, p[i * 97].position.y + 1, p[i * 97].position.z);
+            auto expected = tree.findKNearest(query, 10, &agent);
+            auto found = pooled.findKNearest(query, 10, &agent);
+            ASSERT_EQ(expected.size(), found.size());
+            for (size_t j = 0; j < found.size(); ++j) {
+                ASSERT_EQ(getSquaredDistance(query, agent.GetItemPosition(expected[j])),
+                          getSquaredDistance(query, agent.GetItemPosition(found[j])));
+            }
+        }
+        ASSERT_EQ(pooled.getItemsCount(), pooled.findKNearest(OctreeVec3<double>(0), pointsToProcess, &agent).size());
+    }
+
+    PooledOctree<Point, Point, double> empty(4, OctreeVec3<double>(0), 100);
+    std::vector<const Point *> found;
+    empty.queryRadius(OctreeVec3<double>(0), 10, &agent, found);
+    ASSERT_TRUE(found.empty());
+    ASSERT_EQ(0u, empty.countRadius(OctreeVec3<double>(0), 10, &agent));
+    ASSERT_TRUE(empty.findKNearest(OctreeVec3<double>(0), 3, &agent).empty());
+    OctreePointPooledLeavesVisitor emptyLeaves;
+    empty.visit(&emptyLeaves);
+    ASSERT_TRUE(emptyLeaves.leaves.empty());
+    ASSERT_EQ(1u, empty.getNodes().size());
+}
+
+TEST_F (OctreeTests, LeafPositionsTest) {
+
+    unsigned int pointsToProcess = std::min(points, (unsigned int)3000);
+    std::vector<Point> p(pointsToProcess);
+    std::vector<Point> moved(pointsToProcess);
+
+    std::fstream outputFile;
+    outputFile.open("test.txt", std::ios::in | std::ios::binary);
+    outputFile.read((char *) p.data(), pointsToProcess * sizeof(Point));
+    outputFile.close();
+
+    OctreePointAgentPosition agent;
+    OctreePointAgentOctant octantAgent;
+    OctreePointStaticAgent staticAgent;
+    const OctreeAgent<Point, Point, double> *baseAgent = &octantAgent;
+
+    Octree<Point, Point, double> control(4, OctreeVec3<double>(0), 100);
+    control.insert(p.data(), pointsToProcess, &agent, nullptr, false);
+
+    std::vector<std::shared_ptr<Octree<Point, Point, double> > > trees;
+    for (unsigned int threads : {1u, 4u}) {
+        for (int build = 0; build < 4; ++build) {
+            auto tree = std::make_shared<Octree<Point, Point, double> >(4, OctreeVec3<double>(0), 100, threads);
+            tree->enableLeafPositions(&agent);
+            if (build == 0) {
+                tree->insert(p.data(), pointsToProcess, &agent, nullptr, false);
+            } else if (build == 1) {
+                tree->bulkInsert(p.data(), pointsToProcess, &staticAgent);
+            } else if (build == 2) {
+                tree->insert(p.data(), pointsToProcess, baseAgent, nullptr, false);
+            } else {
+                for (auto &point : p) {
+                    tree->insert(&point, &agent);
+                }
+            }
+            trees.push_back(tree);
+        }
+    }
+
+    // Positions enabled on a tree that already has items
+    auto late = std::make_shared<Octree<Point, Point, double> >(4, OctreeVec3<double>(0), 100);
+    late->insert(p.data(), pointsToProcess, &agent, nullptr, false);
+    late->enableLeafPositions(&agent);
+    trees.push_back(late);
+
+    for (auto &tree : trees) {
+        ASSERT_TRUE(*tree == control);
+        OctreePointLeafPositionsVisitor visitor;
+        tree->visit(&visitor);
+        ASSERT_EQ(0u, visitor.errors);
+        ASSERT_EQ(control.getItemsCount(), visitor.items);
+
+        for (unsigned int i = 0; i < pointsToProcess; i += 97) {
+            OctreeVec3<double> query(p[i].position.x, p[i].position.y, p[i].position.z);
+            std::vector<const Point *> expected, found;
+            control.queryRadius(query, 10, &agent, expected);
+            tree->queryRadius(query, 10, &agent, found);
+            std::sort(expected.begin(), expected.end());
+            std::sort(found.begin(), found.end());
+            ASSERT_TRUE(expected == found);
+            ASSERT_EQ(control.countRadius(query, 10, &agent), tree->countRadius(query, 10, &agent));
+            ASSERT_TRUE(control.findKNearest(query, 5, &agent) == tree->findKNearest(query, 5, &agent));
+
+            expected.clear();
+            found.clear();
+            control.queryBox(query - OctreeVec3<double>(8), query + OctreeVec3<double>(8), &agent, expected);
+            tree->queryBox(query - OctreeVec3<double>(8), query + OctreeVec3<double>(8), &agent, found);
+            std::sort(expected.begin(), expected.end());
+            std::sort(found.begin(), found.end());
+            ASSERT_TRUE(expected == found);
+        }
+    }
+
+    // Removes collapse branches and updates move items between leaves, with and without snapshots
+    auto tree = trees[0];
+    auto snapshotTree = trees[1];
+    snapshotTree->enableSnapshots();
+    for (unsigned int i = 0; i < pointsToProcess; i += 2) {
+        ASSERT_TRUE(tree->remove(&p[i], &agent));
+        ASSERT_TRUE(snapshotTree->remove(&p[i], &agent));
+    }
+    for (unsigned int i = 1; i < pointsToProcess; i += 4) {
+        moved[i] = p[i];
+        p[i].position = i % 8 == 1 ? p[i].position + glm::dvec3(0.001) : p[(i + 1000) % pointsToProcess].position * 0.5;
+        tree->update(&p[i], &moved[i], &agent);
+        snapshotTree->update(&p[i], &moved[i], &agent);
+    }
+    for (auto &t : {tree, snapshotTree}) {
+        OctreePointLeafPositionsVisitor visitor;
+        t->visit(&visitor);
+        ASSERT_EQ(0u, visitor.errors);
+        ASSERT_EQ(t->getItemsCount(), visitor.items);
+    }
+    OctreePointLeafPositionsVisitor visitor;
+    snapshotTree->snapshot()->visit(&visitor);
+    ASSERT_EQ(0u, visitor.errors);
+}
+
+TEST_F (OctreeTests, SnapshotTest) {
+
+    unsigned int pointsToProcess = std::min(points, (unsigned int)2000);
+    std::vector<Point> p(pointsToProcess);
+    std::vector<Point> moved(pointsToProcess);
+
+    std::fstream outputFile;
+    outputFile.open("test.txt", std::ios::in | std::ios::binary);
+    outputFile.read((char *) p.data(), pointsToProcess * sizeof(Point));
+    outputFile.close();
+
+    OctreePointAgentPosition agent;
+    unsigned int half = pointsToProcess / 2;
+
+    Octree<Point, Point, double> tree(4, OctreeVec3<double>(0), 100, 4);
+    Octree<Point, Point, double> control(4, OctreeVec3<double>(0), 100);
+    tree.enableSnapshots();
+    auto empty = tree.snapshot();
+    ASSERT_EQ(0, empty->getItemsCount());
+
+    tree.bulkInsert(p.data(), half, &agent);
+    control.insert(p.data(), half, &agent, nullptr, false);
+    auto first = tree.snapshot();
+    std::string firstRepresentation = first->getStringRepresentation();
+    ASSERT_EQ(control.getStringRepresentation(), firstRepresentation);
+    ASSERT_EQ(0, empty->getItemsCount());
+    Octree<Point, Point, double> emptyControl(4);
+    ASSERT_EQ(emptyControl.getStringRepresentation(), empty->getStringRepresentation());
+
+    // Batch insert, single inserts, removes and updates all leave the first version as it was
+    tree.insert(p.data() + half, half / 2, &agent, nullptr, false);
+    for (unsigned int i = half + half / 2; i < pointsToProcess; ++i) {
+        tree.insert(&p[i], &agent);
+    }
+    for (unsigned int i = 0; i < pointsToProcess; i += 3) {
+        ASSERT_TRUE(tree.remove(&p[i], &agent));
+    }
+    for (unsigned int i = 1; i < pointsToProcess; i += 3) {
+        moved[i] = p[i];
+        p[i].position = p[(i + 500) % pointsToProcess].position * 0.5;
+        tree.update(&p[i], &moved[i], &agent);
+    }
+    ASSERT_EQ(firstRepresentation, first->getStringRepresentation());
+    ASSERT_EQ(half, first->getItemsCount());
+    ASSERT_EQ(half, first->forceGetItemsCount());
+
+    auto second = tree.snapshot();
+    ASSERT_EQ(tree.getStringRepresentation(), second->getStringRepresentation());
+    ASSERT_EQ(tree.getItemsCount(), second->getItemsCount());
+    ASSERT_EQ(second->forceGetItemsCount(), second->getItemsCount());
+
+    std::weak_ptr<const Octree<Point, Point, double> > released = first;
+    first.reset();
+    ASSERT_TRUE(released.expired());
+
+    tree.clear();
+    ASSERT_EQ(0, tree.snapshot()->getItemsCount());
+    ASSERT_EQ(second->forceGetItemsCount(), second->getItemsCount());
+}
+
+// An update that keeps the item in its leaf changes the leaf positions, so it publishes as well
+TEST_F (OctreeTests, SnapshotUpdateInLeafTest) {
+
+    std::vector<Point> p(3);
+    p[0].position = glm::dvec3(10, 10, 10);
+    p[1].position = glm::dvec3(-10, 10, 10);
+    p[2].position = glm::dvec3(10, -10, 10);
+
+    OctreePointAgentPosition agent;
+    Octree<Point, Point, double> tree(4, OctreeVec3<double>(0), 100);
+    tree.enableLeafPositions(&agent);
+    tree.enableSnapshots();
+    tree.insert(p.data(), 3, &agent, nullptr, false);
+    auto first = tree.snapshot();
+
+    Point previous = p[0];
+    p[0].position = glm::dvec3(11, 10, 10);
+    ASSERT_TRUE(tree.update(&p[0], &previous, &agent));
+    auto second = tree.snapshot();
+    ASSERT_NE(first, second);
+
+    std::vector<const Point *> found;
+    second->queryRadius(OctreeVec3<double>(11, 10, 10), 0.1, &agent, found);
+    ASSERT_EQ(1u, found.size());
+    ASSERT_EQ(&p[0], found[0]);
+    ASSERT_EQ(0u, second->countRadius(OctreeVec3<double>(10, 10, 10), 0.1, &agent));
+
+    // The first version keeps the position it was published with
+    found.clear();
+    first->queryRadius(OctreeVec3<double>(10, 10, 10), 0.1, &agent, found);
+    ASSERT_EQ(1u, found.size());
+    ASSERT_EQ(0u, first->countRadius(OctreeVec3<double>(11, 10, 10), 0.1, &agent));
+}
+
+TEST_F (OctreeTests, SnapshotReadersTest) {
+
+    unsigned int pointsToProcess = std::min(points, (unsigned int)4000);
+    std::vector<Point> p(pointsToProcess);
+
+    std::fstream outputFile;
+    outputFile.open("test.txt", std::ios::in | std::ios::binary);
+    outputFile.read((char *) p.data(), pointsToProcess * sizeof(Point));
+    outputFile.close();
+
+    OctreePointAgentPosition agent;
+    Octree<Point, Point, double> tree(4, OctreeVec3<double>(0), 100);
+    tree.enableSnapshots();
+
+    // Readers query whatever version is published while one writer keeps inserting
+    std::atomic_bool writing(true);
+    std::atomic_uint errors(0);
+    std::vector<std::thread> readers;
+    for (int r = 0; r < 3; ++r) {
+        readers.push_back(std::thread([&]() {
+            while (writing) {
+                auto version = tree.snapshot();
+                unsigned int count = version->getItemsCount();
+                if (version->forceGetItemsCount() != count ||
+                    version->countRadius(OctreeVec3<double>(0), 1000, &agent) != count) {
+                    errors++;
+                }
+            }
+        }));
+    }
+    for (unsigned int i = 0; i < pointsToProcess; i += 100) {
+        tree.insert(p.data() + i, std::min(100u, pointsToProcess - i), &agent, nullptr, false);
+        for (unsigned int j = i; j < std::min(i + 100, pointsToProcess); j += 7) {
+            tree.remove(&p[j], &agent);
+            tree.insert(&p[j], &agent);
+        }
+    }
+    writing = false;
+    for (auto &reader : readers) {
+        reader.join();
+    }
+    ASSERT_EQ(0u, errors.load());
+    ASSERT_EQ(pointsToProcess, tree.snapshot()->getItemsCount());
+}
+
+TEST_F (OctreeTests, ThreadPoolTest) {
+    for (unsigned int threads = 1; threads <= 16; ++threads) {
+        OctreeThreadPool pool(threads, threads % 2 == 0 ? 0 : 64);
+        ASSERT_EQ(threads, pool.getThreadsNumber());
+
+        std::vector<std::atomic_uint> calls(threads);
+        for (auto &c : calls) {
+            c.store(0);
+        }
+        for (int run = 0; run < 20; ++run) {
+            pool.run([&](unsigned int thread) {
+                calls[thread]++;
+            });
+            for (auto &c : calls) {
+                ASSERT_EQ(run + 1, c.load());
+            }
+        }
+    }
+}
+
+TEST_F (OctreeTests, SharedThreadPoolTest) {
+
+    unsigned int pointsToProcess = std::min(points, (unsigned int)2000);
+
+    Point *p = new Point[pointsToProcess];
+    OctreePointAgent agent;
+    OctreePointVisitor visitor;
+    OctreePointVisitorThreaded visitorThreaded;
+
+    std::fstream outputFile;
+    outputFile.open("test.txt", std::ios::in | std::ios::binary);
+    outputFile.read((char *) p, pointsToProcess * sizeof(Point));
+    outputFile.close();
+
+    o = new Octree<Point, Point, double>(8, OctreeVec3<double>(0), 100);
+    o->insert(p, pointsToProcess, &agent);
+    o->visit(&visitor);
+    auto controlPoint = testPoint;
+
+    auto pool = std::make_shared<OctreeThreadPool>(4);
+    Octree<Point, Point, double> first(8, OctreeVec3<double>(0), 100, pool);
+    Octree<Point, Point, double> second(8, OctreeVec3<double>(0), 100, pool);
+    ASSERT_EQ(pool, first.getThreadPool());
+    ASSERT_EQ(pool, second.getThreadPool());
+
+    // The same pool serves every call, like a tree rebuilt every frame
+    for (int frame = 0; frame < 60; ++frame) {
+        auto &tree = frame % 2 == 0 ? first : second;
+        tree.clear();
+        tree.insert(p, pointsToProcess, &agent);
+        ASSERT_TRUE(tree == *o);
+
+        testPoint = Point();
+        tree.visit(&visitorThreaded);
+        ASSERT_FLOAT_EQ(controlPoint.mass, testPoint.mass);
+        ASSERT_FLOAT_EQ(controlPoint.position.x, testPoint.position.x);
+        ASSERT_FLOAT_EQ(controlPoint.position.y, testPoint.position.y);
+        ASSERT_FLOAT_EQ(controlPoint.position.z, testPoint.position.z);
+    }
+
+    delete []p;
+}
+
+// Trees sharing a pool may be used from inside a job of that pool, on the caller and on a worker
+TEST_F (OctreeTests, ThreadPoolReentryTest) {
+
+    unsigned int pointsToProcess = std::min(points, (unsigned int)2000);
+    std::vector<Point> p(pointsToProcess);
+
+    std::fstream outputFile;
+    outputFile.open("test.txt", std::ios::in | std::ios::binary);
+    outputFile.read((char *) p.data(), pointsToProcess * sizeof(Point));
+    outputFile.close();
+
+    OctreePointAgent agent;
+    Octree<Point, Point, double> control(8, OctreeVec3<double>(0), 100);
+    control.insert(p.data(), pointsToProcess, &agent);
+
+    auto pool = std::make_shared<OctreeThreadPool>(4);
+    Octree<Point, Point, double> first(8, OctreeVec3<double>(0), 100, pool);
+    Octree<Point, Point, double> second(8, OctreeVec3<double>(0), 100, pool);
+    std::vector<std::atomic_uint> calls(pool->getThreadsNumber());
+    for (auto &c : calls) {
+        c.store(0);
+    }
+    pool->run([&](unsigned int thread) {
+        if (thread == 0) {
+            first.insert(p.data(), pointsToProcess, &agent);
+        } else if (thread == 1) {
+            second.insert(p.data(), pointsToProcess, &agent);
+        }
+        pool->run([&](unsigned int inner) {
+            calls[inner]++;
+        });
+    });
+    ASSERT_TRUE(first == control);
+    ASSERT_TRUE(second == control);
+    for (auto &c : calls) {
+        ASSERT_EQ(pool->getThreadsNumber(), c.load());
+    }
+}
+
+TEST_F (OctreeTests, BulkInsertThreadsFrom1To16Test) {
+    unsigned int pointsToProcess = std::min(points, (unsigned int)5000);
+    OctreePointAgent agent;
+    OctreePointAgentAdjust agentAdjust;
+    OctreePointAgentPosition agentPosition;
+    Point *p = new Point[pointsToProcess];
+    std::fstream outputFile;
+
+    for (auto file : {"test.txt", "denseTest.txt"}) {
+        outputFile.open(file, std::ios::in | std::ios::binary);
+        outputFile.read((char *) p, pointsToProcess * sizeof(Point));
+        outputFile.close();
+
+        Octree<Point, Point, double> incremental(4, OctreeVec3<double>(0), 0);
+        incremental.insert(p, pointsToProcess, &agentAdjust);
+        for (unsigned int i = 1; i <= 16; ++i) {
+            Octree<Point, Point, double> bulk(4, OctreeVec3<double>(0), 0, i);
+            bulk.bulkInsert(p, pointsToProcess, &agentAdjust);
+            ASSERT_EQ(incremental.getItemsCount(), bulk.getItemsCount());
+            ASSERT_EQ(incremental.getItemsCount(), bulk.forceGetItemsCount());
+            ASSERT_EQ(incremental.getStringRepresentation(), bulk.getStringRepresentation());
+            ASSERT_EQ(pointsToProcess, bulk.countRadius(OctreeVec3<double>(0), 1000, &agentPosition));
+        }
+    }
+
+    Octree<Point, Point, double> small(8, OctreeVec3<double>(0), 100, 4);
+    small.bulkInsert(p, 5, &agent);
+    ASSERT_EQ("Leaf, items:5 " + std::to_string((unsigned long long)&p[0]) + " " + std::to_string((unsigned long long)&p[1]) + " " +
+              std::to_string((unsigned long long)&p[2]) + " " + std::to_string((unsigned long long)&p[3]) + " " +
+              std::to_string((unsigned long long)&p[4]) + "\n", small.getStringRepresentation());
+
+    delete []p;
+}
+
+class OctreeSiblingBlockVisitor : public OctreeVisitor<Point, Point, double> {
+public:
+    mutable unsigned int branches = 0;
+
+    virtual void visitBranch(const OctreeCell<Point, Point, double> * cell,
+                             const std::shared_ptr<OctreeCell<Point, Point, double> > childs[8]) const override {
+        branches++;
+        for (int i = 0; i < 8; ++i) {
+            ASSERT_EQ(childs[0].get() + i, childs[i].get());
+            ASSERT_EQ((unsigned int)i, childs[i]->getCellIndex());
+            ContinueVisit(childs[i]);
+        }
+    }
+};
+
+TEST_F (OctreeTests, SiblingCellsShareBlockTest) {
+    unsigned int pointsToProcess = std::min(points, (unsigned int)2000);
+    o = new Octree<Point, Point, double>(8, OctreeVec3<double>(0), 100);
+    o2 = new Octree<Point, Point, double>(8, OctreeVec3<double>(0), 100);
+    OctreePointAgentPosition agent;
+    Point *p = new Point[pointsToProcess];
+
+    std::fstream outputFile;
+    outputFile.open("test.txt", std::ios::in | std::ios::binary);
+    outputFile.read((char *) p, pointsToProcess * sizeof(Point));
+    outputFile.close();
+
+    o->insert(p, pointsToProcess, &agent);
+    o2->bulkInsert(p, pointsToProcess, &agent);
+    OctreeSiblingBlockVisitor visitor, visitor2;
+    o->visit(&visitor);
+    o2->visit(&visitor2);
+    ASSERT_LT(0u, visitor.branches);
+    ASSERT_EQ(visitor.branches, visitor2.branches);
+
+    for (unsigned int i = 0; i < pointsToProcess; ++i) {
+        ASSERT_TRUE(o->remove(&p[i], &agent));
+    }
+    ASSERT_EQ("Leaf, items:0\n", o->getStringRepresentation());
+
+    delete []p;
+}
+
+// Counts the leaves with items whose storage holds more than maxItemsPerCell items or, with
+// checkSlack, more than twice their items once past the first growth
+class OctreeLeafCapacityVisitor : public OctreeVisitor<Point, Point, double> {
+public:
+    unsigned int maxItemsPerCell = 0;
+    bool checkSlack = true;
+    mutable unsigned int leaves = 0;
+    mutable unsigned int errors = 0;
+
+    virtual void visitLeaf(const OctreeCell<Point, Point, double> * const cell,
+                           const std::vector<const Point *> &items) const override {
+        if (!items.empty()) {
+            leaves++;
+            if (items.capacity() > maxItemsPerCell ||
+                (checkSlack && items.capacity() > std::max<size_t>(OctreeLeafMinCapacity, 2 * items.size()))) {
+                errors++;
+            }
+        }
+    }
+};
+
+TEST_F (OctreeTests, LeafCapacityTest) {
+    unsigned int pointsToProcess = std::min(points, (unsigned int)2000);
+    std::vector<Point> p(pointsToProcess);
+
+    std::fstream outputFile;
+    outputFile.open("test.txt", std::ios::in | std::ios::binary);
+    outputFile.read((char *) p.data(), pointsToProcess * sizeof(Point));
+    outputFile.close();
+
+    OctreePointAgentPosition agent;
+    for (unsigned int maxItemsPerCell : {1u, 5u, 16u}) {
+        Octree<Point, Point, double> tree(maxItemsPerCell, OctreeVec3<double>(0), 100);
+        Octree<Point, Point, double> bulk(maxItemsPerCell, OctreeVec3<double>(0), 100);
+        tree.insert(p.data(), pointsToProcess, &agent, nullptr, false);
+        bulk.bulkInsert(p.data(), pointsToProcess, &agent);
+
+        OctreeLeafCapacityVisitor visitor;
+        visitor.maxItemsPerCell = maxItemsPerCell;
+        tree.visit(&visitor);
+        bulk.visit(&visitor);
+        ASSERT_LT(0u, visitor.leaves);
+        ASSERT_EQ(0u, visitor.errors);
+
+        // Collapsed branches hold just their items, leaves that lost items keep their storage
+        for (unsigned int i = 0; i < pointsToProcess; i += 2) {
+            ASSERT_TRUE(tree.remove(&p[i], &agent));
+        }
+        visitor.checkSlack = false;
+        tree.visit(&visitor);
+        ASSERT_EQ(0u, visitor.errors);
+    }
+}
+
+// Counts the items of the leaves of a tree keeping them inside its cells, and the leaves that allocated them
+template<class Policy>
+class OctreeInlineLeafVisitor : public OctreeVisitor<Point, Point, double, Policy> {
+public:
+    mutable unsigned int items = 0;
+    mutable unsigned int allocatedLeaves = 0;
+
+    virtual void visitLeaf(const OctreeCell<Point, Point, double, Policy> * const cell,
+                           const typename Policy::template LeafItems<const Point *> &items) const override {
+        this->items += (unsigned int)items.size();
+        if (items.getAllocatedBytes() != 0) {
+            allocatedLeaves++;
+        }
+    }
+};
+
+TEST_F (OctreeTests, InlineLeafCellPolicyTest) {
+    unsigned int pointsToProcess = std::min(points, (unsigned int)2000);
+    std::vector<Point> p(pointsToProcess);
+
+    std::fstream outputFile;
+    outputFile.open("test.txt", std::ios::in | std::ios::binary);
+    outputFile.read((char *) p.data(), pointsToProcess * sizeof(Point));
+    outputFile.close();
+
+    typedef OctreeInlineLeafCellPolicy<8> InlinePolicy;
+    OctreePointAgentPosition agent;
+    Octree<Point, Point, double> reference(8, OctreeVec3<double>(0), 100);
+    reference.insert(p.data(), pointsToProcess, &agent, nullptr, false);
+
+    Octree<Point, Point, double, InlinePolicy> tree(8, OctreeVec3<double>(0), 100);
+    tree.enableLeafPositions(&agent);
+    tree.insert(p.data(), pointsToProcess, &agent, nullptr, false);
+    ASSERT_EQ(reference.getStringRepresentation(), tree.getStringRepresentation());
+    ASSERT_EQ(0u, tree.stats().leafDataBytes);
+
+    OctreeInlineLeafVisitor<InlinePolicy> visitor;
+    tree.visit(&visitor);
+    ASSERT_EQ(reference.getItemsCount(), visitor.items);
+    ASSERT_EQ(0u, visitor.allocatedLeaves);
+
+    Octree<Point, Point, double, InlinePolicy> bulk(8, OctreeVec3<double>(0), 100);
+    bulk.bulkInsert(p.data(), pointsToProcess, &agent);
+    ASSERT_EQ(reference.getItemsCount(), bulk.forceGetItemsCount());
+
+    std::vector<const Point *> expected, items;
+    reference.queryRadius(OctreeVec3<double>(0), 30, &agent, expected);
+    tree.queryRadius(OctreeVec3<double>(0), 30, &agent, items);
+    ASSERT_EQ(expected.size(), items.size());
+
+    // Snapshots copy the items kept in place, and collapsed branches move them back into the cell
+    tree.enableSnapshots();
+    auto snapshot = tree.snapshot();
+    for (unsigned int i = 0; i < pointsToProcess; i += 2) {
+        ASSERT_EQ(reference.remove(&p[i], &agent), tree.remove(&p[i], &agent));
+    }
+    ASSERT_EQ(reference.getStringRepresentation(), tree.getStringRepresentation());
+    ASSERT_EQ(0u, tree.stats().leafDataBytes);
+    ASSERT_EQ(bulk.forceGetItemsCount(), snapshot->forceGetItemsCount());
+
+    // Leaves holding more items than the room in the cell allocate like a vector
+    typedef OctreeInlineLeafCellPolicy<2, OctreeSingleWriterCellPolicy> SmallInlinePolicy;
+    Octree<Point, Point, double, SmallInlinePolicy> spilled(8, OctreeVec3<double>(0), 100, 2);
+    spilled.insert(p.data(), pointsToProcess, &agent, nullptr, false);
+    ASSERT_EQ(bulk.forceGetItemsCount(), spilled.getItemsCount());
+    OctreeInlineLeafVisitor<SmallInlinePolicy> spilledVisitor;
+    spilled.visit(&spilledVisitor);
+    ASSERT_EQ(spilled.getItemsCount(), spilledVisitor.items);
+    ASSERT_LT(0u, spilledVisitor.allocatedLeaves);
+    ASSERT_LT(0u, spilled.stats().leafDataBytes);
+}
+
+TEST_F (OctreeTests, StatsTest) {
+    OctreePointAgentPosition agent;
+    Point p[2];
+    p[0].position = glm::vec3(1, 1, 1);
+    p[1].position = glm::vec3(-1, -1, -1);
+    Octree<Point, Point, double> small(1, OctreeVec3<double>(0), 100);
+    ASSERT_EQ(1u, small.stats().leaves);
+    ASSERT_EQ(1.0, small.stats().getEmptyLeafRatio());
+    small.insert(p, 2, &agent);
+
+    OctreeStats stats = small.stats();
+    ASSERT_EQ(9u, stats.nodes);
+    ASSERT_EQ(1u, stats.branches);
+    ASSERT_EQ(8u, stats.leaves);
+    ASSERT_EQ(6u, stats.emptyLeaves);
+    ASSERT_EQ(0.75, stats.getEmptyLeafRatio());
+    ASSERT_EQ(std::vector<size_t>({0, 8}), stats.depthHistogram);
+    ASSERT_EQ(std::vector<size_t>({6, 2}), stats.occupancyHistogram);
+    ASSERT_EQ(9 * sizeof(Point), stats.nodeDataBytes);
+    ASSERT_LE(2 * sizeof(Point *), stats.leafDataBytes);
+    ASSERT_EQ(0u, stats.leafPositionsBytes);
+    // The root on its own and one block for its eight children
+    typedef OctreeCell<Point, Point, double> Cell;
+    typedef OctreeCellBlock<Point, Point, double> CellBlock;
+    ASSERT_EQ(getSharedControlBytes<Cell>(1u, OctreeVec3<double>(), 1.0) +
+              getSharedControlBytes<CellBlock>(1u, OctreeVec3<double>(), 1.0) + sizeof(CellBlock) - 8 * sizeof(Cell),
+              stats.controlBlockBytes);
+    ASSERT_LT(0u, stats.controlBlockBytes);
+
+    unsigned int pointsToProcess = std::min(points, (unsigned int)4000);
+    std::vector<Point> cloud(pointsToProcess);
+
+    std::fstream outputFile;
+    outputFile.open("test.txt", std::ios::in | std::ios::binary);
+    outputFile.read((char *) cloud.data(), pointsToProcess * sizeof(Point));
+    outputFile.close();
+
+    Octree<Point, Point, double> single(4, OctreeVec3<double>(0), 100);
+    single.insert(cloud.data(), pointsToProcess, &agent);
+    OctreeStats expected = single.stats();
+    ASSERT_EQ(expected.nodes, expected.branches + expected.leaves);
+    ASSERT_EQ(expected.nodes, 8 * expected.branches + 1);
+    ASSERT_EQ(expected.emptyLeaves, expected.occupancyHistogram[0]);
+    size_t leaves = 0, items = 0;
+    for (size_t depth = 0; depth < expected.depthHistogram.size(); ++depth) {
+        leaves += expected.depthHistogram[depth];
+    }
+    for (size_t count = 0; count < expected.occupancyHistogram.size(); ++count) {
+        items += count * expected.occupancyHistogram[count];
+    }
+    ASSERT_EQ(expected.leaves, leaves);
+    ASSERT_EQ(single.getItemsCount(), items);
+
+    // Every thread count measures the same tree
+    for (unsigned int threads = 2; threads <= 16; threads *= 2) {
+        Octree<Point, Point, double> tree(4, OctreeVec3<double>(0), 100, threads);
+        tree.insert(cloud.data(), pointsToProcess, &agent);
+        OctreeStats threaded = tree.stats();
+        ASSERT_EQ(expected.nodes, threaded.nodes);
+        ASSERT_EQ(expected.branches, threaded.branches);
+        ASSERT_EQ(expected.emptyLeaves, threaded.emptyLeaves);
+        ASSERT_EQ(expected.depthHistogram, threaded.depthHistogram);
+        ASSERT_EQ(expected.occupancyHistogram, threaded.occupancyHistogram);
+        ASSERT_EQ(expected.getTotalBytes(), threaded.getTotalBytes());
+
+        tree.enableLeafPositions(&agent);
+        ASSERT_LE(3 * pointsToProcess * sizeof(double), tree.stats().leafPositionsBytes);
+    }
+}
+
+TEST_F (OctreeTests, CountersTest) {
+    unsigned int pointsToProcess = std::min(points, (unsigned int)2000);
+    std::vector<Point> p(pointsToProcess);
+
+    std::fstream outputFile;
+    outputFile.open("test.txt", std::ios::in | std::ios::binary);
+    outputFile.read((char *) p.data(), pointsToProcess * sizeof(Point));
+    outputFile.close();
+
+    OctreePointAgentPosition agent;
+    OctreePointVisitorThreaded visitor;
+    Octree<Point, Point, double> tree(4, OctreeVec3<double>(0), 100, 4);
+    tree.insert(p.data(), pointsToProcess, &agent, nullptr, false);
+    tree.insert(p.data(), pointsToProcess / 2, &agent, nullptr, false);
+    tree.concurrentInsert(&p[0], &agent);
+    tree.visit(&visitor);
+
+    OctreeCounters counters = tree.getCounters();
+#ifdef OCTREE_INSTRUMENTATION
+    ASSERT_EQ(pointsToProcess / 2 + 1, counters.duplicatesRejected);
+    ASSERT_LT(0u, counters.splits);
+    ASSERT_EQ(4 * counters.splits, counters.splitReinserts);
+    ASSERT_LE(pointsToProcess + pointsToProcess / 2 + 1, counters.overlapTests);
+    ASSERT_LT(0u, counters.lockAcquisitions);
+    ASSERT_LE(counters.contendedLocks, counters.lockAcquisitions);
+    ASSERT_LT(0u, counters.visitTasks);
+    ASSERT_LE(1u, counters.visitThreadNanoseconds.size());
+    ASSERT_GE(4u, counters.visitThreadNanoseconds.size());
+
+    tree.resetCounters();
+    counters = tree.getCounters();
+#endif
+    ASSERT_EQ(0u, counters.overlapTests);
+    ASSERT_EQ(0u, counters.splits);
+    ASSERT_EQ(0u, counters.duplicatesRejected);
+    ASSERT_EQ(0u, counters.lockAcquisitions);
+    ASSERT_EQ(0u, counters.visitTasks);
+    ASSERT_TRUE(counters.visitThreadNanoseconds.empty());
+}
+
+TEST_F (OctreeTests, TracerTest) {
+    unsigned int pointsToProcess = std::min(points, (unsigned int)4000);
+    std::vector<Point> p(pointsToProcess);
+
+    std::fstream outputFile;
+    outputFile.open("test.txt", std::ios::in | std::ios::binary);
+    outputFile.read((char *) p.data(), pointsToProcess * sizeof(Point));
+    outputFile.close();
+
+    OctreePointAgentPosition agent;
+    OctreePointVisitorThreaded visitor;
+    auto tracer = std::make_shared<OctreeTracer>();
+    Octree<Point, Point, double> tree(4, OctreeVec3<double>(0), 100, 4);
+    Octree<Point, Point, double> bulk(4, OctreeVec3<double>(0), 100, 4);
+    tree.setTracer(tracer);
+    bulk.setTracer(tracer);
+    tree.insert(p.data(), pointsToProcess, &agent, nullptr, false);
+    bulk.bulkInsert(p.data(), pointsToProcess, &agent);
+    tree.visit(&visitor);
+    ASSERT_EQ(4u, tracer->getThreadsNumber());
+
+    std::map<std::string, unsigned int> spans;
+    uint64_t builtItems = 0;
+    unsigned int rootTasks = 0;
+    for (unsigned int thread = 0; thread < tracer->getThreadsNumber(); ++thread) {
+        for (auto &event : tracer->getThreadEvents(thread)) {
+            ASSERT_LE(event.beginNanoseconds, event.endNanoseconds);
+            spans[event.name]++;
+            if (std::string(event.name) == "buildTask") {
+                builtItems += event.items;
+            }
+            if (std::string(event.name) == "visitTask" && event.items == tree.getItemsCount()) {
+                rootTasks++;
+            }
+        }
+    }
+    ASSERT_EQ(4u, spans["insertThread"]);
+    ASSERT_EQ(4u, spans["buildThread"]);
+    ASSERT_EQ(4u, spans["visitThread"]);
+    ASSERT_LT(0u, spans["buildTask"]);
+    ASSERT_LT(0u, spans["visitTask"]);
+    ASSERT_EQ(pointsToProcess, builtItems);
+    ASSERT_EQ(1u, rootTasks);
+
+    std::stringstream trace;
+    tracer->writeChromeTrace(trace);
+    std::string json = trace.str();
+    size_t completeEvents = 0;
+    for (size_t i = json.find("\"ph\": \"X\""); i != std::string::npos; i = json.find("\"ph\": \"X\"", i + 1)) {
+        completeEvents++;
+    }
+    ASSERT_EQ(0u, json.find("{\"traceEvents\": ["));
+    ASSERT_EQ(tracer->getEventsCount(), completeEvents);
+
+    size_t events = tracer->getEventsCount();
+    tree.setTracer(nullptr);
+    tree.visit(&visitor);
+    ASSERT_EQ(events, tracer->getEventsCount());
+    tracer->clear();
+    ASSERT_EQ(0u, tracer->getEventsCount());
+}
+
+class OctreeCellCountVisitor : public OctreeVisitor<Point, Point, double> {
+public:
+    mutable unsigned int errors = 0;
+
+    virtual void visitBranch(const OctreeCell<Point, Point, double> * cell,
+                             const std::shared_ptr<OctreeCell<Point, Point, double> > childs[8]) const override {
+        unsigned int count = 0;
+        for (int i = 0; i < 8; ++i) {
+            ContinueVisit(childs[i]);
+            count += childs[i]->getItemsCount();
+        }
+        if (cell->getItemsCount() != count) {
+            errors++;
+        }
+    }
+
+    virtual void visitLeaf(const OctreeCell<Point, Point, double> * const cell,
+                           const std::vector<const Point *> &items) const override {
+        if (cell->getItemsCount() != items.size()) {
+            errors++;
+        }
+    }
+};
+
+TEST_F (OctreeTests, CellItemsCountTest) {
+    unsigned int pointsToProcess = std::min(points, (unsigned int)2000);
+    std::vector<Point> p(pointsToProcess);
+
+    std::fstream outputFile;
+    outputFile.open("test.txt", std::ios::in | std::ios::binary);
+    outputFile.read((char *) p.data(), pointsToProcess * sizeof(Point));
+    outputFile.close();
+
+    OctreePointAgentPosition agent;
+    OctreeCellCountVisitor visitor;
+    for (unsigned int threads : {1u, 4u}) {
+        Octree<Point, Point, double> tree(4, OctreeVec3<double>(0), 100, threads);
+        Octree<Point, Point, double> bulk(4, OctreeVec3<double>(0), 100, threads);
+        Octree<Point, Point, double> concurrent(4, OctreeVec3<double>(0), 100);
+        tree.insert(p.data(), pointsToProcess, &agent, nullptr, false);
+        // Duplicates are rejected and must not be counted
+        tree.insert(p.data(), pointsToProcess / 2, &agent, nullptr, false);
+        bulk.bulkInsert(p.data(), pointsToProcess, &agent);
+        for (unsigned int i = 0; i < pointsToProcess; ++i) {
+            concurrent.concurrentInsert(&p[i], &agent);
+        }
+        for (auto *octree : {&tree, &bulk, &concurrent}) {
+            octree->visit(&visitor);
+            ASSERT_EQ(0u, visitor.errors);
+            ASSERT_EQ(octree->forceGetItemsCount(), octree->getItemsCount());
+        }
+
+        // Removals collapse branches, updates move items between leaves
+        for (unsigned int i = 0; i < pointsToProcess; i += 3) {
+            ASSERT_TRUE(tree.remove(&p[i], &agent));
+        }
+        for (unsigned int i = 1; i < pointsToProcess; i += 3) {
+            Point previous = p[i];
+            p[i].position = glm::dvec3(0) - p[i].position;
+            ASSERT_TRUE(tree.update(&p[i], &previous, &agent));
+        }
+        tree.visit(&visitor);
+        ASSERT_EQ(0u, visitor.errors);
+        ASSERT_EQ(tree.forceGetItemsCount(), tree.getItemsCount());
+
+        for (int i = 0; i < 20; ++i) {
+            OctreeVec3<double> min(-100 + 5 * i, -60 + 3 * i, -90 + 8 * i);
+            OctreeVec3<double> max = min + OctreeVec3<double>(20 + 3 * i, 40, 25);
+            std::vector<const Point *> items;
+            tree.queryBox(min, max, &agent, items);
+            ASSERT_EQ(items.size(), tree.countBox(min, max, &agent));
+        }
+        ASSERT_EQ(tree.getItemsCount(), tree.countBox(OctreeVec3<double>(-100), OctreeVec3<double>(100), &agent));
+    }
+}
+
+TEST_F (OctreeTests, StaticAgentTest) {
+    unsigned int pointsToProcess = std::min(points, (unsigned int)2000);
+    OctreePointAgentAdjust agentAdjust;
+    OctreePointAgentPosition agentPosition;
+    OctreePointStaticAgent staticAgent;
+    OctreePointStaticAgentNoAdjust staticAgentNoAdjust;
+    Point *p = new Point[pointsToProcess];
+
+    std::fstream outputFile;
+    outputFile.open("test.txt", std::ios::in | std::ios::binary);
+    outputFile.read((char *) p, pointsToProcess * sizeof(Point));
+    outputFile.close();
+
+    o = new Octree<Point, Point, double>(8, OctreeVec3<double>(0), 0);
+    o2 = new Octree<Point, Point, double>(8, OctreeVec3<double>(0), 0);
+    o->insert(p, pointsToProcess, &agentAdjust);
+    o2->insert(p, pointsToProcess, &staticAgent);
+    ASSERT_EQ(o->getStringRepresentation(), o2->getStringRepresentation());
+
+    Octree<Point, Point, double> bulk(8, OctreeVec3<double>(0), 0, 4);
+    bulk.bulkInsert(p, pointsToProcess, &staticAgent);
+    ASSERT_EQ(o->getStringRepresentation(), bulk.getStringRepresentation());
+
+    Octree<Point, Point, double> threaded(8, OctreeVec3<double>(0), 0, 4);
+    threaded.insert(p, pointsToProcess, &staticAgent);
+    ASSERT_TRUE(*o == threaded);
+
+    // Without auto adjust methods the tree keeps its size and drops the items outside of it
+    Octree<Point, Point, double> noAdjust(8, OctreeVec3<double>(0), 50);
+    Octree<Point, Point, double> noAdjust2(8, OctreeVec3<double>(0), 50);
+    noAdjust.insert(p, pointsToProcess, &staticAgentNoAdjust);
+    noAdjust2.insert(p, pointsToProcess, &agentPosition);
+    ASSERT_EQ(noAdjust2.getItemsCount(), noAdjust.getItemsCount());
+    ASSERT_EQ(noAdjust2.getStringRepresentation(), noAdjust.getStringRepresentation());
+
+    std::vector<const Point *> items, items2;
+    o->queryBox(OctreeVec3<double>(-20), OctreeVec3<double>(35), &agentPosition, items);
+    o2->queryBox(OctreeVec3<double>(-20), OctreeVec3<double>(35), &staticAgent, items2);
+    ASSERT_TRUE(items == items2);
+    items.clear();
+    items2.clear();
+    o->queryRadius(OctreeVec3<double>(10, -5, 3), 30, &agentPosition, items);
+    o2->queryRadius(OctreeVec3<double>(10, -5, 3), 30, &staticAgent, items2);
+    ASSERT_TRUE(items == items2);
+    ASSERT_EQ(items.size(), o2->countRadius(OctreeVec3<double>(10, -5, 3), 30, &staticAgent));
+    ASSERT_TRUE(o->findKNearest(OctreeVec3<double>(1, 2, 3), 20, &agentPosition) ==
+                o2->findKNearest(OctreeVec3<double>(1, 2, 3), 20, &staticAgent));
+
+    Point previous = p[0];
+    p[0].position = glm::dvec3(-90, 90, -90);
+    ASSERT_TRUE(o2->update(&p[0], &previous, &staticAgent));
+    for (unsigned int i = 0; i < pointsToProcess; ++i) {
+        ASSERT_TRUE(o2->remove(&p[i], &staticAgent));
+    }
+    ASSERT_EQ(0, o2->getItemsCount());
+
+    delete []p;
+}
+
+TEST_F (OctreeTests, OctantAgentTest) {
+    unsigned int pointsToProcess = std::min(points, (unsigned int)2000);
+    const double grid[] = {-100, -75, -50, -25, -12.5, 0, 12.5, 25, 50, 75, 100};
+    std::vector<Point> p(pointsToProcess);
+
+    std::fstream outputFile;
+    outputFile.open("test.txt", std::ios::in | std::ios::binary);
+    outputFile.read((char *) p.data(), pointsToProcess * sizeof(Point));
+    outputFile.close();
+
+    // Points on the faces shared by cells have to land where the eight overlap tests put them
+    for (int x = 0; x < 11; ++x) {
+        for (int y = 0; y < 11; ++y) {
+            for (int z = 0; z < 11; ++z) {
+                Point point;
+                point.position = glm::dvec3(grid[x], grid[y], grid[z]);
+                point.mass = 1;
+                p.push_back(point);
+            }
+        }
+    }
+
+    OctreePointAgent agent;
+    OctreePointAgentOctant octantAgent;
+    OctreePointStaticAgent staticAgent;
+    const OctreeAgent<Point, Point, double> *baseAgent = &octantAgent;
+
+    Octree<Point, Point, double> expected(4, OctreeVec3<double>(0), 100);
+    expected.insert(p.data(), (unsigned int)p.size(), &agent);
+    std::string representation = expected.getStringRepresentation();
+
+    Octree<Point, Point, double> single(4, OctreeVec3<double>(0), 100);
+    for (auto &point : p) {
+        single.insert(&point, &octantAgent);
+    }
+    ASSERT_EQ(representation, single.getStringRepresentation());
+
+    Octree<Point, Point, double> batch(4, OctreeVec3<double>(0), 100);
+    batch.insert(p.data(), (unsigned int)p.size(), baseAgent, nullptr, false);
+    ASSERT_EQ(representation, batch.getStringRepresentation());
+
+    Octree<Point, Point, double> threaded(4, OctreeVec3<double>(0), 100, 4);
+    threaded.insert(p, &octantAgent);
+    ASSERT_TRUE(expected == threaded);
+
+    Octree<Point, Point, double> bulk(4, OctreeVec3<double>(0), 100, 4);
+    bulk.bulkInsert(p.data(), (unsigned int)p.size(), baseAgent, nullptr, false);
+    ASSERT_EQ(representation, bulk.getStringRepresentation());
+
+    Octree<Point, Point, double> bulkStatic(4, OctreeVec3<double>(0), 100);
+    bulkStatic.bulkInsert(p.data(), (unsigned int)p.size(), &staticAgent);
+    ASSERT_EQ(representation, bulkStatic.getStringRepresentation());
+
+    for (auto &point : p) {
+        ASSERT_TRUE(single.remove(&point, &octantAgent));
+        ASSERT_TRUE(bulkStatic.remove(&point, &staticAgent));
+    }
+    ASSERT_EQ(0, single.getItemsCount());
+    ASSERT_EQ(0, bulkStatic.getItemsCount());
+}
+
+TEST_F (OctreeTests, PerformanceSparseInsertTests) {
+    printf("Using %u threads\n", std::thread::hardware_concurrency());
+    o = new Octree<Point, Point, double>(8, OctreeVec3<double>(0), 100, 0);
+    o2 = new Octree<Point, Point, double>(8, OctreeVec3<double>(0), 100);
+
+    OctreePointAgent agent;
+    Point *p = new Point[points];
+    std::fstream outputFile;
+
+    outputFile.open("test.txt", std::ios::in | std::ios::binary);
+    outputFile.read((char *) p, points * sizeof(Point));
+    outputFile.close();
+
+
+    auto start2 = std::chrono::steady_clock::now();
+    o2->insert(p, points, &agent);
+    auto end2 = std::chrono::steady_clock::now();
+    auto diff2 = end2 - start2;
+    std::cout << "1 thread: " << std::chrono::duration<double, std::milli>(diff2).count() << " ms" << std::endl;
+
+
+    auto start = std::chrono::steady_clock::now();
+    o->insert(p, points, &agent);
+    auto end = std::chrono::steady_clock::now();
+    auto diff = end - start;
+    std::cout << "All threads: " << std::chrono::duration<double, std::milli>(diff).count() << " ms" << std::endl;
+
+    ASSERT_EQ(o->getItemsCount(), o2->getItemsCount());
+    ASSERT_EQ(o->forceGetItemsCount(), o2->forceGetItemsCount());
+    ASSERT_TRUE(*o == *o2);
+    delete []p;
+}
+
+TEST_F (OctreeTests, PerformanceSparseInsertAdjustTests) {
+    o = new Octree<Point, Point, double>(8, OctreeVec3<double>(0), 100, 0);
+    o2 = new Octree<Point, Point, double>(8, OctreeVec3<double>(0), 100);
+
+    auto oAdjust = new Octree<Point, Point, double>(8, OctreeVec3<double>(0), 0, 0);
+    auto o2Adjust = new Octree<Point, Point, double>(8, OctreeVec3<double>(0), 0);
+
+    OctreePointAgent agent;
+    OctreePointAgentAdjust agentAdjust;
+    Point *p = new Point[points];
+    std::fstream outputFile;
+
+    outputFile.open("test.txt", std::ios::in | std::ios::binary);
+    outputFile.read((char *) p, points * sizeof(Point));
+    outputFile.close();
+
+    auto start2 = std::chrono::steady_clock::now();
+    o2->insert(p, points, &agent);
+    auto end2 = std::chrono::steady_clock::now();
+    auto diff2 = end2 - start2;
+    std::cout << "1 thread: " << std::chrono::duration<double, std::milli>(diff2).count() << " ms" << std::endl;
+
+
+    auto start = std::chrono::steady_clock::now();
+    o->insert(p, points, &agent);
     auto end = std::chrono::steady_clock::now();
     auto diff = end - start;
     std::cout << "All threads: " << std::chrono::duration<double, std::milli>(diff).count() << " ms" << std::endl;
@@ -1328,6 +3424,172 @@ TEST_F (OctreeTests, PerformanceSparseInsertAdjustTests) {
     delete []p;
 }
 
+TEST_F (OctreeTests, PerformanceSparseBulkInsertTests) {
+    o = new Octree<Point, Point, double>(8, OctreeVec3<double>(0), 100);
+    o2 = new Octree<Point, Point, double>(8, OctreeVec3<double>(0), 100);
+
+    OctreePointAgent agent;
+    Point *p = new Point[points];
+    std::fstream outputFile;
+
+    outputFile.open("test.txt", std::ios::in | std::ios::binary);
+    outputFile.read((char *) p, points * sizeof(Point));
+    outputFile.close();
+
+    auto start2 = std::chrono::steady_clock::now();
+    o2->insert(p, points, &agent);
+    auto end2 = std::chrono::steady_clock::now();
+    auto diff2 = end2 - start2;
+    std::cout << "1 thread: " << std::chrono::duration<double, std::milli>(diff2).count() << " ms" << std::endl;
+
+    auto start = std::chrono::steady_clock::now();
+    o->bulkInsert(p, points, &agent);
+    auto end = std::chrono::steady_clock::now();
+    auto diff = end - start;
+    std::cout << "Bulk insert: " << std::chrono::duration<double, std::milli>(diff).count() << " ms" << std::endl;
+
+    auto oThreads = new Octree<Point, Point, double>(8, OctreeVec3<double>(0), 100, 0);
+    start = std::chrono::steady_clock::now();
+    oThreads->bulkInsert(p, points, &agent);
+    end = std::chrono::steady_clock::now();
+    diff = end - start;
+    std::cout << "Bulk insert all threads: " << std::chrono::duration<double, std::milli>(diff).count() << " ms" << std::endl;
+
+    ASSERT_EQ(o->getItemsCount(), o2->getItemsCount());
+    ASSERT_EQ(o->forceGetItemsCount(), o2->forceGetItemsCount());
+    ASSERT_TRUE(*o == *o2);
+    ASSERT_TRUE(*oThreads == *o2);
+
+    delete oThreads;
+    delete []p;
+}
+
+TEST_F (OctreeTests, PerformanceSparseStaticAgentInsertTests) {
+    o = new Octree<Point, Point, double>(8, OctreeVec3<double>(0), 100);
+    o2 = new Octree<Point, Point, double>(8, OctreeVec3<double>(0), 100);
+
+    OctreePointAgent agent;
+    OctreePointStaticAgentNoAdjust staticAgent;
+    Point *p = new Point[points];
+    std::fstream outputFile;
+
+    outputFile.open("test.txt", std::ios::in | std::ios::binary);
+    outputFile.read((char *) p, points * sizeof(Point));
+    outputFile.close();
+
+    auto start2 = std::chrono::steady_clock::now();
+    o2->insert(p, points, &agent);
+    auto end2 = std::chrono::steady_clock::now();
+    auto diff2 = end2 - start2;
+    std::cout << "Virtual agent: " << std::chrono::duration<double, std::milli>(diff2).count() << " ms" << std::endl;
+
+    auto start = std::chrono::steady_clock::now();
+    o->insert(p, points, &staticAgent);
+    auto end = std::chrono::steady_clock::now();
+    auto diff = end - start;
+    std::cout << "Static agent: " << std::chrono::duration<double, std::milli>(diff).count() << " ms" << std::endl;
+
+    OctreePointAgentOctant octantAgent;
+    Octree<Point, Point, double> oOctant(8, OctreeVec3<double>(0), 100);
+    start = std::chrono::steady_clock::now();
+    oOctant.insert(p, points, &octantAgent);
+    end = std::chrono::steady_clock::now();
+    diff = end - start;
+    std::cout << "Octant agent: " << std::chrono::duration<double, std::milli>(diff).count() << " ms" << std::endl;
+
+    ASSERT_EQ(o->getItemsCount(), o2->getItemsCount());
+    ASSERT_TRUE(*o == *o2);
+    ASSERT_TRUE(oOctant == *o2);
+    delete []p;
+}
+
+TEST_F (OctreeTests, PerformanceSparseRadiusQueryTests) {
+    o = new Octree<Point, Point, double>(8, OctreeVec3<double>(0), 100);
+    o2 = new Octree<Point, Point, double>(8, OctreeVec3<double>(0), 100);
+
+    OctreePointAgentPosition agent;
+    Point *p = new Point[points];
+    std::fstream outputFile;
+
+    outputFile.open("test.txt", std::ios::in | std::ios::binary);
+    outputFile.read((char *) p, points * sizeof(Point));
+    outputFile.close();
+
+    o->insert(p, points, &agent, nullptr, false);
+    o2->enableLeafPositions(&agent);
+    o2->insert(p, points, &agent, nullptr, false);
+
+    unsigned int queries = 10000;
+    unsigned int found = 0;
+    std::vector<const Point *> items;
+    auto start = std::chrono::steady_clock::now();
+    for (unsigned int i = 0; i < queries; ++i) {
+        items.clear();
+        auto &q = p[(i * 7919) % points].position;
+        o->queryRadius(OctreeVec3<double>(q.x, q.y, q.z), 5, &agent, items);
+        found += items.size();
+    }
+    auto end = std::chrono::steady_clock::now();
+    auto diff = end - start;
+    std::cout << "Item pointers: " << std::chrono::duration<double, std::milli>(diff).count() << " ms" << std::endl;
+
+    unsigned int foundWithPositions = 0;
+    start = std::chrono::steady_clock::now();
+    for (unsigned int i = 0; i < queries; ++i) {
+        items.clear();
+        auto &q = p[(i * 7919) % points].position;
+        o2->queryRadius(OctreeVec3<double>(q.x, q.y, q.z), 5, &agent, items);
+        foundWithPositions += items.size();
+    }
+    end = std::chrono::steady_clock::now();
+    diff = end - start;
+    std::cout << "Leaf positions: " << std::chrono::duration<double, std::milli>(diff).count() << " ms" << std::endl;
+
+    ASSERT_EQ(found, foundWithPositions);
+
+    // Same queries over items allocated one by one in a shuffled order, so items of a leaf lie far apart in memory
+    std::vector<std::unique_ptr<Point> > scattered(points);
+    for (unsigned int i = 0; i < points; ++i) {
+        size_t index = (size_t(i) * 7919) % points;
+        scattered[index].reset(new Point(p[index]));
+    }
+    Octree<Point, Point, double> scatteredTree(8, OctreeVec3<double>(0), 100);
+    Octree<Point, Point, double> scatteredTreeWithPositions(8, OctreeVec3<double>(0), 100);
+    scatteredTreeWithPositions.enableLeafPositions(&agent);
+    for (auto &item : scattered) {
+        scatteredTree.insert(item.get(), &agent);
+        scatteredTreeWithPositions.insert(item.get(), &agent);
+    }
+
+    unsigned int foundScattered = 0;
+    start = std::chrono::steady_clock::now();
+    for (unsigned int i = 0; i < queries; ++i) {
+        items.clear();
+        auto &q = p[(i * 7919) % points].position;
+        scatteredTree.queryRadius(OctreeVec3<double>(q.x, q.y, q.z), 5, &agent, items);
+        foundScattered += items.size();
+    }
+    end = std::chrono::steady_clock::now();
+    diff = end - start;
+    std::cout << "Scattered item pointers: " << std::chrono::duration<double, std::milli>(diff).count() << " ms" << std::endl;
+
+    unsigned int foundScatteredWithPositions = 0;
+    start = std::chrono::steady_clock::now();
+    for (unsigned int i = 0; i < queries; ++i) {
+        items.clear();
+        auto &q = p[(i * 7919) % points].position;
+        scatteredTreeWithPositions.queryRadius(OctreeVec3<double>(q.x, q.y, q.z), 5, &agent, items);
+        foundScatteredWithPositions += items.size();
+    }
+    end = std::chrono::steady_clock::now();
+    diff = end - start;
+    std::cout << "Scattered leaf positions: " << std::chrono::duration<double, std::milli>(diff).count() << " ms" << std::endl;
+
+    ASSERT_EQ(found, foundScattered);
+    ASSERT_EQ(found, foundScatteredWithPositions);
+    delete []p;
+}
+
 TEST_F (OctreeTests, PerformanceDenseInsertTests) {
     o = new Octree<Point, Point, double>(8, OctreeVec3<double>(0), 100, 0);
     o2 = new Octree<Point, Point, double>(8, OctreeVec3<double>(0), 100);